@@ -6,6 +6,7 @@
 #include "commandlineparser.h"
 #include "corelib/ddiskinfo.h"
 #include "corelib/dvirtualimagefileio.h"
+#include "corelib/dblockcodec.h"
 #include "corelib/helper.h"
 #include "dglobal.h"
 #include "fixboot/bootdoctor.h"
@@ -17,7 +18,14 @@ CommandLineParser::CommandLineParser()
     , o_dim_info("dim-info")
     , o_override(QStringList() << "O" << "override")
     , o_compress_level(QStringList() << "C" << "compress-level")
+    , o_compress_threads(QStringList() << "compress-threads")
+    , o_codec(QStringList() << "codec")
+    , o_block_size(QStringList() << "block-size")
+    , o_block_checksum("block-checksum")
+    , o_direct_io("direct-io")
     , o_buffer_size(QStringList() << "B" << "buffer-size")
+    , o_jobs(QStringList() << "j" << "jobs")
+    , o_device_jobs(QStringList() << "device-jobs")
     , o_non_ui("tui")
     , o_to_serial_url("to-serial-url")
     , o_from_serial_url("from-serial-url")
@@ -32,6 +40,7 @@ CommandLineParser::CommandLineParser()
     , o_auto_fix_boot(QStringList() << "auto-fix-boot")
     , o_write_custom_file(QStringList() << "write-custom-file")
     , o_read_custom_file(QStringList() << "read-custom-file")
+    , o_verify("verify")
 {
     o_info.setDescription("Get the device info.");
     o_dim_info.setDescription("Get the dim file info.");
@@ -39,9 +48,26 @@ CommandLineParser::CommandLineParser()
     o_compress_level.setDescription("Output to the dim file when the data compression level.");
     o_compress_level.setValueName("Compress Level");
     o_compress_level.setDefaultValue(QString::number(Global::compressionLevel));
+    o_compress_threads.setDescription("The number of threads used to compress the dim file data, 0 is the number of processor cores.");
+    o_compress_threads.setValueName("Threads");
+    o_compress_threads.setDefaultValue(QString::number(Global::compressionThreads));
+    o_codec.setDescription("The codec used to compress the dim file data[zlib|zstd|zstd-long|lz4].");
+    o_codec.setValueName("Codec");
+    o_codec.setDefaultValue(DBlockCodec::typeName(DBlockCodec::Type(Global::compressionCodec), Global::compressionLongMode));
+    o_block_size.setDescription("The size of the dim file data blocks, from 262144 to 16777216 bytes, auto is tuned for the codec and the number of threads.");
+    o_block_size.setValueName("Block Size");
+    o_block_size.setDefaultValue("auto");
+    o_block_checksum.setDescription("Store a CRC32C checksum in every block of the dim file data, checked before the block is uncompressed.");
+    o_direct_io.setDescription("Read and write the dim file data with direct I/O, without filling the page cache.");
     o_buffer_size.setDescription("The size of the buffer when data is transferred.");
     o_buffer_size.setValueName("Buffer Size");
     o_buffer_size.setDefaultValue(QString::number(Global::bufferSize));
+    o_jobs.setDescription("The maximum number of partitions cloned at the same time.");
+    o_jobs.setValueName("Jobs");
+    o_jobs.setDefaultValue(QString::number(Global::cloneJobs));
+    o_device_jobs.setDescription("The maximum number of partitions cloned at the same time on one device, 0 is no limit.");
+    o_device_jobs.setValueName("Jobs");
+    o_device_jobs.setDefaultValue(QString::number(Global::deviceJobs));
     o_non_ui.setDescription("Run in TUI mode.");
     o_to_serial_url.setDescription("File path format to serial url format.");
     o_to_serial_url.setValueName("File Path");
@@ -67,6 +93,8 @@ CommandLineParser::CommandLineParser()
     o_auto_fix_boot.setDescription("Auto fix the partition bootloader on the clone/restore job finished.");
     o_write_custom_file.setDescription("Write custom file data into dim file. Source file format: dim://example.dim/custom");
     o_read_custom_file.setDescription("Read data from custom file. Source file format: dim://example.dim/custom");
+    o_verify.setDescription("Check all the data of the dim file against its hash tree, the blocks are checked by the compression threads. An entry without a hash tree fails the check.");
+    o_verify.setValueName("File Path");
 
     QDir::current().mkpath(QStandardPaths::writableLocation(QStandardPaths::CacheLocation));
 
@@ -75,7 +103,14 @@ CommandLineParser::CommandLineParser()
     parser.addOption(o_override);
     parser.addOption(o_buffer_size);
     parser.addOption(o_compress_level);
+    parser.addOption(o_compress_threads);
+    parser.addOption(o_codec);
+    parser.addOption(o_block_size);
+    parser.addOption(o_block_checksum);
+    parser.addOption(o_direct_io);
     parser.addOption(o_buffer_size);
+    parser.addOption(o_jobs);
+    parser.addOption(o_device_jobs);
     parser.addOption(o_non_ui);
     parser.addOption(o_to_serial_url);
     parser.addOption(o_from_serial_url);
@@ -90,6 +125,7 @@ CommandLineParser::CommandLineParser()
     parser.addOption(o_auto_fix_boot);
     parser.addOption(o_write_custom_file);
     parser.addOption(o_read_custom_file);
+    parser.addOption(o_verify);
     parser.addHelpOption();
     parser.addVersionOption();
 
@@ -99,6 +135,7 @@ CommandLineParser::CommandLineParser()
     parser.setApplicationDescription(QString("e.g(path):   %1 /dev/sda ~/sda.dim\n"
                                              "             %1 /dev/sda /dev/sdb\n"
                                              "             %1 ~/sda.dim /dev/sda\n\n"
+                                             "e.g(stream): %1 /dev/sda - | %1 - /dev/sdb\n\n"
                                              "e.g(serial): %1 serial://W530B6RT ~/W530B6RT.dim\n"
                                              "             %1 serial://W530B6RT:1 serial://W530B6RT:2\n"
                                              "             %1 serial://W530B6RT.dim serial://W530B6RT:0").arg(qApp->applicationName()));
@@ -118,6 +155,8 @@ void CommandLineParser::parse()
 {
     Global::isOverride = parser.isSet(o_override);
     Global::disableMD5CheckForDimFile = parser.isSet(o_disable_check_dim);
+    Global::blockChecksum = parser.isSet(o_block_checksum);
+    Global::directIO = parser.isSet(o_direct_io);
     Global::disableLoopDevice = !parser.isSet(o_loop_device);
     Global::fixBoot = parser.isSet(o_auto_fix_boot);
 
@@ -141,6 +180,62 @@ void CommandLineParser::parse()
         }
     }
 
+    if (parser.isSet(o_compress_threads)) {
+        bool ok = false;
+
+        Global::compressionThreads = parser.value(o_compress_threads).toInt(&ok);
+
+        if (!ok || Global::compressionThreads < 0) {
+            parser.showHelp(EXIT_FAILURE);
+        }
+    }
+
+    if (parser.isSet(o_codec)) {
+        bool ok = false;
+
+        Global::compressionCodec = DBlockCodec::typeFromName(parser.value(o_codec), &Global::compressionLongMode, &ok);
+
+        if (!ok) {
+            parser.showHelp(EXIT_FAILURE);
+        }
+    }
+
+    if (parser.isSet(o_block_size)) {
+        const QString &value = parser.value(o_block_size);
+
+        if (value == "auto") {
+            Global::compressionBlockSize = 0;
+        } else {
+            bool ok = false;
+
+            Global::compressionBlockSize = value.toInt(&ok);
+
+            if (!ok || Global::compressionBlockSize < 256 * 1024 || Global::compressionBlockSize > 16 * 1024 * 1024) {
+                parser.showHelp(EXIT_FAILURE);
+            }
+        }
+    }
+
+    if (parser.isSet(o_jobs)) {
+        bool ok = false;
+
+        Global::cloneJobs = parser.value(o_jobs).toInt(&ok);
+
+        if (!ok || Global::cloneJobs <= 0) {
+            parser.showHelp(EXIT_FAILURE);
+        }
+    }
+
+    if (parser.isSet(o_device_jobs)) {
+        bool ok = false;
+
+        Global::deviceJobs = parser.value(o_device_jobs).toInt(&ok);
+
+        if (!ok || Global::deviceJobs < 0) {
+            parser.showHelp(EXIT_FAILURE);
+        }
+    }
+
     if (parser.isSet(o_debug_level)) {
         bool ok = false;
 
@@ -177,11 +272,20 @@ void CommandLineParser::parse()
             ::exit(EXIT_FAILURE);
         }
 
+        printf("Version: %d\n\n", io.version());
+
         for (const QString &file : io.fileList()) {
             printf("File Name: %s\n", qPrintable(file));
             printf("Size: %s (%lld bytes)\n", qPrintable(Helper::sizeDisplay(io.size(file))), io.size(file));
             printf("Data Start: %lld\n", io.start(file));
-            printf("Data End: %lld\n\n", io.end(file));
+            printf("Data End: %lld\n", io.end(file));
+
+            const QVariantMap &attributes = io.attributes(file);
+
+            for (auto i = attributes.constBegin(); i != attributes.constEnd(); ++i)
+                printf("%s: %s\n", qPrintable(i.key()), qPrintable(i.value().toString()));
+
+            printf("\n");
         }
 
         ::exit(EXIT_SUCCESS);
@@ -214,6 +318,8 @@ void CommandLineParser::parse()
         }
         bool isOK = Helper::writeCustomFile(source(), target());
         isOK ? ::exit(EXIT_SUCCESS) : ::exit(EXIT_FAILURE);
+    } else if (parser.isSet(o_verify)) {
+        Helper::verifyDimFile(parser.value(o_verify)) ? ::exit(EXIT_SUCCESS) : ::exit(EXIT_FAILURE);
     } else if (parser.isSet(o_read_custom_file)) {
         if (source().isEmpty()) {
             fputs(qPrintable("The source file is empty!\n"), stderr);
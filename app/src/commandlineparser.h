@@ -32,7 +32,14 @@ private:
     QCommandLineOption o_dim_info;
     QCommandLineOption o_override;
     QCommandLineOption o_compress_level;
+    QCommandLineOption o_compress_threads;
+    QCommandLineOption o_codec;
+    QCommandLineOption o_block_size;
+    QCommandLineOption o_block_checksum;
+    QCommandLineOption o_direct_io;
     QCommandLineOption o_buffer_size;
+    QCommandLineOption o_jobs;
+    QCommandLineOption o_device_jobs;
     QCommandLineOption o_non_ui;
     QCommandLineOption o_to_serial_url;
     QCommandLineOption o_from_serial_url;
@@ -47,6 +54,7 @@ private:
     QCommandLineOption o_auto_fix_boot;
     QCommandLineOption o_write_custom_file;
     QCommandLineOption o_read_custom_file;
+    QCommandLineOption o_verify;
 };
 
 #endif // COMMANDLINEPARSER_H
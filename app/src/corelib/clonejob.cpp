@@ -7,16 +7,28 @@
 #include "ddiskinfo.h"
 #include "ddevicediskinfo.h"
 #include "dfilediskinfo.h"
+#include "dstreamdiskinfo.h"
 #include "helper.h"
+#include "dbufferqueue.h"
 #ifdef ENABLE_BOOTDOCTOR
 #include "bootdoctor.h"
 #endif
 
 #include <QDir>
 #include <QElapsedTimer>
+#include <QSemaphore>
+#include <QScopedPointer>
+#include <QMutex>
+#include <QWaitCondition>
 
 #include <functional>
 
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+
 CloneJob::CloneJob(QObject *parent)
     : QThread(parent)
     , m_status(Stoped)
@@ -82,54 +94,54 @@ QString CloneJob::errorString() const
 
 typedef std::function<bool(qint64 accomplishBytes, int)> PipeNotifyFunction;
 
-static bool diskInfoPipe(DDiskInfo &from, DDiskInfo &to, DDiskInfo::DataScope scope,
-                         int fromIndex = 0, int toIndex = 0, QString *error = 0, PipeNotifyFunction *notify = 0)
+#define PIPE_BUFFER_COUNT 4
+
+static bool readToQueue(DDiskInfo &from, DBufferQueue *queue, QString *error)
 {
-    bool ok = false;
-    char block[Global::bufferSize];
-    QElapsedTimer elapsedTimer;
-    int speed = 10000000;
-    qint64 total_size = 0;
+    while (!from.atEnd()) {
+        DBufferQueue::Buffer *buffer = queue->acquire();
 
-    if (!from.beginScope(scope, DDiskInfo::Read, fromIndex)) {
-        if (error)
-            *error = from.errorString();
+        // aborted by the writer
+        if (!buffer)
+            return false;
 
-        dCDebug("BeginScope failed, scope: %d, index: %d, mode: Read", scope, fromIndex);
+        buffer->size = from.read(buffer->data, queue->bufferSize());
 
-        goto exit;
-    }
+        if (buffer->size <= 0) {
+            *error = from.errorString();
 
-    if (!to.beginScope(scope, DDiskInfo::Write, toIndex)) {
-        if (error)
-            *error = to.errorString();
+            dCError("Reading data from \"%1\" failed, error: %2", qPrintable(from.filePath()), qPrintable(from.errorString()));
 
-        dCDebug("BeginScope failed, scope: %d, index: %d, mode: Write", scope, toIndex);
+            queue->release(buffer);
 
-        goto exit;
-    }
+            return false;
+        }
 
-    elapsedTimer.start();
+        queue->push(buffer);
+    }
 
-    while (!from.atEnd()) {
-        qint64 read_size = from.read(block, Global::bufferSize);
+    return true;
+}
 
-        if (read_size <= 0) {
-            if (error)
-                *error = from.errorString();
+static bool writeFromQueue(DDiskInfo &to, DBufferQueue *queue, QString *error, PipeNotifyFunction *notify)
+{
+    QElapsedTimer elapsedTimer;
+    int speed = 10000000;
+    qint64 total_size = 0;
 
-            dCError("Reading data from \"%1\" failed, error: %2", qPrintable(from.filePath()), qPrintable(from.errorString()));
+    elapsedTimer.start();
 
-            goto exit;
-        }
+    while (DBufferQueue::Buffer *buffer = queue->pop()) {
+        const qint64 read_size = buffer->size;
+        qint64 write_size = to.write(buffer->data, read_size);
 
-        qint64 write_size = to.write(block, read_size);
+        queue->release(buffer);
 
         if (write_size < read_size) {
             if (error)
                 *error = QCoreApplication::translate("CloneJob", "Writing data to %1 failed, expected write size: %2 — only %3 written, error: %4").arg(to.filePath()).arg(read_size).arg(write_size).arg(to.errorString());
 
-            goto exit;
+            return false;
         }
 
         if (notify)
@@ -142,13 +154,227 @@ static bool diskInfoPipe(DDiskInfo &from, DDiskInfo &to, DDiskInfo::DataScope sc
             speed = total_size / (qreal)elapsedTimer.elapsed() * 1000;
     }
 
-    ok = true;
+    // aborted by the reader
+    return !queue->isAborted();
+}
+
+#define PIPE_OUTPUT_TAIL 4096
 
-exit:
+// waits until the fd is ready, the output pipes are drained meanwhile and their last bytes kept for the
+// error message, errno is ECANCELED if the job is aborted
+static bool waitForPipe(int fd, short events, QList<int> *outputs, QByteArray *outputTail, PipeNotifyFunction *notify, int speed)
+{
+    forever {
+        QVector<pollfd> fds;
+
+        fds.append({fd, events, 0});
+
+        for (int output : *outputs)
+            fds.append({output, POLLIN, 0});
+
+        int count = poll(fds.data(), fds.size(), 1000);
+
+        if (count < 0) {
+            if (errno == EINTR)
+                continue;
+
+            return false;
+        }
+
+        // checks whether the job is aborted while a process stalls
+        if (count == 0) {
+            if (notify && !(*notify)(0, speed)) {
+                errno = ECANCELED;
+
+                return false;
+            }
+
+            continue;
+        }
+
+        for (int i = 1; i < fds.size(); ++i) {
+            if (!(fds.at(i).revents & (POLLIN | POLLHUP | POLLERR)))
+                continue;
+
+            char data[PIPE_OUTPUT_TAIL];
+            const ssize_t size = ::read(fds.at(i).fd, data, sizeof(data));
+
+            if (size > 0) {
+                outputTail->append(data, size);
+                outputTail->remove(0, qMax(0, outputTail->size() - PIPE_OUTPUT_TAIL));
+            } else if (size == 0 || errno != EAGAIN) {
+                outputs->removeOne(fds.at(i).fd);
+            }
+        }
+
+        // splice reports the end of the data or the error
+        if (fds.first().revents)
+            return true;
+    }
+}
+
+static bool splicePipe(int in, int out, QList<int> outputs, QString *error, PipeNotifyFunction *notify)
+{
+    QElapsedTimer elapsedTimer;
+    QByteArray output_tail;
+    int speed = 10000000;
+    qint64 total_size = 0;
+    bool ok = true;
+    sigset_t sigpipe;
+    sigset_t old_mask;
+
+    // a target exiting before the end must fail the splice with EPIPE instead of killing the process
+    sigemptyset(&sigpipe);
+    sigaddset(&sigpipe, SIGPIPE);
+    pthread_sigmask(SIG_BLOCK, &sigpipe, &old_mask);
+
+    elapsedTimer.start();
+
+    forever {
+        const ssize_t size = splice(in, NULL, out, NULL, Global::bufferSize, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+
+        if (size > 0) {
+            if (notify && !(*notify)(size, speed)) {
+                ok = false;
+                break;
+            }
+
+            total_size += size;
+
+            if (elapsedTimer.elapsed() > 0)
+                speed = total_size / (qreal)elapsedTimer.elapsed() * 1000;
+
+            continue;
+        }
+
+        // the source closed its standard output
+        if (size == 0)
+            break;
+
+        if (errno == EINTR)
+            continue;
+
+        if (errno == EAGAIN) {
+            // either the source has no data or the target has no room, wait for one after the other
+            if (waitForPipe(in, POLLIN, &outputs, &output_tail, notify, speed)
+                    && waitForPipe(out, POLLOUT, &outputs, &output_tail, notify, speed))
+                continue;
+
+            if (errno == ECANCELED) {
+                ok = false;
+                break;
+            }
+        }
+
+        const QString splice_error = strerror(errno);
 
-    if (!from.endScope()) {
         if (error)
-            *error = from.errorString();
+            *error = QCoreApplication::translate("CloneJob", "Moving data between the processes failed, error: %1, output: %2").arg(splice_error).arg(QString::fromUtf8(output_tail));
+
+        dCError("Splice failed after %lld bytes, error: %s", total_size, qPrintable(splice_error));
+
+        ok = false;
+        break;
+    }
+
+    const timespec no_wait = {0, 0};
+
+    // drop the SIGPIPE raised while it was blocked
+    while (sigtimedwait(&sigpipe, NULL, &no_wait) > 0);
+
+    pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+
+    dCDebug("Spliced %lld bytes between the processes", total_size);
+
+    return ok;
+}
+
+static bool diskInfoPipe(DDiskInfo &from, DDiskInfo &to, DDiskInfo::DataScope scope,
+                         int fromIndex = 0, int toIndex = 0, QString *error = 0, PipeNotifyFunction *notify = 0)
+{
+    bool ok = false;
+    bool from_opened = false;
+    bool read_ok = false;
+    bool spliced = false;
+    QString read_error;
+    QSemaphore reader_started;
+    QSemaphore reader_continue;
+    DBufferQueue queue(PIPE_BUFFER_COUNT, Global::bufferSize);
+
+    // The source is read on its own thread and handed over through a bounded queue of
+    // reusable buffers, so the source is filling the next block while the target drains.
+    // The scope is opened on the reader thread too, the source is only used by one thread.
+    QScopedPointer<QThread> reader(QThread::create([&] {
+        from_opened = from.beginScope(scope, DDiskInfo::Read, fromIndex);
+
+        if (from_opened) {
+            reader_started.release();
+            // after the target is opened, or after the splice has finished
+            reader_continue.acquire();
+            // the splice errors are reported by the writer side
+            read_ok = spliced || readToQueue(from, &queue, &read_error);
+
+            // the splice has seen the end of the data, the closed pipe is probed without blocking
+            // so the source knows it finished and endScope() checks its exit status
+            if (spliced && ok)
+                from.atEnd();
+        } else {
+            read_error = from.errorString();
+
+            dCDebug("BeginScope failed, scope: %d, index: %d, mode: Read", scope, fromIndex);
+
+            reader_started.release();
+        }
+
+        if (!from.endScope()) {
+            read_error = from.errorString();
+            read_ok = false;
+        }
+
+        if (read_ok)
+            queue.finish();
+        else
+            queue.abort();
+    }));
+
+    reader->start();
+    reader_started.acquire();
+
+    if (from_opened) {
+        if (to.beginScope(scope, DDiskInfo::Write, toIndex)) {
+            QList<int> outputs;
+            const int in = from.streamDescriptor(&outputs);
+            const int out = in < 0 ? -1 : to.streamDescriptor(&outputs);
+
+            // both sides are processes, such as partclone and partclone.restore of a disk to disk clone,
+            // the reader thread is parked meanwhile, only the pipes are used from here
+            if (out >= 0) {
+                spliced = true;
+                ok = splicePipe(in, out, outputs, error, notify);
+                reader_continue.release();
+            } else {
+                reader_continue.release();
+                ok = writeFromQueue(to, &queue, error, notify);
+            }
+        } else {
+            reader_continue.release();
+
+            if (error)
+                *error = to.errorString();
+
+            dCDebug("BeginScope failed, scope: %d, index: %d, mode: Write", scope, toIndex);
+        }
+    }
+
+    // wake up the reader if it is waiting for a free buffer
+    if (!ok)
+        queue.abort();
+
+    reader->wait();
+
+    if (!read_ok) {
+        if (error && !read_error.isEmpty())
+            *error = read_error;
 
         ok = false;
     }
@@ -173,7 +399,11 @@ void CloneJob::run()
 
     dCInfo("Clone job start, source: %s, target: %s", qPrintable(m_from), qPrintable(m_to));
 
-    if (!QFile::exists(m_from)) {
+    const bool stream_target = DStreamDiskInfo::isStreamFile(m_to);
+    // the image data goes to the standard output, the progress to the standard error
+    FILE *out = stream_target ? stderr : stdout;
+
+    if (!DStreamDiskInfo::isStreamFile(m_from) && !QFile::exists(m_from)) {
         setErrorString(tr("%1 not exist").arg(m_from));
 
         return;
@@ -205,7 +435,7 @@ void CloneJob::run()
                 return;
             }
         }
-    } else if (Global::isOverride) {
+    } else if (Global::isOverride && !stream_target) {
         QFile file(m_to);
 
         if (!file.resize(0)) {
@@ -213,7 +443,7 @@ void CloneJob::run()
         }
     }
 
-    DDiskInfo to_info = DDiskInfo::getInfo(m_to);
+    DDiskInfo to_info = DDiskInfo::getInfo(m_to, DDiskInfo::Write);
 
     if (!to_info) {
         setErrorString(tr("%1 invalid or not exist").arg(m_to));
@@ -244,7 +474,7 @@ void CloneJob::run()
 
     qint8 progress = 0;
 
-    PipeNotifyFunction print_fun = [from_info_total_data_size, &have_been_written, &progress, this] (qint64 accomplishBytes, int speed) {
+    PipeNotifyFunction print_fun = [from_info_total_data_size, &have_been_written, &progress, out, this] (qint64 accomplishBytes, int speed) {
         if (m_abort)
             return false;
 
@@ -258,9 +488,9 @@ void CloneJob::run()
         m_estimateTime = from_info_total_data_size / (qreal)speed * (1 - m_progress);
 
         if (Global::isTUIMode) {
-            printf("\033[A");
-            fflush(stdout);
-            printf("----%lld bytes of data have been written, total progress: %f----\n", have_been_written, m_progress * 100);
+            fprintf(out, "\033[A");
+            fflush(out);
+            fprintf(out, "----%lld bytes of data have been written, total progress: %f----\n", have_been_written, m_progress * 100);
         } else if (progress != (int)(m_progress * 100)) {
             progress = m_progress * 100;
             dCDebug("----%lld bytes of data have been written, total progress: %d----", have_been_written, progress);
@@ -271,23 +501,50 @@ void CloneJob::run()
         return true;
     };
 
-    auto call_disk_pipe = [&print_fun, this, &from_info, &to_info] (DDiskInfo::DataScope scope, int fromIndex = 0, int toIndex = 0) {
+    auto call_disk_pipe = [&print_fun, out, this, &from_info, &to_info] (DDiskInfo::DataScope scope, int fromIndex = 0, int toIndex = 0) {
         QString error;
 
-        printf("\n");
+        fprintf(out, "\n");
 
         if (!diskInfoPipe(from_info, to_info, scope, fromIndex, toIndex, &error, &print_fun)) {
             setErrorString(error);
-            printf("\n");
+            fprintf(out, "\n");
 
             return false;
         }
 
-        printf("\n");
+        fprintf(out, "\n");
 
         return true;
     };
 
+    auto clone_json_info = [&call_disk_pipe, this] {
+        setStatus(Save_Info);
+
+        dCInfo("begin clone json info\n");
+
+        if (!call_disk_pipe(DDiskInfo::JsonInfo)) {
+            dCDebug("failed!!!");
+            setStatus(Failed);
+
+            return false;
+        }
+
+        return true;
+    };
+
+    // a stream is read in the order it was written, the reader needs the disk info before the data
+    if (stream_target) {
+        if (!from_info.hasScope(DDiskInfo::JsonInfo)) {
+            setErrorString(tr("%1 has no disk info to stream").arg(m_from));
+
+            return;
+        }
+
+        if (!clone_json_info())
+            return;
+    }
+
     if (from_info.hasScope(DDiskInfo::Headgear)) {
         setStatus(Clone_Headgear);
 
@@ -314,12 +571,32 @@ void CloneJob::run()
         }
     }
 
-    const QList<DPartInfo> &list = from_info.childrenPartList();
+    QList<DPartInfo> list;
 
-    for (const DPartInfo &info : list) {
-        if (!from_info.hasScope(DDiskInfo::Partition, DDiskInfo::Read, info.indexNumber()))
-            continue;
+    for (const DPartInfo &info : from_info.childrenPartList()) {
+        if (from_info.hasScope(DDiskInfo::Partition, DDiskInfo::Read, info.indexNumber()))
+            list << info;
+    }
 
+    // the entries of a dim file are written next to each other in extents, a stream can only be read in order
+    if (Global::cloneJobs > 1 && list.count() > 1
+            && (Helper::isBlockSpecialFile(m_to) || to_info.typeName() == "dim")
+            && !DStreamDiskInfo::isStreamFile(m_from)) {
+        setStatus(Clone_Partition);
+
+        dCInfo("begin clone %d partitions, jobs: %d......................\n", list.count(), Global::cloneJobs);
+
+        if (!clonePartitions(list, print_fun)) {
+            dCDebug("failed!!!");
+            setStatus(Failed);
+
+            return;
+        }
+
+        list.clear();
+    }
+
+    for (const DPartInfo &info : list) {
         setStatus(Clone_Partition);
 
         dCInfo("begin clone partition, index: %d......................\n", info.indexNumber());
@@ -340,17 +617,9 @@ void CloneJob::run()
         }
     }
 
-    if (from_info.hasScope(DDiskInfo::JsonInfo) && to_info.hasScope(DDiskInfo::JsonInfo, DDiskInfo::Write)) {
-        setStatus(Save_Info);
-
-        dCInfo("begin clone json info\n");
-
-        if (!call_disk_pipe(DDiskInfo::JsonInfo)) {
-            dCDebug("failed!!!");
-            setStatus(Failed);
-
+    if (!stream_target && from_info.hasScope(DDiskInfo::JsonInfo) && to_info.hasScope(DDiskInfo::JsonInfo, DDiskInfo::Write)) {
+        if (!clone_json_info())
             return;
-        }
     }
 
     m_estimateTime = 0;
@@ -381,6 +650,158 @@ void CloneJob::run()
     dCInfo("Total time: %s, Total data: %s", qPrintable(Helper::secondsToString(timer.elapsed() / 1000)), qPrintable(Helper::sizeDisplay(have_been_written)));
 }
 
+bool CloneJob::clonePartitions(const QList<DPartInfo> &list, const PipeNotifyFunction &notify)
+{
+    QMutex mutex;
+    QWaitCondition slot_released;
+    QMap<QString, int> device_jobs;
+    QList<DPartInfo> pending = list;
+    bool failed = false;
+    qint64 total_written = 0;
+    QElapsedTimer timer;
+
+    const int max_device_jobs = Global::deviceJobs > 0 ? Global::deviceJobs : Global::cloneJobs;
+
+    auto source_device = [this] (const DPartInfo &info) {
+        return info.parentDiskFilePath().isEmpty() ? m_from : info.parentDiskFilePath();
+    };
+
+    // take the first pending partition whose source and target device both have a free slot
+    auto take_partition = [&] (DPartInfo *part) {
+        QMutexLocker locker(&mutex);
+
+        forever {
+            if (failed || m_abort || pending.isEmpty())
+                return false;
+
+            for (int i = 0; i < pending.count(); ++i) {
+                const QString &from_device = source_device(pending.at(i));
+
+                if (device_jobs.value(from_device) >= max_device_jobs
+                        || device_jobs.value(m_to) >= max_device_jobs) {
+                    continue;
+                }
+
+                *part = pending.takeAt(i);
+                ++device_jobs[from_device];
+                ++device_jobs[m_to];
+
+                return true;
+            }
+
+            slot_released.wait(&mutex);
+        }
+    };
+
+    auto clone_partition = [&] (const DPartInfo &part) {
+        const int index = part.indexNumber();
+        const qint64 part_total = qMax(part.usedSize(), qint64(1));
+        qint64 part_written = 0;
+        int part_progress = -1;
+        QString error;
+
+        // every stream needs its own device objects, a DDiskInfo can only open one scope at a time
+        DDiskInfo from = DDiskInfo::getInfo(m_from);
+        DDiskInfo to = DDiskInfo::getInfo(m_to);
+
+        if (!from || !to) {
+            QMutexLocker locker(&mutex);
+
+            setErrorString(tr("%1 invalid or not exist").arg(!from ? m_from : m_to));
+
+            return false;
+        }
+
+        PipeNotifyFunction part_notify = [&] (qint64 accomplishBytes, int speed) {
+            Q_UNUSED(speed)
+
+            part_written += accomplishBytes;
+
+            const qreal progress = qMin(part_written / (qreal)part_total, 1.0);
+
+            if (part_progress != (int)(progress * 100)) {
+                part_progress = progress * 100;
+
+                emit partitionProgressChanged(index, progress);
+            }
+
+            QMutexLocker locker(&mutex);
+
+            if (failed)
+                return false;
+
+            total_written += accomplishBytes;
+
+            int total_speed = 10000000;
+
+            if (timer.elapsed() > 0)
+                total_speed = total_written / (qreal)timer.elapsed() * 1000;
+
+            return notify(accomplishBytes, total_speed);
+        };
+
+        dCInfo("begin clone partition, index: %d......................\n", index);
+
+        if (!diskInfoPipe(from, to, DDiskInfo::Partition, index, index, &error, &part_notify)) {
+            QMutexLocker locker(&mutex);
+
+            // the other jobs are stopped by the first failure
+            if (!failed && !m_abort)
+                setErrorString(error);
+
+            return false;
+        }
+
+        Helper::processExec("fsck", {"-f", "-y", QString::number(index)});
+
+        if (part.fileSystemType() == DPartInfo::EXT4
+                || part.fileSystemType() == DPartInfo::EXT3
+                || part.fileSystemType() == DPartInfo::EXT2) {
+            Helper::processExec("resize2fs", {"-p", "-f", QString::number(index)});
+        }
+
+        dCInfo("clone partition finished, index: %d", index);
+
+        return true;
+    };
+
+    auto worker = [&] {
+        DPartInfo part;
+
+        while (take_partition(&part)) {
+            bool ok = clone_partition(part);
+
+            QMutexLocker locker(&mutex);
+
+            --device_jobs[source_device(part)];
+            --device_jobs[m_to];
+
+            if (!ok)
+                failed = true;
+
+            slot_released.wakeAll();
+        }
+    };
+
+    QList<QThread*> threads;
+
+    timer.start();
+
+    for (int i = 0; i < qMin(Global::cloneJobs, list.count()); ++i) {
+        QThread *thread = QThread::create(worker);
+
+        thread->start();
+        threads << thread;
+    }
+
+    for (QThread *thread : threads) {
+        thread->wait();
+        delete thread;
+    }
+
+    return !failed && !m_abort;
+}
+
 void CloneJob::setStatus(CloneJob::Status s)
 {
     if (s == m_status)
@@ -8,6 +8,9 @@
 
 #include <QThread>
 
+#include <functional>
+
+class DPartInfo;
 class CloneJob : public QThread
 {
     Q_OBJECT
@@ -41,6 +44,8 @@ signals:
     void failed(const QString &error);
     void finished();
     void progressChanged(qreal progress);
+    // only emitted when the partitions are cloned at the same time
+    void partitionProgressChanged(int index, qreal progress);
 
 private:
     using QThread::start;
@@ -50,6 +55,8 @@ private:
     void setStatus(Status s);
     void setErrorString(const QString &error);
 
+    bool clonePartitions(const QList<DPartInfo> &list, const std::function<bool(qint64, int)> &notify);
+
     Status m_status;
     bool m_abort = false;
 
@@ -0,0 +1,235 @@
+// SPDX-FileCopyrightText: 2022 UnionTech Software Technology Co., Ltd.
+//
+// SPDX-License-Identifier: GPL-3.0-only
+
+#include "dblockcodec.h"
+
+#include <zstd.h>
+#include <lz4.h>
+#include <lz4hc.h>
+
+class DNoneCodec : public DBlockCodec
+{
+public:
+    DNoneCodec()
+        : DBlockCodec(None, 0) {}
+
+    QByteArray compress(const QByteArray &data) const Q_DECL_OVERRIDE
+    {
+        return data;
+    }
+
+    QByteArray uncompress(const QByteArray &data, int size) const Q_DECL_OVERRIDE
+    {
+        Q_UNUSED(size)
+
+        return data;
+    }
+};
+
+// the format written by qCompress, compatible with the version 1 dim files
+class DZlibCodec : public DBlockCodec
+{
+public:
+    explicit DZlibCodec(int level)
+        : DBlockCodec(Zlib, level) {}
+
+    QByteArray compress(const QByteArray &data) const Q_DECL_OVERRIDE
+    {
+        return qCompress(data, level());
+    }
+
+    QByteArray uncompress(const QByteArray &data, int size) const Q_DECL_OVERRIDE
+    {
+        Q_UNUSED(size)
+
+        return qUncompress(data);
+    }
+};
+
+class DZstdCodec : public DBlockCodec
+{
+public:
+    DZstdCodec(int level, bool longMode)
+        : DBlockCodec(Zstd, level)
+        , m_longMode(longMode) {}
+
+    QByteArray compress(const QByteArray &data) const Q_DECL_OVERRIDE
+    {
+        ZSTD_CCtx *cctx = context().cctx;
+
+        ZSTD_CCtx_reset(cctx, ZSTD_reset_session_and_parameters);
+        ZSTD_CCtx_setParameter(cctx, ZSTD_c_compressionLevel, level());
+
+        if (m_longMode)
+            ZSTD_CCtx_setParameter(cctx, ZSTD_c_enableLongDistanceMatching, 1);
+
+        QByteArray array(int(ZSTD_compressBound(data.size())), Qt::Uninitialized);
+        size_t size = ZSTD_compress2(cctx, array.data(), array.size(), data.constData(), data.size());
+
+        if (ZSTD_isError(size))
+            return QByteArray();
+
+        array.resize(size);
+
+        return array;
+    }
+
+    QByteArray uncompress(const QByteArray &data, int size) const Q_DECL_OVERRIDE
+    {
+        QByteArray array(size, Qt::Uninitialized);
+        size_t real_size = ZSTD_decompressDCtx(context().dctx, array.data(), array.size(), data.constData(), data.size());
+
+        if (ZSTD_isError(real_size) || real_size != size_t(size))
+            return QByteArray();
+
+        return array;
+    }
+
+private:
+    // the contexts are expensive to create, every thread reuses its own
+    struct Context {
+        Context()
+            : cctx(ZSTD_createCCtx())
+            , dctx(ZSTD_createDCtx()) {}
+
+        ~Context()
+        {
+            ZSTD_freeCCtx(cctx);
+            ZSTD_freeDCtx(dctx);
+        }
+
+        ZSTD_CCtx *cctx;
+        ZSTD_DCtx *dctx;
+    };
+
+    static Context &context()
+    {
+        static thread_local Context context;
+
+        return context;
+    }
+
+    bool m_longMode;
+};
+
+class DLz4Codec : public DBlockCodec
+{
+public:
+    explicit DLz4Codec(int level)
+        : DBlockCodec(Lz4, level) {}
+
+    QByteArray compress(const QByteArray &data) const Q_DECL_OVERRIDE
+    {
+        QByteArray array(LZ4_compressBound(data.size()), Qt::Uninitialized);
+        int size = 0;
+
+        // the fast compressor for the low levels, the high compression one for the others
+        if (level() < LZ4HC_CLEVEL_MIN)
+            size = LZ4_compress_default(data.constData(), array.data(), data.size(), array.size());
+        else
+            size = LZ4_compress_HC(data.constData(), array.data(), data.size(), array.size(), level());
+
+        if (size <= 0)
+            return QByteArray();
+
+        array.resize(size);
+
+        return array;
+    }
+
+    QByteArray uncompress(const QByteArray &data, int size) const Q_DECL_OVERRIDE
+    {
+        QByteArray array(size, Qt::Uninitialized);
+        int real_size = LZ4_decompress_safe(data.constData(), array.data(), data.size(), array.size());
+
+        if (real_size != size)
+            return QByteArray();
+
+        return array;
+    }
+};
+
+DBlockCodec::DBlockCodec(DBlockCodec::Type type, int level)
+    : m_type(type)
+    , m_level(level)
+{
+
+}
+
+DBlockCodec::~DBlockCodec()
+{
+
+}
+
+DBlockCodec::Type DBlockCodec::type() const
+{
+    return m_type;
+}
+
+int DBlockCodec::level() const
+{
+    return m_level;
+}
+
+DBlockCodec *DBlockCodec::create(DBlockCodec::Type type, int level, bool longMode)
+{
+    switch (type) {
+    case Zlib:
+        return new DZlibCodec(level);
+    case Zstd:
+        return new DZstdCodec(level, longMode);
+    case Lz4:
+        return new DLz4Codec(level);
+    case None:
+        return new DNoneCodec();
+    default:
+        break;
+    }
+
+    return nullptr;
+}
+
+DBlockCodec::Type DBlockCodec::typeFromName(const QString &name, bool *longMode, bool *ok)
+{
+    Type type = None;
+    bool long_mode = false;
+    bool valid = true;
+
+    if (name == "zlib") {
+        type = Zlib;
+    } else if (name == "zstd") {
+        type = Zstd;
+    } else if (name == "zstd-long") {
+        type = Zstd;
+        long_mode = true;
+    } else if (name == "lz4") {
+        type = Lz4;
+    } else {
+        valid = false;
+    }
+
+    if (longMode)
+        *longMode = long_mode;
+
+    if (ok)
+        *ok = valid;
+
+    return type;
+}
+
+QString DBlockCodec::typeName(DBlockCodec::Type type, bool longMode)
+{
+    switch (type) {
+    case Zlib:
+        return "zlib";
+    case Zstd:
+        return longMode ? "zstd-long" : "zstd";
+    case Lz4:
+        return "lz4";
+    default:
+        break;
+    }
+
+    return "none";
+}
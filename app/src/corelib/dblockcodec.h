@@ -0,0 +1,49 @@
+// SPDX-FileCopyrightText: 2022 UnionTech Software Technology Co., Ltd.
+//
+// SPDX-License-Identifier: GPL-3.0-only
+
+#ifndef DBLOCKCODEC_H
+#define DBLOCKCODEC_H
+
+#include <QByteArray>
+#include <QString>
+
+// Compresses the blocks of a DZlibIODevice stream. The codec type is stored in the stream
+// metadata, so every block of one stream uses the same codec. The compress and uncompress
+// functions are called from several threads at the same time.
+class DBlockCodec
+{
+public:
+    enum Type {
+        None = 0,
+        Zlib = 1,
+        Zstd = 2,
+        Lz4 = 3
+    };
+
+    virtual ~DBlockCodec();
+
+    Type type() const;
+    int level() const;
+
+    // returns an empty array on failure
+    virtual QByteArray compress(const QByteArray &data) const = 0;
+    // size is the size of the uncompressed data, returns an empty array if the data is corrupt
+    virtual QByteArray uncompress(const QByteArray &data, int size) const = 0;
+
+    // returns 0 for an unknown type, e.g. read from a stream written by a newer version
+    static DBlockCodec *create(Type type, int level = 0, bool longMode = false);
+
+    // "zlib", "zstd", "zstd-long" or "lz4"
+    static Type typeFromName(const QString &name, bool *longMode = 0, bool *ok = 0);
+    static QString typeName(Type type, bool longMode = false);
+
+protected:
+    DBlockCodec(Type type, int level);
+
+private:
+    Type m_type;
+    int m_level;
+};
+
+#endif // DBLOCKCODEC_H
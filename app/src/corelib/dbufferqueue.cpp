@@ -0,0 +1,96 @@
+// SPDX-FileCopyrightText: 2022 UnionTech Software Technology Co., Ltd.
+//
+// SPDX-License-Identifier: GPL-3.0-only
+
+#include "dbufferqueue.h"
+
+DBufferQueue::DBufferQueue(int count, int bufferSize, int alignment)
+    : m_buffers(qMax(count, 1))
+    , m_bufferSize(bufferSize)
+{
+    for (Buffer &buffer : m_buffers) {
+        buffer.data = static_cast<char*>(qMallocAligned(bufferSize, alignment));
+        m_freeQueue.enqueue(&buffer);
+    }
+}
+
+DBufferQueue::~DBufferQueue()
+{
+    for (Buffer &buffer : m_buffers)
+        qFreeAligned(buffer.data);
+}
+
+int DBufferQueue::bufferSize() const
+{
+    return m_bufferSize;
+}
+
+DBufferQueue::Buffer *DBufferQueue::acquire()
+{
+    QMutexLocker locker(&m_mutex);
+
+    while (m_freeQueue.isEmpty() && !m_aborted)
+        m_freeCondition.wait(&m_mutex);
+
+    if (m_aborted)
+        return nullptr;
+
+    Buffer *buffer = m_freeQueue.dequeue();
+
+    buffer->size = 0;
+
+    return buffer;
+}
+
+void DBufferQueue::push(DBufferQueue::Buffer *buffer)
+{
+    QMutexLocker locker(&m_mutex);
+
+    m_filledQueue.enqueue(buffer);
+    m_filledCondition.wakeOne();
+}
+
+void DBufferQueue::finish()
+{
+    QMutexLocker locker(&m_mutex);
+
+    m_finished = true;
+    m_filledCondition.wakeAll();
+}
+
+DBufferQueue::Buffer *DBufferQueue::pop()
+{
+    QMutexLocker locker(&m_mutex);
+
+    while (m_filledQueue.isEmpty() && !m_finished && !m_aborted)
+        m_filledCondition.wait(&m_mutex);
+
+    if (m_aborted || m_filledQueue.isEmpty())
+        return nullptr;
+
+    return m_filledQueue.dequeue();
+}
+
+void DBufferQueue::release(DBufferQueue::Buffer *buffer)
+{
+    QMutexLocker locker(&m_mutex);
+
+    m_freeQueue.enqueue(buffer);
+    m_freeCondition.wakeOne();
+}
+
+void DBufferQueue::abort()
+{
+    QMutexLocker locker(&m_mutex);
+
+    m_aborted = true;
+    m_freeCondition.wakeAll();
+    m_filledCondition.wakeAll();
+}
+
+bool DBufferQueue::isAborted() const
+{
+    QMutexLocker locker(&m_mutex);
+
+    return m_aborted;
+}
@@ -0,0 +1,56 @@
+// SPDX-FileCopyrightText: 2022 UnionTech Software Technology Co., Ltd.
+//
+// SPDX-License-Identifier: GPL-3.0-only
+
+#ifndef DBUFFERQUEUE_H
+#define DBUFFERQUEUE_H
+
+#include <QMutex>
+#include <QWaitCondition>
+#include <QQueue>
+#include <QVector>
+
+// A bounded queue of reusable, aligned buffers shared by one producer and one consumer.
+// The producer acquire()s a free buffer, fills it and push()es it; the consumer pop()s
+// filled buffers in order and release()s them back to the free list.
+class DBufferQueue
+{
+public:
+    struct Buffer {
+        char *data = nullptr;
+        qint64 size = 0;
+    };
+
+    explicit DBufferQueue(int count, int bufferSize, int alignment = 4096);
+    ~DBufferQueue();
+
+    int bufferSize() const;
+
+    // producer
+    Buffer *acquire();
+    void push(Buffer *buffer);
+    void finish();
+
+    // consumer
+    Buffer *pop();
+    void release(Buffer *buffer);
+
+    // wake up both sides, acquire() and pop() return nullptr afterwards
+    void abort();
+    bool isAborted() const;
+
+private:
+    Q_DISABLE_COPY(DBufferQueue)
+
+    mutable QMutex m_mutex;
+    QWaitCondition m_freeCondition;
+    QWaitCondition m_filledCondition;
+    QVector<Buffer> m_buffers;
+    QQueue<Buffer*> m_freeQueue;
+    QQueue<Buffer*> m_filledQueue;
+    int m_bufferSize;
+    bool m_finished = false;
+    bool m_aborted = false;
+};
+
+#endif // DBUFFERQUEUE_H
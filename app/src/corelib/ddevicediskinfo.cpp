@@ -12,26 +12,24 @@
 #include "helper.h"
 #include "ddevicepartinfo.h"
 #include "dpartinfo_p.h"
+#include "dpipeprocess.h"
+#include "dpartitiontable.h"
+#include "ddevicetopology.h"
 
 #include <QJsonObject>
 #include <QJsonArray>
 #include <QJsonDocument>
-#include <QProcess>
 #include <QBuffer>
+#include <QElapsedTimer>
+#include <QFile>
 
-static QString getPTName(const QString &device)
-{
-    Helper::processExec("/sbin/blkid", {"-p", "-s", "PTTYPE", "-d", "-i", device});
-
-    const QByteArray &data = Helper::lastProcessStandardOutput();
+#include <unistd.h>
 
-    if (data.isEmpty())
-        return QString();
+// the sectors before the first partition, the boot loader lives here
+#define HEADGEAR_SIZE 1048576
 
-    const QByteArrayList &list = data.split('=');
-
-    return list.last().simplified().replace('\"', "");
-}
+// the time a terminated source has to exit before it is killed
+#define PROCESS_TERMINATE_TIMEOUT 5000
 
 class DDeviceDiskInfoPrivate : public DDiskInfoPrivate
 {
@@ -60,13 +58,17 @@ public:
 
     bool atEnd() const Q_DECL_OVERRIDE;
 
+    int streamDescriptor(QList<int> *outputDescriptors) const Q_DECL_OVERRIDE;
+
     QString errorString() const Q_DECL_OVERRIDE;
 
-    bool isClosing() const;
+    // the exit status of a process that finished by itself
+    void checkExitStatus();
 
-    QProcess *process = NULL;
+    DPipeProcess *process = NULL;
+    // the data of the scopes read or written without a process
     QBuffer buffer;
-    bool closing = false;
+    QFile device;
 };
 
 DDeviceDiskInfoPrivate::DDeviceDiskInfoPrivate(DDeviceDiskInfo *qq)
@@ -80,7 +82,7 @@ DDeviceDiskInfoPrivate::~DDeviceDiskInfoPrivate()
     closeDataStream();
 
     if (process)
-        process->deleteLater();
+        delete process;
 }
 
 void DDeviceDiskInfoPrivate::init(const QJsonObject &obj)
@@ -127,10 +129,8 @@ void DDeviceDiskInfoPrivate::init(const QJsonObject &obj)
         return info1.sizeStart() < info2.sizeStart();
     });
 
-    if (type == DDiskInfo::Disk)
-        ptTypeName = getPTName(name);
-    else
-        ptTypeName = getPTName(obj.value("pkname").toString());
+    // the table of the disk for a partition
+    ptTypeName = obj.value("pttype").toString();
 
     if (ptTypeName == "dos") {
         ptType = DDiskInfo::MBR;
@@ -162,11 +162,12 @@ QString DDeviceDiskInfoPrivate::filePath() const
 void DDeviceDiskInfoPrivate::refresh()
 {
     children.clear();
+    DDeviceTopology::instance()->invalidate(name);
 
-    const QJsonArray &block_devices = Helper::getBlockDevices({name});
+    const QJsonObject &obj = DDeviceTopology::instance()->device(name);
 
-    if (!block_devices.isEmpty())
-        init(block_devices.first().toObject());
+    if (!obj.isEmpty())
+        init(obj);
 }
 
 bool DDeviceDiskInfoPrivate::hasScope(DDiskInfo::DataScope scope, DDiskInfo::ScopeMode mode, int index) const
@@ -214,22 +215,11 @@ bool DDeviceDiskInfoPrivate::hasScope(DDiskInfo::DataScope scope, DDiskInfo::Sco
 bool DDeviceDiskInfoPrivate::openDataStream(int index)
 {
     if (process) {
-        process->deleteLater();
+        delete process;
+        process = 0;
     }
 
-    process = new QProcess();
-
-    QObject::connect(process, static_cast<void (QProcess::*)(int, QProcess::ExitStatus)>(&QProcess::finished),
-                     process, [this] (int code, QProcess::ExitStatus status) {
-        if (isClosing())
-            return;
-
-        if (status == QProcess::CrashExit) {
-            setErrorString(QObject::tr("process \"%1 %2\" crashed").arg(process->program()).arg(process->arguments().join(" ")));
-        } else if (code != 0) {
-            setErrorString(QObject::tr("Failed to perform process \"%1 %2\", error: %3").arg(process->program()).arg(process->arguments().join(" ")).arg(QString::fromUtf8(process->readAllStandardError())));
-        }
-    });
+    bool started = false;
 
     switch (currentScope) {
     case DDiskInfo::Headgear: {
@@ -239,10 +229,18 @@ bool DDeviceDiskInfoPrivate::openDataStream(int index)
             return false;
         }
 
+        device.setFileName(filePath());
+
+        // ReadWrite, a block device is never truncated but QFile would ask for it in the WriteOnly mode
+        if (!device.open(currentMode == DDiskInfo::Read ? QIODevice::ReadOnly : QIODevice::ReadWrite)) {
+            setErrorString(QObject::tr("Failed to open file(%1), error: %2").arg(filePath()).arg(device.errorString()));
+
+            return false;
+        }
+
         if (currentMode == DDiskInfo::Read) {
-            process->start("dd", {QString("if=%1").arg(filePath()), "bs=512", "count=2048", "status=none"}, QIODevice::ReadOnly);
-        } else {
-            process->start("dd", {QString("of=%1").arg(filePath()), "bs=512", "status=none", "conv=fsync"});
+            buffer.setData(device.read(HEADGEAR_SIZE));
+            device.close();
         }
 
         break;
@@ -254,10 +252,20 @@ bool DDeviceDiskInfoPrivate::openDataStream(int index)
             return false;
         }
 
-        if (currentMode == DDiskInfo::Read)
-            process->start("sfdisk", {"-d", filePath()}, QIODevice::ReadOnly);
-        else
-            process->start("sfdisk", {filePath(), "--no-reread"});
+        // the dump of sfdisk, written to the disk in closeDataStream()
+        if (currentMode == DDiskInfo::Read) {
+            DPartitionTable table;
+
+            if (!table.read(filePath())) {
+                setErrorString(table.errorString());
+
+                return false;
+            }
+
+            buffer.setData(table.toDump());
+        } else {
+            buffer.setData(QByteArray());
+        }
 
         break;
     }
@@ -282,19 +290,19 @@ bool DDeviceDiskInfoPrivate::openDataStream(int index)
             }
         }
 
+        process = new DPipeProcess();
+
         if (currentMode == DDiskInfo::Read) {
             QStringList args = {"-s", part.filePath(), "-o", "-", "-c", "-z", QString::number(Global::bufferSize), "-L", "/var/log/partclone.log"};
             const QString &executer = Helper::getPartcloneExecuter(part, args);
-            process->start(executer, args, QIODevice::ReadOnly);
+            started = process->start(executer, args, QIODevice::ReadOnly);
         } else {
-            process->start("partclone.restore", {"-s", "-", "-o", part.filePath(), "-z", QString::number(Global::bufferSize), "-L", "/var/log/partclone.log"});
+            started = process->start("partclone.restore", {"-s", "-", "-o", part.filePath(), "-z", QString::number(Global::bufferSize), "-L", "/var/log/partclone.log"}, QIODevice::WriteOnly);
         }
 
         break;
     }
     case DDiskInfo::JsonInfo: {
-        process->deleteLater();
-        process = 0;
         buffer.setData(q->toJson());
         break;
     }
@@ -303,19 +311,24 @@ bool DDeviceDiskInfoPrivate::openDataStream(int index)
     }
 
     if (process) {
-        if (!process->waitForStarted()) {
+        if (!started) {
             setErrorString(QObject::tr("Failed to start \"%1 %2\", error: %3").arg(process->program()).arg(process->arguments().join(" ")).arg(process->errorString()));
 
             return false;
         }
 
         dCDebug("The \"%s %s\" command start finished", qPrintable(process->program()), qPrintable(process->arguments().join(" ")));
+
+        return true;
     }
 
-    bool ok = process ? process->isOpen() : buffer.open(QIODevice::ReadOnly);
+    if (device.isOpen())
+        return true;
+
+    bool ok = buffer.open(currentMode == DDiskInfo::Read ? QIODevice::ReadOnly : QIODevice::WriteOnly);
 
     if (!ok) {
-        setErrorString(QObject::tr("Failed to open process, error: %1").arg(process ? process->errorString(): buffer.errorString()));
+        setErrorString(QObject::tr("Failed to open process, error: %1").arg(buffer.errorString()));
     }
 
     return ok;
@@ -323,48 +336,68 @@ bool DDeviceDiskInfoPrivate::openDataStream(int index)
 
 void DDeviceDiskInfoPrivate::closeDataStream()
 {
-    closing = true;
-
     if (process) {
-        if (process->state() != QProcess::NotRunning) {
-            if (currentMode == DDiskInfo::Read) {
-                process->closeReadChannel(QProcess::StandardOutput);
-                process->terminate();
-            } else {
-                process->closeWriteChannel();
-            }
+        QElapsedTimer timer;
 
-            while (process->state() != QProcess::NotRunning) {
-                QThread::currentThread()->sleep(1);
+        timer.start();
 
-                if (!QFile::exists(QString("/proc/%2").arg(process->pid()))) {
-                    process->waitForFinished(-1);
+        if (currentMode == DDiskInfo::Read) {
+            // a source stopped before the end of its data is terminated, its exit status does not count
+            const bool finished = process->reachedEnd();
 
-                    if (process->error() == QProcess::Timedout)
-                        process->QIODevice::d_func()->errorString.clear();
+            process->closeReadChannel();
 
-                    break;
+            if (!finished) {
+                process->terminate();
+
+                if (!process->waitForFinished(PROCESS_TERMINATE_TIMEOUT)) {
+                    dCWarning("The \"%s\" process ignored SIGTERM, kill it", qPrintable(process->program()));
+
+                    process->kill();
                 }
             }
+
+            process->waitForFinished();
+
+            if (finished)
+                checkExitStatus();
+        } else {
+            process->closeWriteChannel();
+            process->waitForFinished();
+            checkExitStatus();
         }
 
-        dCDebug("Process exit code: %d(%s %s)", process->exitCode(), qPrintable(process->program()), qPrintable(process->arguments().join(' ')));
+        // the exit is reported by the pidfd, this is the time the process took to finish
+        dCDebug("Process exit code: %d(%s %s), waited %lld ms for the exit", process->exitCode(), qPrintable(process->program()), qPrintable(process->arguments().join(' ')), timer.elapsed());
+    }
+
+    // a new file system or boot sector is not always announced by a uevent
+    if (currentMode == DDiskInfo::Write && (process || device.isOpen()))
+        DDeviceTopology::instance()->invalidate(filePath());
+
+    // dd conv=fsync
+    if (device.isOpen()) {
+        if (!device.flush() || fsync(device.handle()) != 0)
+            setErrorString(QObject::tr("Failed to write data to %1, error: %2").arg(filePath()).arg(device.errorString()));
+
+        device.close();
     }
 
-    if (currentMode == DDiskInfo::Write && currentScope == DDiskInfo::PartitionTable) {
+    if (currentMode == DDiskInfo::Write && currentScope == DDiskInfo::PartitionTable && buffer.isOpen()) {
+        DPartitionTable table = DPartitionTable::fromDump(buffer.data(), filePath());
+
         Helper::umountDevice(filePath());
 
-        if (Helper::refreshSystemPartList(filePath())) {
+        if (!table.write(filePath())) {
+            setErrorString(table.errorString());
+        } else if (table.updateKernel(filePath()) || Helper::refreshSystemPartList(filePath())) {
             refresh();
         } else {
             dCWarning("Refresh the devcie %s failed", qPrintable(filePath()));
         }
     }
 
-    if (currentScope == DDiskInfo::JsonInfo)
-        buffer.close();
-
-    closing = false;
+    buffer.close();
 }
 
 qint64 DDeviceDiskInfoPrivate::readableDataSize(DDiskInfo::DataScope scope) const
@@ -380,7 +413,7 @@ qint64 DDeviceDiskInfoPrivate::totalReadableDataSize() const
 
     if (hasScope(DDiskInfo::PartitionTable, DDiskInfo::Read)) {
         if (hasScope(DDiskInfo::Headgear, DDiskInfo::Read)) {
-            size += 1048576;
+            size += HEADGEAR_SIZE;
         } else if (!children.isEmpty()) {
             size += children.first().sizeStart();
         }
@@ -424,39 +457,26 @@ qint64 DDeviceDiskInfoPrivate::read(char *data, qint64 maxSize)
         return buffer.read(data, maxSize);
     }
 
-    process->waitForReadyRead(-1);
-
-    if (process->bytesAvailable() > Global::bufferSize) {
-        dCWarning("The \"%s %s\" process bytes available: %s", qPrintable(process->program()), qPrintable(process->arguments().join(" ")), qPrintable(Helper::sizeDisplay(process->bytesAvailable())));
-    }
-
     return process->read(data, maxSize);
 }
 
 qint64 DDeviceDiskInfoPrivate::write(const char *data, qint64 maxSize)
 {
-    if (!process)
-        return -1;
+    if (!process) {
+        if (device.isOpen())
+            return device.write(data, maxSize);
 
-    if (process->state() != QProcess::Running)
-        return -1;
+        return buffer.isWritable() ? buffer.write(data, maxSize) : -1;
+    }
 
+    // blocks until the process has taken all the data
     qint64 size = process->write(data, maxSize);
 
-    QElapsedTimer timer;
-
-    timer.start();
-
-    int timeout = 5000;
-
-    while (process->state() == QProcess::Running && process->bytesToWrite() > 0) {
-        process->waitForBytesWritten();
-
-        if (timer.elapsed() > timeout) {
-            timeout += 5000;
-
-            dCWarning("Wait for bytes written timeout, elapsed: %lld, bytes to write: %lld", timer.elapsed(), process->bytesToWrite());
-        }
+    // the process closed its standard input
+    if (size < maxSize) {
+        process->closeWriteChannel();
+        process->waitForFinished();
+        checkExitStatus();
     }
 
     return size;
@@ -468,16 +488,25 @@ bool DDeviceDiskInfoPrivate::atEnd() const
         return buffer.atEnd();
     }
 
-    process->waitForReadyRead(-1);
-
     return process->atEnd();
 }
 
+int DDeviceDiskInfoPrivate::streamDescriptor(QList<int> *outputDescriptors) const
+{
+    if (!process || process->dataDescriptor() < 0)
+        return -1;
+
+    if (outputDescriptors && process->errorDescriptor() >= 0)
+        outputDescriptors->append(process->errorDescriptor());
+
+    return process->dataDescriptor();
+}
+
 QString DDeviceDiskInfoPrivate::errorString() const
 {
     if (error.isEmpty()) {
         if (process) {
-            if (process->error() == QProcess::UnknownError)
+            if (process->errorString().isEmpty())
                 return QString();
 
             return QString("%1 %2: %3").arg(process->program()).arg(process->arguments().join(' ')).arg(process->errorString());
@@ -490,9 +519,16 @@ QString DDeviceDiskInfoPrivate::errorString() const
     return error;
 }
 
-bool DDeviceDiskInfoPrivate::isClosing() const
+void DDeviceDiskInfoPrivate::checkExitStatus()
 {
-    return closing;
+    if (process->isRunning())
+        return;
+
+    if (process->isCrashed()) {
+        setErrorString(QObject::tr("process \"%1 %2\" crashed").arg(process->program()).arg(process->arguments().join(" ")));
+    } else if (process->exitCode() != 0) {
+        setErrorString(QObject::tr("Failed to perform process \"%1 %2\", error: %3").arg(process->program()).arg(process->arguments().join(" ")).arg(QString::fromUtf8(process->standardError())));
+    }
 }
 
 DDeviceDiskInfo::DDeviceDiskInfo()
@@ -502,20 +538,16 @@ DDeviceDiskInfo::DDeviceDiskInfo()
 
 DDeviceDiskInfo::DDeviceDiskInfo(const QString &filePath)
 {
-    const QJsonArray &block_devices = Helper::getBlockDevices({filePath});
-
-    if (!block_devices.isEmpty()) {
-        const QJsonObject &obj = block_devices.first().toObject();
+    const QJsonObject &obj = DDeviceTopology::instance()->device(filePath);
 
+    if (!obj.isEmpty()) {
         d = new DDeviceDiskInfoPrivate(this);
         d_func()->init(obj);
 
         if (d->type == Part) {
-            const QJsonArray &parent = Helper::getBlockDevices({obj.value("pkname").toString()});
-
-            if (!parent.isEmpty()) {
-                const QJsonObject &parent_obj = parent.first().toObject();
+            const QJsonObject &parent_obj = DDeviceTopology::instance()->device(obj.value("pkname").toString());
 
+            if (!parent_obj.isEmpty()) {
                 d->transport = parent_obj.value("tran").toString();
                 d->model = parent_obj.value("model").toString();
                 d->serial = parent_obj.value("serial").toString();
@@ -529,7 +561,7 @@ DDeviceDiskInfo::DDeviceDiskInfo(const QString &filePath)
 
 QList<DDeviceDiskInfo> DDeviceDiskInfo::localeDiskList()
 {
-    const QJsonArray &block_devices = Helper::getBlockDevices();
+    const QJsonArray &block_devices = DDeviceTopology::instance()->devices();
 
     QList<DDeviceDiskInfo> list;
 
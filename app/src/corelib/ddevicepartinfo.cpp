@@ -7,6 +7,7 @@
 #include "dpartinfo_p.h"
 #include "helper.h"
 #include "ddevicediskinfo.h"
+#include "ddevicetopology.h"
 
 #include <QJsonObject>
 #include <QJsonArray>
@@ -107,56 +108,27 @@ void DDevicePartInfoPrivate::init(const QJsonObject &obj)
         sizeStart = 0;
         sizeEnd = size - 1;
         index = 0;
+    } else if (obj.contains("partn")) {
+        index = obj.value("partn").toInt();
+        // in 512 bytes sectors whatever the sector size is
+        sizeStart = Helper::getIntValue(obj.value("start")) * 512;
+        sizeEnd = sizeStart + size - 1;
     } else {
-        int code = Helper::processExec("partx", {name, "-b", "-P", "-o", "START,END,SECTORS,SIZE,TYPE,NR,UUID"});
+        int number_start = 0;
 
-        if (code == 0) {
-            const QByteArray &data = Helper::lastProcessStandardOutput();
-            const QByteArrayList &list = data.split(' ');
-
-            if (list.count() != 7) {
-                dCError("Get partition START/END/SECTORS/SIZE/TYPE/NR/UUID info error by partx, device: %s", qPrintable(name));
-
-                return;
-            }
-
-            qint64 start = list.first().split('"').at(1).toLongLong();
-//            qint64 end = list.at(1).split('"').at(1).toLongLong();
-            qint64 sectors = list.at(2).split('"').at(1).toLongLong();
-            qint64 size = list.at(3).split('"').at(1).toLongLong();
-
-            if (partTypeName.isEmpty()) {
-                partTypeName = list.at(4).split('"').at(1);
-                partType = DPartInfo::type(partTypeName);
-            }
-
-            index = list.at(5).split('"').at(1).toInt();
-
-            if (partUUID.isEmpty()) {
-                partUUID = list.at(6).split('"').at(1);
-            }
-
-            Q_ASSERT(sectors > 0);
-
-            sizeStart = start * (size / sectors);
-            sizeEnd = sizeStart + this->size - 1;
-        } else {
-            int number_start = 0;
-
-            for (int i = name.size() - 1; i >= 0; --i) {
-                if (!name.at(i).isDigit()) {
-                    number_start = i + 1;
-                    break;
-                }
+        for (int i = name.size() - 1; i >= 0; --i) {
+            if (!name.at(i).isDigit()) {
+                number_start = i + 1;
+                break;
             }
+        }
 
-            bool ok = false;
+        bool ok = false;
 
-            index = name.mid(number_start).toInt(&ok);
+        index = name.mid(number_start).toInt(&ok);
 
-            if (!ok)
-                index = -1;
-        }
+        if (!ok)
+            index = -1;
     }
 }
 
@@ -169,11 +141,9 @@ DDevicePartInfo::DDevicePartInfo()
 DDevicePartInfo::DDevicePartInfo(const QString &name)
     : DPartInfo(new DDevicePartInfoPrivate(this))
 {
-    const QJsonArray &block_devices = Helper::getBlockDevices({name});
-
-    if (!block_devices.isEmpty()) {
-        const QJsonObject &obj = block_devices.first().toObject();
+    const QJsonObject &obj = DDeviceTopology::instance()->device(name);
 
+    if (!obj.isEmpty()) {
         d_func()->init(obj);
 
         d->transport = DDeviceDiskInfo(d_func()->parentDiskFilePath).transport();
@@ -182,7 +152,7 @@ DDevicePartInfo::DDevicePartInfo(const QString &name)
 
 QList<DDevicePartInfo> DDevicePartInfo::localePartList()
 {
-    const QJsonArray &block_devices = Helper::getBlockDevices();
+    const QJsonArray &block_devices = DDeviceTopology::instance()->devices();
 
     QList<DDevicePartInfo> list;
 
@@ -0,0 +1,761 @@
+// SPDX-FileCopyrightText: 2022 UnionTech Software Technology Co., Ltd.
+//
+// SPDX-License-Identifier: GPL-3.0-only
+
+#include "ddevicetopology.h"
+#include "dpartitiontable.h"
+#include "helper.h"
+
+#include <QDir>
+#include <QFile>
+#include <QFileInfo>
+#include <QMutexLocker>
+#include <QUuid>
+#include <QtEndian>
+
+#include <algorithm>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <linux/netlink.h>
+
+#define SYSFS_BLOCK "/sys/class/block/"
+#define UDEV_DATA "/run/udev/data/b%1:%2"
+#define MOUNT_INFO "/proc/self/mountinfo"
+// the multicast groups of the kernel and of udev, udev announces a device once its database is written
+#define UEVENT_GROUPS 3
+#define UEVENT_BUFFER_SIZE (1024 * 1024)
+// the ram disks, lsblk hides them too
+#define RAMDISK_MAJOR 1
+// the btrfs superblock is the farthest of the probed ones
+#define PROBE_SIZE (0x10000 + 0x1000)
+
+static QByteArray readAttribute(const QString &path)
+{
+    QFile file(path);
+
+    if (!file.open(QIODevice::ReadOnly))
+        return QByteArray();
+
+    return file.readAll().trimmed();
+}
+
+// lsblk prints null for the empty columns
+static QJsonValue toValue(const QString &string)
+{
+    if (string.isEmpty())
+        return QJsonValue();
+
+    return string;
+}
+
+// the "\x20" escapes of the udev database
+static QString unhexmangle(const QByteArray &data)
+{
+    QByteArray result;
+
+    for (int i = 0; i < data.size(); ++i) {
+        if (data.at(i) == '\\' && i + 3 < data.size() && data.at(i + 1) == 'x') {
+            bool ok = false;
+            const int ch = data.mid(i + 2, 2).toInt(&ok, 16);
+
+            if (ok) {
+                result.append(char(ch));
+                i += 3;
+                continue;
+            }
+        }
+
+        result.append(data.at(i));
+    }
+
+    return QString::fromUtf8(result);
+}
+
+// the "\040" escapes of the mount table
+static QString unescapeMountPath(const QByteArray &data)
+{
+    QByteArray result;
+
+    for (int i = 0; i < data.size(); ++i) {
+        if (data.at(i) == '\\' && i + 3 < data.size()) {
+            bool ok = false;
+            const int ch = data.mid(i + 1, 3).toInt(&ok, 8);
+
+            if (ok) {
+                result.append(char(ch));
+                i += 3;
+                continue;
+            }
+        }
+
+        result.append(data.at(i));
+    }
+
+    return QString::fromUtf8(result);
+}
+
+// false if udev has no record of the device
+static bool readUdevProperties(quint64 devno, QHash<QByteArray, QByteArray> *properties)
+{
+    QFile file(QString(UDEV_DATA).arg(major(devno)).arg(minor(devno)));
+
+    if (!file.open(QIODevice::ReadOnly))
+        return false;
+
+    for (const QByteArray &line : file.readAll().split('\n')) {
+        if (!line.startsWith("E:"))
+            continue;
+
+        const int pos = line.indexOf('=');
+
+        if (pos > 2)
+            properties->insert(line.mid(2, pos - 2), line.mid(pos + 1));
+    }
+
+    return true;
+}
+
+static QString uuidString(const char *data)
+{
+    return QUuid::fromRfc4122(QByteArray::fromRawData(data, 16)).toString().mid(1, 36);
+}
+
+static QString labelString(const char *data, int size)
+{
+    return QString::fromUtf8(data, qstrnlen(data, size)).trimmed();
+}
+
+// the file systems partclone knows, named as blkid does, for the devices udev has not seen yet
+static bool probeFileSystem(const QString &device, QString *type, QString *uuid, QString *label)
+{
+    const int fd = ::open(QFile::encodeName(device).constData(), O_RDONLY | O_CLOEXEC | O_NONBLOCK);
+
+    if (fd < 0)
+        return false;
+
+    const int page_size = getpagesize();
+    QByteArray data(qMax(PROBE_SIZE, page_size), 0);
+    const ssize_t size = pread(fd, data.data(), data.size(), 0);
+
+    ::close(fd);
+
+    if (size <= 0)
+        return false;
+
+    data.resize(size);
+
+    const char *d = data.constData();
+    auto has = [&data, d] (int offset, const char *magic, int length) {
+        return offset >= 0 && data.size() >= offset + length && memcmp(d + offset, magic, length) == 0;
+    };
+
+    if (data.size() >= 0x488 && qFromLittleEndian<quint16>(d + 0x438) == 0xef53) {
+        const quint32 compat = qFromLittleEndian<quint32>(d + 0x45c);
+        const quint32 incompat = qFromLittleEndian<quint32>(d + 0x460);
+
+        // extents, 64bit or flex_bg make an ext4, a journal an ext3
+        if (incompat & 0x2c0)
+            *type = "ext4";
+        else if (compat & 0x4)
+            *type = "ext3";
+        else
+            *type = "ext2";
+
+        *uuid = uuidString(d + 0x468);
+        *label = labelString(d + 0x478, 16);
+    } else if (has(0, "XFSB", 4) && data.size() >= 120) {
+        *type = "xfs";
+        *uuid = uuidString(d + 32);
+        *label = labelString(d + 108, 12);
+    } else if (has(0x10040, "_BHRfS_M", 8) && data.size() >= 0x1022b) {
+        *type = "btrfs";
+        *uuid = uuidString(d + 0x10020);
+        *label = labelString(d + 0x1012b, 256);
+    } else if (has(page_size - 10, "SWAPSPACE2", 10)) {
+        *type = "swap";
+        *uuid = uuidString(d + 0x40c);
+        *label = labelString(d + 0x41c, 16);
+    } else if (has(3, "NTFS    ", 8)) {
+        *type = "ntfs";
+        *uuid = QString("%1").arg(qFromLittleEndian<quint64>(d + 0x48), 16, 16, QChar('0')).toUpper();
+    } else if (has(510, "\x55\xaa", 2) && (has(0x52, "FAT32   ", 8) || has(0x36, "FAT1", 4))) {
+        const bool fat32 = has(0x52, "FAT32   ", 8);
+        const quint32 serial = qFromLittleEndian<quint32>(d + (fat32 ? 0x43 : 0x27));
+
+        *type = "vfat";
+        *uuid = QString("%1-%2").arg(serial >> 16, 4, 16, QChar('0')).arg(serial & 0xffff, 4, 16, QChar('0')).toUpper();
+        *label = labelString(d + (fat32 ? 0x47 : 0x2b), 11);
+
+        if (*label == "NO NAME")
+            label->clear();
+    } else {
+        return false;
+    }
+
+    return true;
+}
+
+static QString typeName(const QString &kname, const QString &path)
+{
+    if (kname.startsWith("dm-")) {
+        const QByteArray &uuid = readAttribute(path + "dm/uuid");
+
+        if (uuid.startsWith("LVM-"))
+            return "lvm";
+
+        if (uuid.startsWith("CRYPT-"))
+            return "crypt";
+
+        if (uuid.startsWith("mpath-"))
+            return "mpath";
+
+        if (uuid.startsWith("part"))
+            return "part";
+
+        return "dm";
+    }
+
+    if (kname.startsWith("md")) {
+        const QByteArray &level = readAttribute(path + "md/level");
+
+        return level.isEmpty() ? QString("md") : QString::fromLatin1(level);
+    }
+
+    if (kname.startsWith("loop"))
+        return "loop";
+
+    // the scsi type of the cd/dvd drives
+    if (readAttribute(path + "device/type") == "5")
+        return "rom";
+
+    return "disk";
+}
+
+// from the path of the device in sysfs, as lsblk does
+static QString transportName(const QString &kname, const QString &devicePath)
+{
+    if (kname.startsWith("nvme"))
+        return "nvme";
+
+    if (kname.startsWith("mmcblk"))
+        return "mmc";
+
+    if (devicePath.contains("/usb"))
+        return "usb";
+
+    if (devicePath.contains("/virtio"))
+        return "virtio";
+
+    if (devicePath.contains("/ata"))
+        return "sata";
+
+    if (devicePath.contains("/session"))
+        return "iscsi";
+
+    if (devicePath.contains("/rport-"))
+        return "fc";
+
+    if (devicePath.contains("/end_device-"))
+        return "sas";
+
+    return QString();
+}
+
+static void flatten(QJsonObject obj, QList<QJsonObject> *list)
+{
+    const QJsonArray &children = obj.take("children").toArray();
+
+    list->append(obj);
+
+    for (const QJsonValue &child : children)
+        flatten(child.toObject(), list);
+}
+
+DDeviceTopology *DDeviceTopology::instance()
+{
+    static DDeviceTopology topology;
+
+    return &topology;
+}
+
+DDeviceTopology::DDeviceTopology()
+{
+    m_ueventFd = socket(AF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC | SOCK_NONBLOCK, NETLINK_KOBJECT_UEVENT);
+
+    if (m_ueventFd >= 0) {
+        const int size = UEVENT_BUFFER_SIZE;
+
+        // SO_RCVBUFFORCE ignores rmem_max but needs root
+        if (setsockopt(m_ueventFd, SOL_SOCKET, SO_RCVBUFFORCE, &size, sizeof(size)) != 0)
+            setsockopt(m_ueventFd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+
+        sockaddr_nl address;
+
+        memset(&address, 0, sizeof(address));
+        address.nl_family = AF_NETLINK;
+        address.nl_groups = UEVENT_GROUPS;
+
+        if (bind(m_ueventFd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0) {
+            ::close(m_ueventFd);
+            m_ueventFd = -1;
+        }
+    }
+
+    if (m_ueventFd < 0)
+        dCWarning("Failed to listen to the uevents, the block devices are read on every query, error: %s", strerror(errno));
+
+    m_mountInfoFd = ::open(MOUNT_INFO, O_RDONLY | O_CLOEXEC);
+}
+
+DDeviceTopology::~DDeviceTopology()
+{
+    if (m_ueventFd >= 0)
+        ::close(m_ueventFd);
+
+    if (m_mountInfoFd >= 0)
+        ::close(m_mountInfoFd);
+}
+
+QJsonArray DDeviceTopology::devices(const QStringList &devices, bool list, bool sort)
+{
+    QMutexLocker locker(&m_mutex);
+
+    update();
+
+    QVector<int> indexes;
+
+    if (devices.isEmpty())
+        indexes = m_topLevel;
+
+    for (const QString &device : devices) {
+        const int index = indexOf(device);
+
+        if (index < 0) {
+            dCWarning("%s: not a block device", qPrintable(device));
+            continue;
+        }
+
+        indexes << index;
+    }
+
+    QList<QJsonObject> objects;
+
+    for (int index : indexes) {
+        const int parent = m_nodes.at(index).parent;
+        const QJsonObject &obj = toJson(index, parent < 0 ? QString() : "/dev/" + m_nodes.at(parent).kname, sort);
+
+        if (list)
+            flatten(obj, &objects);
+        else
+            objects << obj;
+    }
+
+    if (sort) {
+        std::stable_sort(objects.begin(), objects.end(), [] (const QJsonObject &obj1, const QJsonObject &obj2) {
+            return obj1.value("name").toString() < obj2.value("name").toString();
+        });
+    }
+
+    QJsonArray array;
+
+    for (const QJsonObject &obj : objects)
+        array.append(obj);
+
+    return array;
+}
+
+QJsonObject DDeviceTopology::device(const QString &device)
+{
+    QMutexLocker locker(&m_mutex);
+
+    update();
+
+    const int index = indexOf(device);
+
+    if (index < 0)
+        return QJsonObject();
+
+    const int parent = m_nodes.at(index).parent;
+
+    return toJson(index, parent < 0 ? QString() : "/dev/" + m_nodes.at(parent).kname, false);
+}
+
+void DDeviceTopology::invalidate(const QString &device)
+{
+    QMutexLocker locker(&m_mutex);
+    struct stat st;
+
+    if (!device.isEmpty() && stat(device.toLocal8Bit().constData(), &st) == 0 && S_ISBLK(st.st_mode))
+        m_writtenDevices.insert(st.st_rdev);
+
+    m_outdated = true;
+    m_mountsOutdated = true;
+}
+
+void DDeviceTopology::update()
+{
+    // without the uevents nothing tells that the devices changed
+    if (m_ueventFd < 0 || checkEvents())
+        m_outdated = true;
+
+    if (m_outdated) {
+        rebuild();
+        m_outdated = false;
+    }
+
+    if (m_mountInfoFd < 0) {
+        m_mountsOutdated = true;
+    } else {
+        pollfd fd = {m_mountInfoFd, POLLPRI, 0};
+
+        // the mount table reports a change as an exceptional condition
+        if (poll(&fd, 1, 0) > 0 && (fd.revents & (POLLERR | POLLPRI)))
+            m_mountsOutdated = true;
+    }
+
+    if (m_mountsOutdated) {
+        readMountInfo();
+        m_mountsOutdated = false;
+    }
+}
+
+bool DDeviceTopology::checkEvents()
+{
+    // the property is followed by a zero in both the kernel and the udev messages
+    const QByteArray subsystem("SUBSYSTEM=block", 16);
+    char buffer[8192];
+    bool changed = false;
+
+    for (;;) {
+        const ssize_t size = recv(m_ueventFd, buffer, sizeof(buffer), MSG_DONTWAIT);
+
+        if (size < 0) {
+            if (errno == EINTR)
+                continue;
+
+            // the socket overflowed and some events are lost
+            if (errno == ENOBUFS) {
+                changed = true;
+                continue;
+            }
+
+            break;
+        }
+
+        if (!changed && QByteArray::fromRawData(buffer, size).contains(subsystem))
+            changed = true;
+    }
+
+    return changed;
+}
+
+void DDeviceTopology::rebuild()
+{
+    m_nodes.clear();
+    m_topLevel.clear();
+    m_nameIndex.clear();
+    m_devnoIndex.clear();
+    m_serialIndex.clear();
+    m_partUUIDIndex.clear();
+
+    QHash<QString, int> knames;
+    QVector<bool> partitions;
+
+    for (const QString &kname : QDir(SYSFS_BLOCK).entryList(QDir::Dirs | QDir::NoDotAndDotDot)) {
+        const QByteArrayList &dev = readAttribute(SYSFS_BLOCK + kname + "/dev").split(':');
+
+        if (dev.count() != 2)
+            continue;
+
+        Node node;
+
+        node.kname = kname;
+        node.devno = makedev(dev.first().toUInt(), dev.last().toUInt());
+        knames.insert(kname, m_nodes.size());
+        partitions << QFile::exists(SYSFS_BLOCK + kname + "/partition");
+        m_nodes << node;
+    }
+
+    for (int i = 0; i < m_nodes.size(); ++i) {
+        Node &node = m_nodes[i];
+        const QString &path = SYSFS_BLOCK + node.kname + "/";
+
+        if (partitions.at(i)) {
+            // the directory of a partition is in the one of its disk
+            const QString &device_path = QFileInfo(SYSFS_BLOCK + node.kname).canonicalFilePath();
+
+            node.parent = knames.value(QFileInfo(QFileInfo(device_path).path()).fileName(), -1);
+        } else {
+            const QStringList &slaves = QDir(path + "slaves").entryList(QDir::Dirs | QDir::NoDotAndDotDot);
+
+            if (!slaves.isEmpty())
+                node.parent = knames.value(slaves.first(), -1);
+        }
+
+        // a partition is held too, by the LVM or LUKS device on it
+        for (const QString &holder : QDir(path + "holders").entryList(QDir::Dirs | QDir::NoDotAndDotDot)) {
+            const int index = knames.value(holder, -1);
+
+            if (index >= 0)
+                node.children << index;
+        }
+    }
+
+    QHash<int, DPartitionTable> tables;
+    QSet<int> written_disks;
+
+    // a partition was written through its disk or the table of the disk changed with it
+    for (int i = 0; i < m_nodes.size(); ++i) {
+        if (m_writtenDevices.contains(m_nodes.at(i).devno))
+            written_disks.insert(partitions.at(i) ? m_nodes.at(i).parent : i);
+    }
+
+    m_writtenDevices.clear();
+
+    // the disks first, the partitions take some columns of them
+    for (int pass = 0; pass < 2; ++pass) {
+        for (int i = 0; i < m_nodes.size(); ++i) {
+            if (partitions.at(i) != (pass == 1))
+                continue;
+
+            Node &node = m_nodes[i];
+            QJsonObject &p = node.properties;
+            const QString &path = SYSFS_BLOCK + node.kname + "/";
+            const QString &kname = "/dev/" + node.kname;
+            const Node *disk = node.parent >= 0 ? &m_nodes.at(node.parent) : nullptr;
+            const bool partition = partitions.at(i);
+            QHash<QByteArray, QByteArray> udev;
+            const bool udev_found = readUdevProperties(node.devno, &udev);
+            const QString &type = partition ? QString("part") : typeName(node.kname, path);
+            const qint64 size = readAttribute(path + "size").toLongLong() * 512;
+
+            if (node.kname.startsWith("dm-"))
+                p.insert("name", "/dev/mapper/" + QString::fromUtf8(readAttribute(path + "dm/name")));
+            else
+                p.insert("name", kname);
+
+            p.insert("kname", kname);
+            p.insert("size", size);
+            p.insert("type", type);
+            p.insert("ro", readAttribute(path + "ro") == "1");
+
+            if (partition) {
+                p.insert("rm", disk ? disk->properties.value("rm") : false);
+                p.insert("phy-sec", disk ? disk->properties.value("phy-sec") : 512);
+                p.insert("pttype", disk ? disk->properties.value("pttype") : QJsonValue());
+                p.insert("partn", readAttribute(path + "partition").toInt());
+                // in 512 bytes sectors whatever the sector size is
+                p.insert("start", readAttribute(path + "start").toLongLong());
+                p.insert("model", QJsonValue());
+                p.insert("serial", QJsonValue());
+                p.insert("tran", QJsonValue());
+            } else {
+                QString model = unhexmangle(udev.value("ID_MODEL_ENC")).simplified();
+                QByteArray serial = udev.value("ID_SCSI_SERIAL");
+
+                if (model.isEmpty())
+                    model = QString::fromUtf8(readAttribute(path + "device/model")).simplified();
+
+                if (serial.isEmpty())
+                    serial = udev.value("ID_SERIAL_SHORT");
+
+                if (serial.isEmpty())
+                    serial = readAttribute(path + "device/serial");
+
+                p.insert("rm", readAttribute(path + "removable") == "1");
+                p.insert("phy-sec", readAttribute(path + "queue/physical_block_size").toInt());
+                p.insert("model", toValue(model));
+                p.insert("serial", toValue(QString::fromUtf8(serial)));
+                p.insert("tran", toValue(type == "disk" || type == "rom" ? transportName(node.kname, QFileInfo(SYSFS_BLOCK + node.kname).canonicalFilePath()) : QString()));
+
+                // the udev database lags behind a table just written, read it from the disk then
+                DPartitionTable table;
+
+                if (udev_found && !written_disks.contains(i)) {
+                    p.insert("pttype", toValue(QString::fromUtf8(udev.value("ID_PART_TABLE_TYPE"))));
+                } else if (size > 0 && type != "rom" && table.read(kname)) {
+                    p.insert("pttype", table.type() == DDiskInfo::GPT ? "gpt" : "dos");
+                    tables.insert(i, table);
+                } else {
+                    p.insert("pttype", QJsonValue());
+                }
+            }
+
+            QString fs_type = QString::fromUtf8(udev.value("ID_FS_TYPE"));
+            QString uuid = unhexmangle(udev.value("ID_FS_UUID_ENC"));
+            QString label = unhexmangle(udev.value("ID_FS_LABEL_ENC"));
+
+            if (!udev_found && size > 0 && type != "rom" && !tables.contains(i))
+                probeFileSystem(kname, &fs_type, &uuid, &label);
+
+            p.insert("fstype", toValue(fs_type));
+            p.insert("uuid", toValue(uuid));
+            p.insert("label", toValue(label));
+
+            QString part_type = QString::fromUtf8(udev.value("ID_PART_ENTRY_TYPE"));
+            QString part_uuid = QString::fromUtf8(udev.value("ID_PART_ENTRY_UUID"));
+            QString part_label = unhexmangle(udev.value("ID_PART_ENTRY_NAME"));
+
+            if (partition && tables.contains(node.parent)) {
+                const DPartitionTable &table = tables[node.parent];
+                const int number = p.value("partn").toInt();
+
+                for (const DPartitionTable::Partition &part : table.partitions()) {
+                    if (part.number != number)
+                        continue;
+
+                    if (table.type() == DDiskInfo::GPT) {
+                        part_type = part.type.toLower();
+                        part_uuid = part.uuid.toLower();
+                        part_label = part.name;
+                    } else {
+                        const QString &label_id = table.labelId().startsWith("0x") ? table.labelId().mid(2) : table.labelId();
+
+                        part_type = "0x" + part.type;
+                        part_uuid = QString("%1-%2").arg(label_id).arg(number, 2, 16, QChar('0'));
+                        part_label.clear();
+                    }
+
+                    break;
+                }
+            }
+
+            p.insert("parttype", toValue(part_type));
+            p.insert("partuuid", toValue(part_uuid));
+            p.insert("partlabel", toValue(part_label));
+
+            m_nameIndex.insert(kname, i);
+            m_nameIndex.insert(p.value("name").toString(), i);
+            m_devnoIndex.insert(node.devno, i);
+
+            if (!part_uuid.isEmpty())
+                m_partUUIDIndex.insert(part_uuid.toUpper(), i);
+
+            const QString &serial = p.value("serial").toString().toUpper();
+
+            if (!partition && !serial.isEmpty() && !m_serialIndex.contains(serial))
+                m_serialIndex.insert(serial, i);
+
+            if (partition && disk)
+                m_nodes[node.parent].children << i;
+            else if (!partition && node.parent < 0 && size > 0 && major(node.devno) != RAMDISK_MAJOR)
+                m_topLevel << i;
+        }
+    }
+
+    // the partitions by number before the holders, as lsblk
+    for (Node &node : m_nodes) {
+        std::stable_sort(node.children.begin(), node.children.end(), [this, &partitions] (int index1, int index2) {
+            if (partitions.at(index1) != partitions.at(index2))
+                return partitions.at(index1);
+
+            return m_nodes.at(index1).properties.value("partn").toInt() < m_nodes.at(index2).properties.value("partn").toInt();
+        });
+    }
+}
+
+void DDeviceTopology::readMountInfo()
+{
+    m_mounts.clear();
+
+    QByteArray data;
+
+    if (m_mountInfoFd >= 0 && lseek(m_mountInfoFd, 0, SEEK_SET) == 0) {
+        char buffer[4096];
+        ssize_t size;
+
+        while ((size = ::read(m_mountInfoFd, buffer, sizeof(buffer))) > 0)
+            data.append(buffer, size);
+    } else {
+        QFile file(MOUNT_INFO);
+
+        if (file.open(QIODevice::ReadOnly))
+            data = file.readAll();
+    }
+
+    for (const QByteArray &line : data.split('\n')) {
+        const QByteArrayList &fields = line.split(' ');
+        // the optional fields end with a "-"
+        const int separator = fields.indexOf("-", 6);
+
+        if (separator < 0 || separator + 2 >= fields.size())
+            continue;
+
+        const QByteArrayList &dev = fields.at(2).split(':');
+
+        if (dev.count() != 2)
+            continue;
+
+        quint64 devno = makedev(dev.first().toUInt(), dev.last().toUInt());
+
+        // btrfs and the like have an anonymous device number, the source names the device
+        if (major(devno) == 0) {
+            struct stat st;
+
+            if (stat(unescapeMountPath(fields.at(separator + 2)).toLocal8Bit().constData(), &st) != 0 || !S_ISBLK(st.st_mode))
+                continue;
+
+            devno = st.st_rdev;
+        }
+
+        if (!m_mounts.contains(devno))
+            m_mounts.insert(devno, unescapeMountPath(fields.at(4)));
+    }
+}
+
+int DDeviceTopology::indexOf(const QString &device) const
+{
+    int index = m_nameIndex.value(device, -1);
+
+    if (index >= 0)
+        return index;
+
+    struct stat st;
+
+    // the links in /dev/disk and the like
+    if (stat(QFile::encodeName(device).constData(), &st) == 0 && S_ISBLK(st.st_mode))
+        return m_devnoIndex.value(st.st_rdev, -1);
+
+    index = m_serialIndex.value(device.toUpper(), -1);
+
+    if (index >= 0)
+        return index;
+
+    return m_partUUIDIndex.value(device.toUpper(), -1);
+}
+
+QJsonObject DDeviceTopology::toJson(int index, const QString &parent, bool sort) const
+{
+    const Node &node = m_nodes.at(index);
+    QJsonObject obj = node.properties;
+
+    obj.insert("pkname", toValue(parent));
+    obj.insert("mountpoint", toValue(m_mounts.value(node.devno)));
+
+    if (node.children.isEmpty())
+        return obj;
+
+    QVector<int> children = node.children;
+
+    if (sort) {
+        std::stable_sort(children.begin(), children.end(), [this] (int index1, int index2) {
+            return m_nodes.at(index1).properties.value("name").toString() < m_nodes.at(index2).properties.value("name").toString();
+        });
+    }
+
+    QJsonArray array;
+
+    for (int child : children)
+        array.append(toJson(child, "/dev/" + node.kname, sort));
+
+    obj.insert("children", array);
+
+    return obj;
+}
@@ -0,0 +1,73 @@
+// SPDX-FileCopyrightText: 2022 UnionTech Software Technology Co., Ltd.
+//
+// SPDX-License-Identifier: GPL-3.0-only
+
+#ifndef DDEVICETOPOLOGY_H
+#define DDEVICETOPOLOGY_H
+
+#include <QHash>
+#include <QJsonArray>
+#include <QJsonObject>
+#include <QMutex>
+#include <QSet>
+#include <QString>
+#include <QStringList>
+#include <QVector>
+
+// The block devices in the shape of "lsblk -J -b -p", built in process from /sys/class/block,
+// the udev database, /proc/self/mountinfo and the partition tables on the disks.
+// The snapshot is kept until a block uevent arrives, the mount points until the mount table changes.
+class DDeviceTopology
+{
+public:
+    static DDeviceTopology *instance();
+
+    // the devices and their descendants, all the top level devices if none is given.
+    // list flattens the tree as "lsblk -l" and sort orders the devices by name as "lsblk -x NAME"
+    QJsonArray devices(const QStringList &devices = QStringList(), bool list = false, bool sort = false);
+    // the device by name, kname, any path to it, the serial of a disk or a partuuid; empty if not found
+    QJsonObject device(const QString &device);
+    // for the changes the kernel does not announce, such as a new partition table with the same partitions.
+    // the partition table of the device written, or of its disk, is read from the disk on the next rebuild
+    void invalidate(const QString &device = QString());
+
+private:
+    DDeviceTopology();
+    ~DDeviceTopology();
+    Q_DISABLE_COPY(DDeviceTopology)
+
+    struct Node {
+        QString kname;
+        quint64 devno = 0;
+        // the columns of lsblk except pkname and mountpoint, which depend on the time and the parent
+        QJsonObject properties;
+        // the disk of a partition or the first slave of a holder
+        int parent = -1;
+        // the partitions by number then the holders
+        QVector<int> children;
+    };
+
+    void update();
+    bool checkEvents();
+    void rebuild();
+    void readMountInfo();
+    int indexOf(const QString &device) const;
+    QJsonObject toJson(int index, const QString &parent, bool sort) const;
+
+    QMutex m_mutex;
+    int m_ueventFd = -1;
+    int m_mountInfoFd = -1;
+    bool m_outdated = true;
+    bool m_mountsOutdated = true;
+    QVector<Node> m_nodes;
+    QVector<int> m_topLevel;
+    QHash<QString, int> m_nameIndex;
+    QHash<quint64, int> m_devnoIndex;
+    QHash<QString, int> m_serialIndex;
+    QHash<QString, int> m_partUUIDIndex;
+    QHash<quint64, QString> m_mounts;
+    // the devices passed to invalidate() since the last rebuild
+    QSet<quint64> m_writtenDevices;
+};
+
+#endif // DDEVICETOPOLOGY_H
@@ -9,6 +9,7 @@
 #include "helper.h"
 #include "ddevicediskinfo.h"
 #include "dfilediskinfo.h"
+#include "dstreamdiskinfo.h"
 
 #include <QJsonDocument>
 #include <QJsonObject>
@@ -195,6 +196,11 @@ bool DDiskInfo::atEnd() const
     return d->atEnd();
 }
 
+int DDiskInfo::streamDescriptor(QList<int> *outputDescriptors) const
+{
+    return d->streamDescriptor(outputDescriptors);
+}
+
 QString DDiskInfo::filePath() const
 {
     return d->filePath();
@@ -320,11 +326,13 @@ QString DDiskInfo::errorString() const
     return d->errorString();
 }
 
-DDiskInfo DDiskInfo::getInfo(const QString &file)
+DDiskInfo DDiskInfo::getInfo(const QString &file, ScopeMode mode)
 {
     DDiskInfo info;
 
-    if (Helper::isBlockSpecialFile(file)) {
+    if (DStreamDiskInfo::isStreamFile(file)) {
+        info = DStreamDiskInfo(mode);
+    } else if (Helper::isBlockSpecialFile(file)) {
         info = DDeviceDiskInfo(file);
     } else {
         QFileInfo file_info(file);
@@ -69,6 +69,10 @@ public:
 
     bool atEnd() const;
 
+    // -1 if the data of the current scope does not go through a pipe, the pipes in outputDescriptors
+    // must be drained while the data is moved past read() and write()
+    int streamDescriptor(QList<int> *outputDescriptors = 0) const;
+
     QString filePath() const;
     QString model() const;
     // device name
@@ -99,7 +103,8 @@ public:
     inline operator bool() const
     { return d;}
 
-    static DDiskInfo getInfo(const QString &file);
+    // "-" is the standard input in the Read mode, the standard output in the Write mode
+    static DDiskInfo getInfo(const QString &file, ScopeMode mode = Read);
 
 protected:
     explicit DDiskInfo(DDiskInfoPrivate *dd);
@@ -112,6 +117,7 @@ private:
     friend class DDiskInfoPrivate;
     friend class DDeviceDiskInfoPrivate;
     friend class DFileDiskInfoPrivate;
+    friend class DStreamDiskInfoPrivate;
     friend bool operator==(const DDiskInfo &first, const DDiskInfo &second);
 };
 
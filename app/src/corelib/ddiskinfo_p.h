@@ -14,6 +14,7 @@ class DDiskInfoPrivate : public QSharedData
 {
 public:
     DDiskInfoPrivate(DDiskInfo *qq);
+    virtual ~DDiskInfoPrivate() {}
 
     void initFromJson(const QByteArray &json);
 
@@ -36,6 +37,10 @@ public:
 
     virtual bool atEnd() const = 0;
 
+    // the pipe of the process reading or writing the current scope, the kernel can move the data
+    // between two of them, the other output pipes of the process are appended to outputDescriptors
+    virtual int streamDescriptor(QList<int> *outputDescriptors) const {Q_UNUSED(outputDescriptors) return -1;}
+
     void setErrorString(const QString &error);
     virtual QString errorString() const;
 
@@ -8,6 +8,7 @@
 #include "dpartinfo_p.h"
 #include "dvirtualimagefileio.h"
 #include "dzlibfile.h"
+#include "dblockcodec.h"
 #include "helper.h"
 
 #include <QString>
@@ -21,6 +22,7 @@ class DFileDiskInfoPrivate : public DDiskInfoPrivate
 {
 public:
     DFileDiskInfoPrivate(DFileDiskInfo *qq);
+    ~DFileDiskInfoPrivate();
 
     void init(const QString &filePath, DVirtualImageFileIO *io);
 
@@ -48,6 +50,8 @@ public:
 
     QString m_filePath;
     DZlibFile m_file;
+    // the entries written by this object are committed to the dim file at once
+    bool m_session = false;
 };
 
 DFileDiskInfoPrivate::DFileDiskInfoPrivate(DFileDiskInfo *qq)
@@ -56,11 +60,30 @@ DFileDiskInfoPrivate::DFileDiskInfoPrivate(DFileDiskInfo *qq)
 
 }
 
+DFileDiskInfoPrivate::~DFileDiskInfoPrivate()
+{
+    // an unfinished clone keeps the entries written so far
+    if (m_session)
+        DVirtualImageFileIO(m_filePath).commit();
+}
+
 static QString getDIMFilePath(const QString &base, const QString &file)
 {
     return QString("dim://%1/%2").arg(base).arg(file);
 }
 
+// recorded in the entry table of the version 2 files, the other files are read from their stream head
+static qint64 uncompressedSize(const DVirtualImageFileIO &io, const QString &base, const QString &file)
+{
+    bool ok = false;
+    const qint64 size = io.attributes(file).value("uncompressedSize").toLongLong(&ok);
+
+    if (ok && size >= 0)
+        return size;
+
+    return DZlibFile(getDIMFilePath(base, file)).size();
+}
+
 void DFileDiskInfoPrivate::init(const QString &filePath, DVirtualImageFileIO *io)
 {
     Q_UNUSED(io)
@@ -151,6 +174,9 @@ bool DFileDiskInfoPrivate::openDataStream(int index)
 
     bool ok = true;
 
+    if (currentMode == DDiskInfo::Write && !m_session)
+        m_session = DVirtualImageFileIO(m_filePath).beginSession();
+
     if (currentMode == DDiskInfo::Read)
         ok = m_file.open(QIODevice::ReadOnly);
     else
@@ -167,13 +193,39 @@ bool DFileDiskInfoPrivate::openDataStream(int index)
 
 void DFileDiskInfoPrivate::closeDataStream()
 {
+    const bool write_mode = currentMode == DDiskInfo::Write && m_file.isOpen();
+
     m_file.close();
 
+    // the last blocks are written by close(), the size and the hash tree are complete after it
+    if (write_mode) {
+        QVariantMap attributes;
+
+        attributes["codec"] = DBlockCodec::typeName(m_file.codec());
+        attributes["blockSize"] = m_file.blockSize();
+        attributes["uncompressedSize"] = DZlibFile(m_file.fileName()).size();
+
+        if (!m_file.rootHash().isEmpty())
+            attributes["hash"] = QString::fromLatin1(m_file.rootHash().toHex());
+
+        DVirtualImageFileIO io(m_filePath);
+        const QString &file_name = m_file.fileName().mid(getDIMFilePath(m_filePath, QString()).size());
+
+        if (io.isValid() && io.version() > 1 && !io.setAttributes(file_name, attributes))
+            dCWarning("Failed to set the attributes of \"%s\"", qPrintable(m_file.fileName()));
+    }
+
     if (currentMode == DDiskInfo::Write && currentScope == DDiskInfo::JsonInfo) {
         DVirtualImageFileIO io(m_filePath);
 
-        if (io.isValid()) {
-            QFile::resize(m_filePath, io.metaDataSize() + io.fileDataSize());
+        // drop the space reserved by setTotalWritableDataSize(), the version 2 files keep the entry table at the end
+        if (m_session) {
+            m_session = false;
+
+            if (!io.commit())
+                setErrorString(QObject::tr("Failed to write the entry table of %1").arg(m_filePath));
+        } else if (io.isValid()) {
+            io.setSize(io.metaDataSize() + io.fileDataSize());
         }
 
         refresh();
@@ -197,7 +249,7 @@ qint64 DFileDiskInfoPrivate::totalReadableDataSize() const
     qint64 size = 0;
 
     for (const QString &file : io.fileList())
-        size += DZlibFile(getDIMFilePath(m_filePath, file)).size();
+        size += uncompressedSize(io, m_filePath, file);
 
     return size;
 }
@@ -205,15 +257,14 @@ qint64 DFileDiskInfoPrivate::totalReadableDataSize() const
 qint64 DFileDiskInfoPrivate::maxReadableDataSize() const
 {
     qint64 size = 0;
+    DVirtualImageFileIO io(m_filePath);
 
     if (children.isEmpty()) {
-        size = DZlibFile(getDIMFilePath(m_filePath, "headgear")).size();
+        size = io.isValid() ? uncompressedSize(io, m_filePath, "headgear") : -1;
 
         return size < 0 ? 0 : size;
     }
 
-    DVirtualImageFileIO io(m_filePath);
-
     for (int i = children.count() - 1; i >= 0; --i) {
         const QString &part_file_name = QString::number(i);
 
@@ -241,7 +292,7 @@ bool DFileDiskInfoPrivate::setTotalWritableDataSize(qint64 size)
     if (!io.isValid())
         return false;
 
-    return io.setSize(size + DVirtualImageFileIO::metaDataSize());
+    return io.setSize(size + io.metaDataSize());
 }
 
 qint64 DFileDiskInfoPrivate::read(char *data, qint64 maxSize)
@@ -338,6 +338,7 @@ private:
     friend class DDiskInfo;
     friend class DDeviceDiskInfo;
     friend class DFileDiskInfoPrivate;
+    friend class DStreamDiskInfoPrivate;
     friend class DDeviceDiskInfoPrivate;
     friend bool operator==(const DPartInfo &first, const DPartInfo &second);
 };
@@ -0,0 +1,1071 @@
+// SPDX-FileCopyrightText: 2022 UnionTech Software Technology Co., Ltd.
+//
+// SPDX-License-Identifier: GPL-3.0-only
+
+#include "dpartitiontable.h"
+#include "helper.h"
+
+#include <QDir>
+#include <QFile>
+#include <QFileInfo>
+#include <QRegularExpression>
+#include <QUuid>
+#include <QVector>
+#include <QtEndian>
+
+#include <algorithm>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <linux/blkpg.h>
+#include <linux/fs.h>
+
+#define MBR_ID_OFFSET 440
+#define MBR_TABLE_OFFSET 446
+#define MBR_ENTRY_SIZE 16
+#define MBR_SIGNATURE_OFFSET 510
+#define MBR_PROTECTIVE_TYPE 0xee
+// a loop in the chain of the extended boot records ends here
+#define MBR_MAX_LOGICAL_PARTITIONS 128
+
+#define GPT_SIGNATURE "EFI PART"
+#define GPT_REVISION 0x00010000
+#define GPT_HEADER_SIZE 92
+#define GPT_ENTRY_SIZE 128
+// the UEFI specification reserves at least 16 KiB for the entries
+#define GPT_MIN_ENTRY_COUNT 128
+#define GPT_MAX_ENTRY_COUNT 4096
+#define GPT_NAME_LENGTH 36
+
+// CRC-32 of IEEE 802.3, used by the GPT headers
+static quint32 crc32(const char *data, qint64 size)
+{
+    static const QVector<quint32> table = [] {
+        QVector<quint32> table(256);
+
+        for (quint32 i = 0; i < 256; ++i) {
+            quint32 crc = i;
+
+            for (int j = 0; j < 8; ++j)
+                crc = (crc & 1) ? (crc >> 1) ^ 0xedb88320 : crc >> 1;
+
+            table[i] = crc;
+        }
+
+        return table;
+    }();
+
+    quint32 crc = 0xffffffff;
+
+    for (qint64 i = 0; i < size; ++i)
+        crc = table.at((crc ^ uchar(data[i])) & 0xff) ^ (crc >> 8);
+
+    return crc ^ 0xffffffff;
+}
+
+// the first three fields are little endian on the disk
+static QString guidToString(const uchar *data)
+{
+    const QUuid uuid(qFromLittleEndian<quint32>(data), qFromLittleEndian<quint16>(data + 4), qFromLittleEndian<quint16>(data + 6),
+                     data[8], data[9], data[10], data[11], data[12], data[13], data[14], data[15]);
+
+    return uuid.toString().mid(1, 36).toUpper();
+}
+
+static bool guidToData(const QString &guid, uchar *data)
+{
+    const QUuid uuid(guid);
+
+    if (uuid.isNull())
+        return false;
+
+    qToLittleEndian<quint32>(uuid.data1, data);
+    qToLittleEndian<quint16>(uuid.data2, data + 4);
+    qToLittleEndian<quint16>(uuid.data3, data + 6);
+    memcpy(data + 8, uuid.data4, 8);
+
+    return true;
+}
+
+static bool isExtendedType(uint type)
+{
+    return type == 0x05 || type == 0x0f || type == 0x85;
+}
+
+static bool hasMBRSignature(const QByteArray &sector)
+{
+    return sector.size() >= 512 && uchar(sector.at(MBR_SIGNATURE_OFFSET)) == 0x55 && uchar(sector.at(MBR_SIGNATURE_OFFSET + 1)) == 0xaa;
+}
+
+static void setMBRSignature(QByteArray *sector)
+{
+    (*sector)[MBR_SIGNATURE_OFFSET] = char(0x55);
+    (*sector)[MBR_SIGNATURE_OFFSET + 1] = char(0xaa);
+}
+
+// the CHS fields say "beyond 8 GiB", the LBA fields are used by every current system
+static void setMBREntry(uchar *entry, bool bootable, uchar type, quint64 start, quint64 size)
+{
+    static const uchar chs[3] = {0xfe, 0xff, 0xff};
+
+    entry[0] = bootable ? 0x80 : 0x00;
+    memcpy(entry + 1, chs, 3);
+    entry[4] = type;
+    memcpy(entry + 5, chs, 3);
+    qToLittleEndian<quint32>(start, entry + 8);
+    qToLittleEndian<quint32>(size, entry + 12);
+}
+
+static QString attributesToString(quint64 attributes)
+{
+    static const char *names[] = {"RequiredPartition", "NoBlockIOProtocol", "LegacyBIOSBootable"};
+
+    QStringList list;
+    QStringList guid_bits;
+
+    for (int i = 0; i < 3; ++i) {
+        if (attributes & (Q_UINT64_C(1) << i))
+            list << names[i];
+    }
+
+    for (int i = 48; i < 64; ++i) {
+        if (attributes & (Q_UINT64_C(1) << i))
+            guid_bits << QString::number(i);
+    }
+
+    if (!guid_bits.isEmpty())
+        list << "GUID:" + guid_bits.join(',');
+
+    return list.join(' ');
+}
+
+static quint64 attributesFromString(const QString &string)
+{
+    quint64 attributes = 0;
+
+    for (const QString &item : string.split(QRegularExpression("\\s+"), QString::SkipEmptyParts)) {
+        if (item == "RequiredPartition") {
+            attributes |= 1;
+        } else if (item == "NoBlockIOProtocol") {
+            attributes |= 2;
+        } else if (item == "LegacyBIOSBootable") {
+            attributes |= 4;
+        } else if (item.startsWith("GUID:")) {
+            for (const QString &bit : item.mid(5).split(',', QString::SkipEmptyParts)) {
+                bool ok = false;
+                const int number = bit.toInt(&ok);
+
+                if (ok && number >= 0 && number < 64)
+                    attributes |= Q_UINT64_C(1) << number;
+            }
+        } else {
+            dCWarning("Unknown GPT partition attribute: %s", qPrintable(item));
+        }
+    }
+
+    return attributes;
+}
+
+// /dev/sda1, /dev/nvme0n1p1
+static QString partitionName(const QString &device, int number)
+{
+    if (!device.isEmpty() && device.at(device.size() - 1).isDigit())
+        return QString("%1p%2").arg(device).arg(number);
+
+    return device + QString::number(number);
+}
+
+// the fields of a partition line, split at the commas outside the quotes
+static QStringList splitFields(const QString &line)
+{
+    QStringList list;
+    QString field;
+    bool quoted = false;
+
+    for (const QChar &ch : line) {
+        if (ch == '"')
+            quoted = !quoted;
+
+        if (ch == ',' && !quoted) {
+            list << field.trimmed();
+            field.clear();
+        } else {
+            field.append(ch);
+        }
+    }
+
+    if (!field.trimmed().isEmpty())
+        list << field.trimmed();
+
+    return list;
+}
+
+static bool deviceGeometry(int fd, int *sectorSize, quint64 *size, bool *blockDevice)
+{
+    struct stat st;
+
+    if (fstat(fd, &st) < 0)
+        return false;
+
+    *blockDevice = S_ISBLK(st.st_mode);
+
+    if (!*blockDevice) {
+        *sectorSize = 512;
+        *size = st.st_size;
+
+        return true;
+    }
+
+    return ioctl(fd, BLKSSZGET, sectorSize) == 0 && ioctl(fd, BLKGETSIZE64, size) == 0;
+}
+
+static bool blkpg(int fd, int operation, int number, qint64 start, qint64 length)
+{
+    struct blkpg_partition partition;
+    struct blkpg_ioctl_arg arg;
+
+    memset(&partition, 0, sizeof(partition));
+    memset(&arg, 0, sizeof(arg));
+
+    partition.pno = number;
+    partition.start = start;
+    partition.length = length;
+    arg.op = operation;
+    arg.datalen = sizeof(partition);
+    arg.data = &partition;
+
+    return ioctl(fd, BLKPG, &arg) == 0;
+}
+
+DPartitionTable::DPartitionTable()
+{
+
+}
+
+bool DPartitionTable::isValid() const
+{
+    return m_type != DDiskInfo::Unknow;
+}
+
+DDiskInfo::PTType DPartitionTable::type() const
+{
+    return m_type;
+}
+
+QString DPartitionTable::labelId() const
+{
+    return m_labelId;
+}
+
+int DPartitionTable::sectorSize() const
+{
+    return m_sectorSize;
+}
+
+QList<DPartitionTable::Partition> DPartitionTable::partitions() const
+{
+    return m_partitions;
+}
+
+QString DPartitionTable::errorString() const
+{
+    return m_errorString;
+}
+
+bool DPartitionTable::read(const QString &device)
+{
+    *this = DPartitionTable();
+    m_device = device;
+
+    const int fd = ::open(QFile::encodeName(device).constData(), O_RDONLY | O_CLOEXEC);
+
+    if (fd < 0) {
+        setError(QObject::tr("Failed to open %1, error: %2").arg(device).arg(strerror(errno)));
+
+        return false;
+    }
+
+    quint64 size = 0;
+    bool block_device = false;
+    bool ok = false;
+
+    if (!deviceGeometry(fd, &m_sectorSize, &size, &block_device) || m_sectorSize < 512) {
+        setError(QObject::tr("Failed to get the size of %1, error: %2").arg(device).arg(strerror(errno)));
+    } else {
+        const QByteArray &mbr = readSectors(fd, 0, 1);
+        bool protective = false;
+
+        for (int i = 0; i < 4 && !mbr.isEmpty(); ++i)
+            protective = protective || uchar(mbr.at(MBR_TABLE_OFFSET + i * MBR_ENTRY_SIZE + 4)) == MBR_PROTECTIVE_TYPE;
+
+        if (mbr.isEmpty())
+            ok = false;
+        else if (!hasMBRSignature(mbr))
+            setError(QObject::tr("No partition table found on %1").arg(device));
+        else if (protective)
+            ok = readGPT(fd, size / m_sectorSize);
+        else
+            ok = readMBR(fd, mbr);
+    }
+
+    ::close(fd);
+
+    if (!ok) {
+        m_type = DDiskInfo::Unknow;
+        m_partitions.clear();
+    }
+
+    return ok;
+}
+
+bool DPartitionTable::write(const QString &device)
+{
+    if (!isValid()) {
+        setError(QObject::tr("Invalid partition table"));
+
+        return false;
+    }
+
+    m_device = device;
+
+    const int fd = ::open(QFile::encodeName(device).constData(), O_RDWR | O_CLOEXEC);
+
+    if (fd < 0) {
+        setError(QObject::tr("Failed to open %1, error: %2").arg(device).arg(strerror(errno)));
+
+        return false;
+    }
+
+    int sector_size = 0;
+    quint64 size = 0;
+    bool block_device = false;
+    bool ok = false;
+
+    if (!deviceGeometry(fd, &sector_size, &size, &block_device)) {
+        setError(QObject::tr("Failed to get the size of %1, error: %2").arg(device).arg(strerror(errno)));
+    } else if (sector_size != m_sectorSize) {
+        setError(QObject::tr("The sector size of %1 is %2, the partition table needs %3").arg(device).arg(sector_size).arg(m_sectorSize));
+    } else {
+        const quint64 sectors = size / m_sectorSize;
+        const QByteArray &mbr = readSectors(fd, 0, 1);
+
+        ok = !mbr.isEmpty();
+
+        for (const Partition &part : m_partitions) {
+            if (ok && part.start + part.size > sectors) {
+                setError(QObject::tr("Partition %1 does not fit on %2").arg(part.number).arg(device));
+                ok = false;
+            }
+        }
+
+        if (ok)
+            ok = m_type == DDiskInfo::GPT ? writeGPT(fd, mbr, sectors) : writeMBR(fd, mbr, sectors);
+
+        if (ok && fsync(fd) != 0) {
+            setError(QObject::tr("Failed to sync %1, error: %2").arg(device).arg(strerror(errno)));
+            ok = false;
+        }
+    }
+
+    ::close(fd);
+
+    if (ok) {
+        dCDebug("Wrote the %s partition table of %s, %d partitions", m_type == DDiskInfo::GPT ? "gpt" : "dos", qPrintable(device), m_partitions.count());
+    }
+
+    return ok;
+}
+
+bool DPartitionTable::updateKernel(const QString &device)
+{
+    struct KernelPartition {
+        int number;
+        // in bytes
+        qint64 start;
+        qint64 length;
+
+        bool operator==(const KernelPartition &other) const
+        {
+            return number == other.number && start == other.start && length == other.length;
+        }
+    };
+
+    const QString &sys_path = "/sys/class/block/" + QFileInfo(QFileInfo(device).canonicalFilePath()).fileName();
+
+    if (!QFile::exists(sys_path))
+        return true;
+
+    auto read_value = [] (const QString &fileName) {
+        QFile file(fileName);
+
+        return file.open(QIODevice::ReadOnly) ? file.readAll().trimmed().toLongLong() : -1;
+    };
+
+    QList<KernelPartition> current;
+    QList<KernelPartition> wanted;
+
+    // sysfs counts in 512 bytes sectors
+    for (const QString &name : QDir(sys_path).entryList(QDir::Dirs | QDir::NoDotAndDotDot)) {
+        const QString &path = sys_path + "/" + name;
+
+        if (QFile::exists(path + "/partition"))
+            current << KernelPartition{int(read_value(path + "/partition")), read_value(path + "/start") * 512, read_value(path + "/size") * 512};
+    }
+
+    for (const Partition &part : m_partitions) {
+        qint64 length = part.size * m_sectorSize;
+
+        // the kernel gives an extended partition just the room of a boot loader
+        if (m_type == DDiskInfo::MBR && isExtendedType(part.type.toUInt(0, 16)))
+            length = qMin<qint64>(length, qMax(m_sectorSize, 1024));
+
+        wanted << KernelPartition{part.number, qint64(part.start * m_sectorSize), length};
+    }
+
+    const int fd = ::open(QFile::encodeName(device).constData(), O_RDONLY | O_CLOEXEC);
+
+    if (fd < 0) {
+        setError(QObject::tr("Failed to open %1, error: %2").arg(device).arg(strerror(errno)));
+
+        return false;
+    }
+
+    bool ok = true;
+    int removed = 0;
+    int added = 0;
+
+    for (const KernelPartition &part : current) {
+        if (wanted.contains(part))
+            continue;
+
+        if (blkpg(fd, BLKPG_DEL_PARTITION, part.number, 0, 0)) {
+            ++removed;
+        } else {
+            dCWarning("Failed to remove the partition %d of %s from the kernel, error: %s", part.number, qPrintable(device), strerror(errno));
+            ok = false;
+        }
+    }
+
+    for (const KernelPartition &part : wanted) {
+        if (current.contains(part))
+            continue;
+
+        if (blkpg(fd, BLKPG_ADD_PARTITION, part.number, part.start, part.length)) {
+            ++added;
+        } else {
+            dCWarning("Failed to add the partition %d of %s to the kernel, error: %s", part.number, qPrintable(device), strerror(errno));
+            ok = false;
+        }
+    }
+
+    ::close(fd);
+
+    dCDebug("Updated the kernel partitions of %s, removed: %d, added: %d", qPrintable(device), removed, added);
+
+    if (!ok)
+        setError(QObject::tr("Failed to update the partitions of %1 in the kernel").arg(device));
+
+    return ok;
+}
+
+QByteArray DPartitionTable::toDump() const
+{
+    if (!isValid())
+        return QByteArray();
+
+    const bool gpt = m_type == DDiskInfo::GPT;
+    QString dump;
+
+    dump += QString("label: %1\n").arg(gpt ? "gpt" : "dos");
+    dump += QString("label-id: %1\n").arg(m_labelId);
+    dump += QString("device: %1\n").arg(m_device);
+    dump += "unit: sectors\n";
+
+    if (gpt) {
+        dump += QString("first-lba: %1\n").arg(m_firstLba);
+        dump += QString("last-lba: %1\n").arg(m_lastLba);
+
+        if (m_tableLength != GPT_MIN_ENTRY_COUNT)
+            dump += QString("table-length: %1\n").arg(m_tableLength);
+    }
+
+    dump += QString("sector-size: %1\n\n").arg(m_sectorSize);
+
+    for (const Partition &part : m_partitions) {
+        dump += QString("%1 : start=%2, size=%3, type=%4").arg(partitionName(m_device, part.number))
+                .arg(part.start, 12).arg(part.size, 12).arg(part.type);
+
+        if (gpt) {
+            dump += QString(", uuid=%1").arg(part.uuid);
+
+            if (!part.name.isEmpty())
+                dump += QString(", name=\"%1\"").arg(part.name);
+
+            if (part.attributes)
+                dump += QString(", attrs=\"%1\"").arg(attributesToString(part.attributes));
+        } else if (part.bootable) {
+            dump += ", bootable";
+        }
+
+        dump += "\n";
+    }
+
+    return dump.toUtf8();
+}
+
+DPartitionTable DPartitionTable::fromDump(const QByteArray &dump, const QString &device)
+{
+    DPartitionTable table;
+    int next_number = 1;
+    bool have_label = false;
+
+    // the dumps of the old sfdisk have no label line
+    table.m_type = DDiskInfo::MBR;
+
+    for (QString line : QString::fromUtf8(dump).split('\n')) {
+        line = line.trimmed();
+
+        if (line.isEmpty() || line.startsWith('#'))
+            continue;
+
+        const int colon = line.indexOf(':');
+        const int equal = line.indexOf('=');
+
+        if (equal < 0) {
+            if (colon < 0)
+                continue;
+
+            const QString &key = line.left(colon).trimmed().toLower();
+            const QString &value = line.mid(colon + 1).trimmed();
+
+            if (key == "label") {
+                have_label = true;
+
+                if (value == "gpt") {
+                    table.m_type = DDiskInfo::GPT;
+                } else if (value != "dos") {
+                    table.m_type = DDiskInfo::Unknow;
+                    table.setError(QObject::tr("Unsupported partition table type: %1").arg(value));
+
+                    return table;
+                }
+            } else if (key == "label-id") {
+                table.m_labelId = value;
+            } else if (key == "device") {
+                table.m_device = value;
+            } else if (key == "unit" && value != "sectors") {
+                table.m_type = DDiskInfo::Unknow;
+                table.setError(QObject::tr("Unsupported partition table unit: %1").arg(value));
+
+                return table;
+            } else if (key == "first-lba") {
+                table.m_firstLba = value.toULongLong();
+            } else if (key == "last-lba") {
+                table.m_lastLba = value.toULongLong();
+            } else if (key == "table-length") {
+                table.m_tableLength = qBound<quint32>(1, value.toUInt(), GPT_MAX_ENTRY_COUNT);
+            } else if (key == "sector-size") {
+                table.m_sectorSize = qMax(512, value.toInt());
+            }
+
+            continue;
+        }
+
+        Partition part;
+        QString fields = line;
+        int number = next_number;
+
+        // "/dev/sda1 : start=..."
+        if (colon >= 0 && colon < equal) {
+            const QRegularExpressionMatch &match = QRegularExpression("(\\d+)$").match(line.left(colon).trimmed());
+
+            if (match.hasMatch())
+                number = match.captured(1).toInt();
+
+            fields = line.mid(colon + 1);
+        }
+
+        for (const QString &field : splitFields(fields)) {
+            const int index = field.indexOf('=');
+            const QString &key = field.left(index).trimmed().toLower();
+            QString value = index < 0 ? QString() : field.mid(index + 1).trimmed();
+
+            if (value.size() > 1 && value.startsWith('"') && value.endsWith('"'))
+                value = value.mid(1, value.size() - 2);
+
+            if (key == "start")
+                part.start = value.toULongLong();
+            else if (key == "size")
+                part.size = value.toULongLong();
+            else if (key == "type" || key == "id")
+                part.type = value;
+            else if (key == "uuid")
+                part.uuid = value.toUpper();
+            else if (key == "name")
+                part.name = value;
+            else if (key == "attrs")
+                part.attributes = attributesFromString(value);
+            else if (key == "bootable")
+                part.bootable = true;
+        }
+
+        next_number = number + 1;
+
+        // the unused slots of the old dumps
+        if (part.size == 0)
+            continue;
+
+        part.number = number;
+
+        if (table.m_type == DDiskInfo::MBR) {
+            bool ok = false;
+            const uint type = (part.type.startsWith("0x", Qt::CaseInsensitive) ? part.type.mid(2) : part.type).toUInt(&ok, 16);
+
+            if (!ok || type == 0 || type > 0xff) {
+                table.m_type = DDiskInfo::Unknow;
+                table.setError(QObject::tr("Invalid type \"%1\" of partition %2").arg(part.type).arg(number));
+
+                return table;
+            }
+
+            part.type = QString::number(type, 16);
+        }
+
+        table.m_partitions << part;
+    }
+
+    // nothing to write, an empty table would wipe the disk
+    if (!have_label && table.m_partitions.isEmpty()) {
+        table.m_type = DDiskInfo::Unknow;
+        table.setError(QObject::tr("Invalid partition table"));
+    }
+
+    if (!device.isEmpty())
+        table.m_device = device;
+
+    return table;
+}
+
+bool DPartitionTable::readGPT(int fd, quint64 sectors)
+{
+    QByteArray entries;
+    quint32 entry_size = 0;
+
+    if (!readGPTHeader(fd, 1, sectors, &entries, &entry_size)) {
+        dCWarning("The primary GPT of %s is damaged, try the backup at the end of the disk", qPrintable(m_device));
+
+        if (sectors < 2 || !readGPTHeader(fd, sectors - 1, sectors, &entries, &entry_size)) {
+            setError(QObject::tr("No valid GPT header found on %1").arg(m_device));
+
+            return false;
+        }
+    }
+
+    m_type = DDiskInfo::GPT;
+
+    for (quint32 i = 0; i < m_tableLength; ++i) {
+        const uchar *entry = reinterpret_cast<const uchar*>(entries.constData()) + i * entry_size;
+        static const uchar unused[16] = {0};
+
+        if (memcmp(entry, unused, sizeof(unused)) == 0)
+            continue;
+
+        Partition part;
+        const quint64 first = qFromLittleEndian<quint64>(entry + 32);
+        const quint64 last = qFromLittleEndian<quint64>(entry + 40);
+
+        if (last < first)
+            continue;
+
+        part.number = i + 1;
+        part.type = guidToString(entry);
+        part.uuid = guidToString(entry + 16);
+        part.start = first;
+        part.size = last - first + 1;
+        part.attributes = qFromLittleEndian<quint64>(entry + 48);
+
+        for (int j = 0; j < GPT_NAME_LENGTH; ++j) {
+            const ushort ch = qFromLittleEndian<quint16>(entry + 56 + j * 2);
+
+            if (ch == 0)
+                break;
+
+            part.name.append(QChar(ch));
+        }
+
+        m_partitions << part;
+    }
+
+    return true;
+}
+
+bool DPartitionTable::readGPTHeader(int fd, quint64 lba, quint64 sectors, QByteArray *entries, quint32 *entrySize)
+{
+    QByteArray header = readSectors(fd, lba, 1);
+
+    if (header.isEmpty() || !header.startsWith(GPT_SIGNATURE))
+        return false;
+
+    const uchar *data = reinterpret_cast<const uchar*>(header.constData());
+    const quint32 header_size = qFromLittleEndian<quint32>(data + 12);
+    const quint32 header_crc = qFromLittleEndian<quint32>(data + 16);
+
+    if (header_size < GPT_HEADER_SIZE || header_size > quint32(m_sectorSize))
+        return false;
+
+    QByteArray crc_data = header.left(header_size);
+
+    qToLittleEndian<quint32>(0, reinterpret_cast<uchar*>(crc_data.data()) + 16);
+
+    if (crc32(crc_data.constData(), crc_data.size()) != header_crc || qFromLittleEndian<quint64>(data + 24) != lba)
+        return false;
+
+    const quint64 first_lba = qFromLittleEndian<quint64>(data + 40);
+    const quint64 last_lba = qFromLittleEndian<quint64>(data + 48);
+    const quint64 entries_lba = qFromLittleEndian<quint64>(data + 72);
+    const quint32 count = qFromLittleEndian<quint32>(data + 80);
+    const quint32 entry_size = qFromLittleEndian<quint32>(data + 84);
+
+    if (entry_size < GPT_ENTRY_SIZE || entry_size % 8 || count == 0 || count > GPT_MAX_ENTRY_COUNT
+            || first_lba > last_lba || last_lba >= sectors || entries_lba >= sectors)
+        return false;
+
+    const qint64 entries_size = qint64(count) * entry_size;
+
+    *entries = readSectors(fd, entries_lba, (entries_size + m_sectorSize - 1) / m_sectorSize).left(entries_size);
+
+    if (entries->size() != entries_size || crc32(entries->constData(), entries_size) != qFromLittleEndian<quint32>(data + 88))
+        return false;
+
+    *entrySize = entry_size;
+    m_labelId = guidToString(data + 56);
+    m_firstLba = first_lba;
+    m_lastLba = last_lba;
+    m_tableLength = count;
+
+    return true;
+}
+
+bool DPartitionTable::readMBR(int fd, const QByteArray &mbr)
+{
+    const uchar *data = reinterpret_cast<const uchar*>(mbr.constData());
+    quint64 extended_start = 0;
+    quint64 extended_size = 0;
+
+    m_type = DDiskInfo::MBR;
+    m_labelId = QString("0x%1").arg(qFromLittleEndian<quint32>(data + MBR_ID_OFFSET), 8, 16, QChar('0'));
+
+    for (int i = 0; i < 4; ++i) {
+        const uchar *entry = data + MBR_TABLE_OFFSET + i * MBR_ENTRY_SIZE;
+        Partition part;
+
+        part.number = i + 1;
+        part.bootable = entry[0] == 0x80;
+        part.start = qFromLittleEndian<quint32>(entry + 8);
+        part.size = qFromLittleEndian<quint32>(entry + 12);
+        part.type = QString::number(entry[4], 16);
+
+        if (entry[4] == 0 || part.size == 0)
+            continue;
+
+        if (isExtendedType(entry[4]) && !extended_start) {
+            extended_start = part.start;
+            extended_size = part.size;
+        }
+
+        m_partitions << part;
+    }
+
+    quint64 ebr = extended_start;
+
+    // the logical partitions are numbered from 5 in the order of the chain
+    for (int number = 5; ebr && number < 5 + MBR_MAX_LOGICAL_PARTITIONS; ++number) {
+        const QByteArray &sector = readSectors(fd, ebr, 1);
+
+        if (sector.isEmpty())
+            return false;
+
+        if (!hasMBRSignature(sector))
+            break;
+
+        const uchar *entry = reinterpret_cast<const uchar*>(sector.constData()) + MBR_TABLE_OFFSET;
+        const uchar *next = entry + MBR_ENTRY_SIZE;
+
+        if (entry[4] != 0 && qFromLittleEndian<quint32>(entry + 12) != 0) {
+            Partition part;
+
+            part.number = number;
+            part.bootable = entry[0] == 0x80;
+            part.start = ebr + qFromLittleEndian<quint32>(entry + 8);
+            part.size = qFromLittleEndian<quint32>(entry + 12);
+            part.type = QString::number(entry[4], 16);
+
+            m_partitions << part;
+        }
+
+        const quint64 next_ebr = extended_start + qFromLittleEndian<quint32>(next + 8);
+
+        if (!isExtendedType(next[4]) || next_ebr <= ebr || next_ebr >= extended_start + extended_size)
+            break;
+
+        ebr = next_ebr;
+    }
+
+    return true;
+}
+
+bool DPartitionTable::writeGPT(int fd, const QByteArray &mbr, quint64 sectors)
+{
+    const quint32 entry_count = qMax<quint32>(m_tableLength, GPT_MIN_ENTRY_COUNT);
+    const quint64 entry_sectors = (quint64(entry_count) * GPT_ENTRY_SIZE + m_sectorSize - 1) / m_sectorSize;
+
+    if (sectors < 2 * entry_sectors + 4) {
+        setError(QObject::tr("%1 is too small for a GPT").arg(m_device));
+
+        return false;
+    }
+
+    // the usable area follows the size of the target disk, the backup is at its end
+    const quint64 first_lba = qMax<quint64>(m_firstLba, 2 + entry_sectors);
+    const quint64 last_lba = sectors - 2 - entry_sectors;
+    QByteArray entries(entry_sectors * m_sectorSize, 0);
+
+    for (const Partition &part : m_partitions) {
+        if (part.number < 1 || quint32(part.number) > entry_count) {
+            setError(QObject::tr("Invalid number of partition %1").arg(part.number));
+
+            return false;
+        }
+
+        if (part.start < first_lba || part.start + part.size - 1 > last_lba) {
+            setError(QObject::tr("Partition %1 is outside of the usable sectors %2-%3").arg(part.number).arg(first_lba).arg(last_lba));
+
+            return false;
+        }
+
+        uchar *entry = reinterpret_cast<uchar*>(entries.data()) + (part.number - 1) * GPT_ENTRY_SIZE;
+
+        if (!guidToData(part.type, entry) || !guidToData(part.uuid.isEmpty() ? QUuid::createUuid().toString() : part.uuid, entry + 16)) {
+            setError(QObject::tr("Invalid type \"%1\" of partition %2").arg(part.type).arg(part.number));
+
+            return false;
+        }
+
+        qToLittleEndian<quint64>(part.start, entry + 32);
+        qToLittleEndian<quint64>(part.start + part.size - 1, entry + 40);
+        qToLittleEndian<quint64>(part.attributes, entry + 48);
+
+        for (int i = 0; i < qMin(part.name.size(), GPT_NAME_LENGTH); ++i)
+            qToLittleEndian<quint16>(part.name.at(i).unicode(), entry + 56 + i * 2);
+    }
+
+    const quint32 entries_crc = crc32(entries.constData(), qint64(entry_count) * GPT_ENTRY_SIZE);
+    const QString &disk_guid = QUuid(m_labelId).isNull() ? QUuid::createUuid().toString() : m_labelId;
+
+    auto make_header = [&] (quint64 lba, quint64 alternateLba, quint64 entriesLba) {
+        QByteArray header(m_sectorSize, 0);
+        uchar *data = reinterpret_cast<uchar*>(header.data());
+
+        memcpy(data, GPT_SIGNATURE, 8);
+        qToLittleEndian<quint32>(GPT_REVISION, data + 8);
+        qToLittleEndian<quint32>(GPT_HEADER_SIZE, data + 12);
+        qToLittleEndian<quint64>(lba, data + 24);
+        qToLittleEndian<quint64>(alternateLba, data + 32);
+        qToLittleEndian<quint64>(first_lba, data + 40);
+        qToLittleEndian<quint64>(last_lba, data + 48);
+        guidToData(disk_guid, data + 56);
+        qToLittleEndian<quint64>(entriesLba, data + 72);
+        qToLittleEndian<quint32>(entry_count, data + 80);
+        qToLittleEndian<quint32>(GPT_ENTRY_SIZE, data + 84);
+        qToLittleEndian<quint32>(entries_crc, data + 88);
+        qToLittleEndian<quint32>(crc32(header.constData(), GPT_HEADER_SIZE), data + 16);
+
+        return header;
+    };
+
+    // the boot code of the old sector 0 is kept, the only entry covers the whole disk
+    QByteArray protective_mbr = mbr;
+    uchar *entry = reinterpret_cast<uchar*>(protective_mbr.data()) + MBR_TABLE_OFFSET;
+
+    memset(entry, 0, 4 * MBR_ENTRY_SIZE);
+    setMBREntry(entry, false, MBR_PROTECTIVE_TYPE, 1, qMin<quint64>(sectors - 1, 0xffffffff));
+    // the CHS start of the protective entry is the sector following the MBR
+    entry[1] = 0x00;
+    entry[2] = 0x02;
+    entry[3] = 0x00;
+    setMBRSignature(&protective_mbr);
+
+    const quint64 backup_lba = sectors - 1;
+    const quint64 backup_entries_lba = backup_lba - entry_sectors;
+
+    // the primary header last, a crash before it leaves the old table or a valid backup
+    return writeSectors(fd, backup_entries_lba, entries)
+            && writeSectors(fd, backup_lba, make_header(backup_lba, 1, backup_entries_lba))
+            && writeSectors(fd, 2, entries)
+            && writeSectors(fd, 1, make_header(1, backup_lba, 2))
+            && writeSectors(fd, 0, protective_mbr);
+}
+
+bool DPartitionTable::writeMBR(int fd, QByteArray mbr, quint64 sectors)
+{
+    QList<Partition> logicals;
+    Partition extended;
+    uchar *table = reinterpret_cast<uchar*>(mbr.data()) + MBR_TABLE_OFFSET;
+
+    memset(table, 0, 4 * MBR_ENTRY_SIZE);
+
+    for (const Partition &part : m_partitions) {
+        const uint type = part.type.toUInt(0, 16);
+
+        if (part.number < 1 || type == 0 || type > 0xff) {
+            setError(QObject::tr("Invalid type \"%1\" of partition %2").arg(part.type).arg(part.number));
+
+            return false;
+        }
+
+        if (part.start + part.size > 0xffffffff) {
+            setError(QObject::tr("Partition %1 is beyond the 2 TiB limit of MBR").arg(part.number));
+
+            return false;
+        }
+
+        if (part.number > 4) {
+            logicals << part;
+
+            continue;
+        }
+
+        if (isExtendedType(type) && extended.size == 0)
+            extended = part;
+
+        setMBREntry(table + (part.number - 1) * MBR_ENTRY_SIZE, part.bootable, type, part.start, part.size);
+    }
+
+    if (!logicals.isEmpty() && extended.size == 0) {
+        setError(QObject::tr("The logical partitions need an extended partition"));
+
+        return false;
+    }
+
+    bool ok = true;
+
+    std::sort(logicals.begin(), logicals.end(), [] (const Partition &part1, const Partition &part2) {
+        return part1.number < part2.number;
+    });
+
+    // every logical partition is preceded by its boot record, placed in the gap after the previous one
+    if (extended.size > 0) {
+        const quint64 extended_end = extended.start + extended.size;
+        quint64 ebr = extended.start;
+
+        for (int i = 0; ok && i < logicals.count(); ++i) {
+            const Partition &part = logicals.at(i);
+
+            if (i > 0)
+                ebr = logicals.at(i - 1).start + logicals.at(i - 1).size;
+
+            if (ebr >= part.start || part.start + part.size > extended_end) {
+                setError(QObject::tr("No room for the boot record of partition %1").arg(part.number));
+
+                return false;
+            }
+
+            QByteArray sector(m_sectorSize, 0);
+            uchar *entry = reinterpret_cast<uchar*>(sector.data()) + MBR_TABLE_OFFSET;
+
+            setMBREntry(entry, part.bootable, part.type.toUInt(0, 16), part.start - ebr, part.size);
+
+            if (i + 1 < logicals.count()) {
+                const Partition &next = logicals.at(i + 1);
+                const quint64 next_ebr = part.start + part.size;
+
+                setMBREntry(entry + MBR_ENTRY_SIZE, false, 0x05, next_ebr - extended.start, next.start + next.size - next_ebr);
+            }
+
+            setMBRSignature(&sector);
+            ok = writeSectors(fd, ebr, sector);
+        }
+
+        // an empty chain, nothing is left of the old one
+        if (logicals.isEmpty()) {
+            QByteArray sector(m_sectorSize, 0);
+
+            setMBRSignature(&sector);
+            ok = writeSectors(fd, extended.start, sector);
+        }
+    }
+
+    // a GPT left by the previous table would still be found by some tools
+    for (quint64 lba : {Q_UINT64_C(1), sectors - 1}) {
+        const QByteArray &sector = readSectors(fd, lba, 1);
+
+        if (ok && sector.startsWith(GPT_SIGNATURE))
+            ok = writeSectors(fd, lba, QByteArray(m_sectorSize, 0));
+    }
+
+    bool id_ok = false;
+    const quint32 id = (m_labelId.startsWith("0x", Qt::CaseInsensitive) ? m_labelId.mid(2) : m_labelId).toUInt(&id_ok, 16);
+
+    if (id_ok)
+        qToLittleEndian<quint32>(id, reinterpret_cast<uchar*>(mbr.data()) + MBR_ID_OFFSET);
+
+    setMBRSignature(&mbr);
+
+    return ok && writeSectors(fd, 0, mbr);
+}
+
+QByteArray DPartitionTable::readSectors(int fd, quint64 lba, quint64 count)
+{
+    QByteArray data(count * m_sectorSize, 0);
+    qint64 done = 0;
+
+    while (done < data.size()) {
+        const ssize_t size = pread(fd, data.data() + done, data.size() - done, lba * m_sectorSize + done);
+
+        if (size < 0 && errno == EINTR)
+            continue;
+
+        if (size <= 0) {
+            setError(QObject::tr("Failed to read sector %1 of %2, error: %3").arg(lba).arg(m_device).arg(size < 0 ? strerror(errno) : "EOF"));
+
+            return QByteArray();
+        }
+
+        done += size;
+    }
+
+    return data;
+}
+
+bool DPartitionTable::writeSectors(int fd, quint64 lba, const QByteArray &data)
+{
+    qint64 done = 0;
+
+    while (done < data.size()) {
+        const ssize_t size = pwrite(fd, data.constData() + done, data.size() - done, lba * m_sectorSize + done);
+
+        if (size < 0 && errno == EINTR)
+            continue;
+
+        if (size <= 0) {
+            setError(QObject::tr("Failed to write sector %1 of %2, error: %3").arg(lba).arg(m_device).arg(strerror(errno)));
+
+            return false;
+        }
+
+        done += size;
+    }
+
+    return true;
+}
+
+void DPartitionTable::setError(const QString &error)
+{
+    m_errorString = error;
+
+    dCDebug("Partition table error: %s", qPrintable(error));
+}
@@ -0,0 +1,73 @@
+// SPDX-FileCopyrightText: 2022 UnionTech Software Technology Co., Ltd.
+//
+// SPDX-License-Identifier: GPL-3.0-only
+
+#ifndef DPARTITIONTABLE_H
+#define DPARTITIONTABLE_H
+
+#include "ddiskinfo.h"
+
+#include <QByteArray>
+#include <QList>
+#include <QString>
+
+// A GPT or MBR partition table read from and written to a disk without sfdisk.
+// The text form is the "sfdisk -d" dump, the format of the pt.json entry of the dim files,
+// so the images stay readable by both.
+class DPartitionTable
+{
+public:
+    struct Partition {
+        int number = 0;
+        // in sectors
+        quint64 start = 0;
+        quint64 size = 0;
+        // the type GUID of GPT, the hexadecimal system id of MBR
+        QString type;
+        QString uuid;
+        QString name;
+        quint64 attributes = 0;
+        bool bootable = false;
+    };
+
+    DPartitionTable();
+
+    bool isValid() const;
+    DDiskInfo::PTType type() const;
+    QString labelId() const;
+    int sectorSize() const;
+    QList<Partition> partitions() const;
+    QString errorString() const;
+
+    // the backup GPT is used if the primary one is damaged
+    bool read(const QString &device);
+    // both GPT copies and the protective MBR, or the MBR and the chain of the logical partitions
+    bool write(const QString &device);
+    // tells the kernel the partitions with the BLKPG ioctls, without rereading the whole disk
+    bool updateKernel(const QString &device);
+
+    QByteArray toDump() const;
+    static DPartitionTable fromDump(const QByteArray &dump, const QString &device = QString());
+
+private:
+    bool readGPT(int fd, quint64 sectors);
+    bool readGPTHeader(int fd, quint64 lba, quint64 sectors, QByteArray *entries, quint32 *entrySize);
+    bool readMBR(int fd, const QByteArray &mbr);
+    bool writeGPT(int fd, const QByteArray &mbr, quint64 sectors);
+    bool writeMBR(int fd, QByteArray mbr, quint64 sectors);
+    QByteArray readSectors(int fd, quint64 lba, quint64 count);
+    bool writeSectors(int fd, quint64 lba, const QByteArray &data);
+    void setError(const QString &error);
+
+    DDiskInfo::PTType m_type = DDiskInfo::Unknow;
+    QString m_device;
+    QString m_labelId;
+    int m_sectorSize = 512;
+    quint64 m_firstLba = 0;
+    quint64 m_lastLba = 0;
+    quint32 m_tableLength = 128;
+    QList<Partition> m_partitions;
+    QString m_errorString;
+};
+
+#endif // DPARTITIONTABLE_H
@@ -0,0 +1,543 @@
+// SPDX-FileCopyrightText: 2022 UnionTech Software Technology Co., Ltd.
+//
+// SPDX-License-Identifier: GPL-3.0-only
+
+#include "dpipeprocess.h"
+#include "helper.h"
+#include "../dglobal.h"
+
+#include <QFile>
+#include <QElapsedTimer>
+#include <QThread>
+#include <QVector>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <spawn.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+
+extern char **environ;
+
+// the tail of the standard error kept for the error message
+#define STANDARD_ERROR_SIZE 65536
+
+// the longest sleep between two checks without a pidfd
+#define EXIT_POLL_INTERVAL 50
+
+// a descriptor readable once the process exits, Linux 5.3 or later
+static int openPidFd(pid_t pid)
+{
+#ifdef SYS_pidfd_open
+    return syscall(SYS_pidfd_open, pid, 0);
+#else
+    Q_UNUSED(pid)
+    errno = ENOSYS;
+
+    return -1;
+#endif
+}
+
+// one block of the clone fits in the pipe, the unprivileged users are limited by pipe-max-size
+static void setPipeSize(int fd)
+{
+    if (fcntl(fd, F_SETPIPE_SZ, Global::bufferSize) >= 0)
+        return;
+
+    QFile file("/proc/sys/fs/pipe-max-size");
+    bool ok = false;
+    int max_size = 0;
+
+    if (file.open(QIODevice::ReadOnly))
+        max_size = file.readAll().trimmed().toInt(&ok);
+
+    if (!ok || max_size <= 0 || fcntl(fd, F_SETPIPE_SZ, qMin(max_size, Global::bufferSize)) < 0)
+        dCDebug("Failed to set the pipe size to %d, error: %s", Global::bufferSize, strerror(errno));
+}
+
+static void setNonBlocking(int fd)
+{
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+}
+
+// a pipe closed by the process fails with EPIPE instead of killing this process
+class SigPipeBlocker
+{
+public:
+    SigPipeBlocker()
+    {
+        sigemptyset(&m_set);
+        sigaddset(&m_set, SIGPIPE);
+        pthread_sigmask(SIG_BLOCK, &m_set, &m_oldSet);
+    }
+
+    ~SigPipeBlocker()
+    {
+        const timespec no_wait = {0, 0};
+
+        // drop the SIGPIPE raised while it was blocked
+        while (sigtimedwait(&m_set, NULL, &no_wait) > 0);
+
+        pthread_sigmask(SIG_SETMASK, &m_oldSet, NULL);
+    }
+
+private:
+    sigset_t m_set;
+    sigset_t m_oldSet;
+};
+
+DPipeProcess::DPipeProcess()
+{
+
+}
+
+DPipeProcess::~DPipeProcess()
+{
+    closeDescriptor(&m_dataFd);
+    closeDescriptor(&m_errorFd);
+
+    if (m_running) {
+        kill();
+        waitForFinished();
+    }
+
+    closeDescriptor(&m_pidFd);
+}
+
+bool DPipeProcess::waitForExit(pid_t pid, int msecs)
+{
+    const int fd = openPidFd(pid);
+
+    if (fd >= 0) {
+        pollfd pid_fd = {fd, POLLIN, 0};
+        QElapsedTimer timer;
+        int ret;
+
+        timer.start();
+
+        do {
+            ret = poll(&pid_fd, 1, msecs < 0 ? -1 : qMax<qint64>(0, msecs - timer.elapsed()));
+        } while (ret < 0 && errno == EINTR);
+
+        ::close(fd);
+
+        return ret > 0;
+    }
+
+    // already reaped
+    if (errno == ESRCH)
+        return true;
+
+    QElapsedTimer timer;
+    int interval = 1;
+
+    timer.start();
+
+    // peek at the child without reaping it, so that its owner still gets the exit status
+    forever {
+        siginfo_t info;
+
+        info.si_pid = 0;
+
+        if (waitid(P_PID, pid, &info, WEXITED | WNOHANG | WNOWAIT) < 0)
+            return ::kill(pid, 0) < 0 && errno == ESRCH;
+
+        if (info.si_pid == pid)
+            return true;
+
+        if (msecs >= 0 && timer.elapsed() >= msecs)
+            return false;
+
+        QThread::msleep(interval);
+        interval = qMin(interval * 2, EXIT_POLL_INTERVAL);
+    }
+}
+
+bool DPipeProcess::start(const QString &program, const QStringList &arguments, QIODevice::OpenMode mode)
+{
+    if (m_running) {
+        setError(QObject::tr("The process is already running"));
+
+        return false;
+    }
+
+    m_program = program;
+    m_arguments = arguments;
+    m_mode = mode;
+    m_reachedEnd = false;
+    m_exitCode = 0;
+    m_crashed = false;
+    m_standardError.clear();
+    m_errorString.clear();
+
+    int data_pipe[2];
+    int error_pipe[2];
+
+    if (pipe2(data_pipe, O_CLOEXEC) < 0) {
+        setError(QString::fromLocal8Bit(strerror(errno)));
+
+        return false;
+    }
+
+    if (pipe2(error_pipe, O_CLOEXEC) < 0) {
+        setError(QString::fromLocal8Bit(strerror(errno)));
+        ::close(data_pipe[0]);
+        ::close(data_pipe[1]);
+
+        return false;
+    }
+
+    const bool read_mode = mode & QIODevice::ReadOnly;
+
+    setPipeSize(data_pipe[0]);
+
+    posix_spawn_file_actions_t actions;
+
+    posix_spawn_file_actions_init(&actions);
+
+    if (read_mode) {
+        posix_spawn_file_actions_addopen(&actions, STDIN_FILENO, "/dev/null", O_RDONLY, 0);
+        posix_spawn_file_actions_adddup2(&actions, data_pipe[1], STDOUT_FILENO);
+    } else {
+        posix_spawn_file_actions_adddup2(&actions, data_pipe[0], STDIN_FILENO);
+        posix_spawn_file_actions_addopen(&actions, STDOUT_FILENO, "/dev/null", O_WRONLY, 0);
+    }
+
+    posix_spawn_file_actions_adddup2(&actions, error_pipe[1], STDERR_FILENO);
+
+    QList<QByteArray> args;
+
+    args << QFile::encodeName(program);
+
+    for (const QString &arg : arguments)
+        args << arg.toLocal8Bit();
+
+    QVector<char*> argv;
+
+    for (QByteArray &arg : args)
+        argv << arg.data();
+
+    argv << NULL;
+
+    const int ret = posix_spawnp(&m_pid, argv.first(), &actions, NULL, argv.data(), environ);
+
+    posix_spawn_file_actions_destroy(&actions);
+
+    // the ends of the child
+    ::close(read_mode ? data_pipe[1] : data_pipe[0]);
+    ::close(error_pipe[1]);
+
+    m_dataFd = read_mode ? data_pipe[0] : data_pipe[1];
+    m_errorFd = error_pipe[0];
+
+    if (ret != 0) {
+        setError(QString::fromLocal8Bit(strerror(ret)));
+        closeDescriptor(&m_dataFd);
+        closeDescriptor(&m_errorFd);
+
+        return false;
+    }
+
+    setNonBlocking(m_dataFd);
+    setNonBlocking(m_errorFd);
+
+    // the exit wakes up waitForFinished() at once, it falls back to short polls on the older kernels
+    closeDescriptor(&m_pidFd);
+    m_pidFd = openPidFd(m_pid);
+
+    m_running = true;
+
+    return true;
+}
+
+QString DPipeProcess::program() const
+{
+    return m_program;
+}
+
+QStringList DPipeProcess::arguments() const
+{
+    return m_arguments;
+}
+
+pid_t DPipeProcess::pid() const
+{
+    return m_pid;
+}
+
+bool DPipeProcess::isRunning()
+{
+    if (!m_running)
+        return false;
+
+    int status = 0;
+    const pid_t ret = waitpid(m_pid, &status, WNOHANG);
+
+    if (ret == m_pid) {
+        setExitStatus(status);
+    } else if (ret < 0 && errno == ECHILD) {
+        // reaped by someone else, the exit status is lost
+        setError(QString::fromLocal8Bit(strerror(errno)));
+        m_running = false;
+        closeDescriptor(&m_pidFd);
+    }
+
+    return m_running;
+}
+
+qint64 DPipeProcess::read(char *data, qint64 maxSize)
+{
+    if (m_dataFd < 0 || !(m_mode & QIODevice::ReadOnly))
+        return -1;
+
+    forever {
+        const ssize_t size = ::read(m_dataFd, data, maxSize);
+
+        if (size >= 0) {
+            if (size == 0)
+                m_reachedEnd = true;
+
+            return size;
+        }
+
+        if (errno == EINTR)
+            continue;
+
+        if (errno != EAGAIN) {
+            setError(QString::fromLocal8Bit(strerror(errno)));
+
+            return -1;
+        }
+
+        if (waitForData(POLLIN) < 0)
+            return -1;
+    }
+}
+
+qint64 DPipeProcess::write(const char *data, qint64 size)
+{
+    if (m_dataFd < 0 || !(m_mode & QIODevice::WriteOnly))
+        return -1;
+
+    SigPipeBlocker blocker;
+    qint64 written = 0;
+
+    while (written < size) {
+        const ssize_t count = ::write(m_dataFd, data + written, size - written);
+
+        if (count > 0) {
+            written += count;
+
+            continue;
+        }
+
+        if (count < 0 && errno == EINTR)
+            continue;
+
+        if (count < 0 && errno == EAGAIN) {
+            if (waitForData(POLLOUT) < 0)
+                break;
+
+            continue;
+        }
+
+        setError(QString::fromLocal8Bit(strerror(errno)));
+
+        break;
+    }
+
+    return written > 0 ? written : -1;
+}
+
+bool DPipeProcess::atEnd()
+{
+    if (m_dataFd < 0 || m_reachedEnd)
+        return true;
+
+    const int events = waitForData(POLLIN);
+
+    if (events < 0)
+        return true;
+
+    if (!(events & (POLLHUP | POLLERR)))
+        return false;
+
+    int size = 0;
+
+    // the data written before the process closed the pipe is still readable
+    if (ioctl(m_dataFd, FIONREAD, &size) == 0 && size > 0)
+        return false;
+
+    m_reachedEnd = true;
+
+    return true;
+}
+
+bool DPipeProcess::reachedEnd() const
+{
+    return m_reachedEnd;
+}
+
+void DPipeProcess::closeReadChannel()
+{
+    if (m_mode & QIODevice::ReadOnly)
+        closeDescriptor(&m_dataFd);
+}
+
+void DPipeProcess::closeWriteChannel()
+{
+    if (m_mode & QIODevice::WriteOnly)
+        closeDescriptor(&m_dataFd);
+}
+
+void DPipeProcess::terminate()
+{
+    if (m_running)
+        ::kill(m_pid, SIGTERM);
+}
+
+void DPipeProcess::kill()
+{
+    if (m_running)
+        ::kill(m_pid, SIGKILL);
+}
+
+bool DPipeProcess::waitForFinished(int msecs)
+{
+    QElapsedTimer timer;
+    int interval = 1;
+
+    timer.start();
+
+    while (isRunning()) {
+        int timeout = -1;
+
+        if (msecs >= 0) {
+            timeout = msecs - timer.elapsed();
+
+            if (timeout <= 0)
+                return false;
+        }
+
+        if (m_pidFd < 0) {
+            timeout = timeout < 0 ? interval : qMin(timeout, interval);
+            interval = qMin(interval * 2, EXIT_POLL_INTERVAL);
+        }
+
+        // the standard error is drained meanwhile, a full pipe would block the process
+        pollfd fds[2] = {{m_errorFd, POLLIN, 0}, {m_pidFd, POLLIN, 0}};
+
+        if (poll(fds, 2, timeout) < 0 && errno != EINTR) {
+            setError(QString::fromLocal8Bit(strerror(errno)));
+
+            return false;
+        }
+
+        if (m_errorFd >= 0 && fds[0].revents)
+            readStandardError();
+    }
+
+    // the output written just before the exit
+    while (m_errorFd >= 0 && readStandardError());
+
+    return true;
+}
+
+int DPipeProcess::exitCode() const
+{
+    return m_exitCode;
+}
+
+bool DPipeProcess::isCrashed() const
+{
+    return m_crashed;
+}
+
+QByteArray DPipeProcess::standardError() const
+{
+    return m_standardError;
+}
+
+QString DPipeProcess::errorString() const
+{
+    return m_errorString;
+}
+
+int DPipeProcess::dataDescriptor() const
+{
+    return m_dataFd;
+}
+
+int DPipeProcess::errorDescriptor() const
+{
+    return m_errorFd;
+}
+
+int DPipeProcess::waitForData(short events)
+{
+    forever {
+        pollfd fds[2] = {{m_dataFd, events, 0}, {m_errorFd, POLLIN, 0}};
+
+        if (poll(fds, m_errorFd < 0 ? 1 : 2, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+
+            setError(QString::fromLocal8Bit(strerror(errno)));
+
+            return -1;
+        }
+
+        if (m_errorFd >= 0 && fds[1].revents)
+            readStandardError();
+
+        if (fds[0].revents)
+            return fds[0].revents;
+    }
+}
+
+bool DPipeProcess::readStandardError()
+{
+    char data[4096];
+    const ssize_t size = ::read(m_errorFd, data, sizeof(data));
+
+    if (size > 0) {
+        m_standardError.append(data, size);
+        m_standardError.remove(0, qMax(0, m_standardError.size() - STANDARD_ERROR_SIZE));
+
+        return true;
+    }
+
+    if (size == 0 || (errno != EAGAIN && errno != EINTR))
+        closeDescriptor(&m_errorFd);
+
+    return false;
+}
+
+void DPipeProcess::closeDescriptor(int *fd)
+{
+    if (*fd < 0)
+        return;
+
+    ::close(*fd);
+    *fd = -1;
+}
+
+void DPipeProcess::setExitStatus(int status)
+{
+    m_running = false;
+    closeDescriptor(&m_pidFd);
+    m_crashed = !WIFEXITED(status);
+    m_exitCode = m_crashed ? -1 : WEXITSTATUS(status);
+}
+
+void DPipeProcess::setError(const QString &error)
+{
+    m_errorString = error;
+
+    dCDebug("The \"%s %s\" process error: %s", qPrintable(m_program), qPrintable(m_arguments.join(' ')), qPrintable(error));
+}
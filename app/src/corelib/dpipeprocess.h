@@ -0,0 +1,87 @@
+// SPDX-FileCopyrightText: 2022 UnionTech Software Technology Co., Ltd.
+//
+// SPDX-License-Identifier: GPL-3.0-only
+
+#ifndef DPIPEPROCESS_H
+#define DPIPEPROCESS_H
+
+#include <QByteArray>
+#include <QIODevice>
+#include <QString>
+#include <QStringList>
+
+#include <sys/types.h>
+
+// A child process streaming through raw pipes, used instead of QProcess for the clone data.
+// Nothing is buffered between the pipe and the caller: read() and write() block until the
+// kernel has room or data, so the memory stays bounded and a slow side throttles the other.
+// It has no thread affinity and no event loop, the standard error is drained while waiting.
+class DPipeProcess
+{
+public:
+    DPipeProcess();
+    ~DPipeProcess();
+
+    // ReadOnly reads the standard output, WriteOnly writes the standard input, the other is /dev/null
+    bool start(const QString &program, const QStringList &arguments, QIODevice::OpenMode mode);
+
+    QString program() const;
+    QStringList arguments() const;
+    pid_t pid() const;
+    bool isRunning();
+
+    // -1 on failure, 0 at the end of the standard output
+    qint64 read(char *data, qint64 maxSize);
+    // writes all the data unless the process fails
+    qint64 write(const char *data, qint64 size);
+    bool atEnd();
+    // read() or atEnd() has seen the end of the standard output, never blocks
+    bool reachedEnd() const;
+
+    void closeReadChannel();
+    void closeWriteChannel();
+    void terminate();
+    void kill();
+    // reaps the process as soon as it exits, false if it still runs after msecs
+    bool waitForFinished(int msecs = -1);
+
+    int exitCode() const;
+    bool isCrashed() const;
+    // the last bytes of the standard error
+    QByteArray standardError() const;
+    QString errorString() const;
+
+    // the pipe of the data and the pipe of the standard error, -1 if closed
+    int dataDescriptor() const;
+    int errorDescriptor() const;
+
+    // waits for the exit of any process without reaping it, true if it has exited
+    static bool waitForExit(pid_t pid, int msecs);
+
+private:
+    Q_DISABLE_COPY(DPipeProcess)
+
+    // waits for the events on the data pipe, the standard error is drained meanwhile
+    int waitForData(short events);
+    // false once nothing more is readable
+    bool readStandardError();
+    void closeDescriptor(int *fd);
+    void setExitStatus(int status);
+    void setError(const QString &error);
+
+    QString m_program;
+    QStringList m_arguments;
+    QIODevice::OpenMode m_mode = QIODevice::NotOpen;
+    pid_t m_pid = -1;
+    int m_dataFd = -1;
+    int m_errorFd = -1;
+    int m_pidFd = -1;
+    bool m_running = false;
+    bool m_reachedEnd = false;
+    int m_exitCode = 0;
+    bool m_crashed = false;
+    QByteArray m_standardError;
+    QString m_errorString;
+};
+
+#endif // DPIPEPROCESS_H
@@ -0,0 +1,415 @@
+// SPDX-FileCopyrightText: 2022 UnionTech Software Technology Co., Ltd.
+//
+// SPDX-License-Identifier: GPL-3.0-only
+
+#include "dstreamdiskinfo.h"
+#include "ddiskinfo_p.h"
+#include "dpartinfo_p.h"
+#include "dzlibiodevice.h"
+#include "helper.h"
+
+#include <QFile>
+#include <QBuffer>
+#include <QDataStream>
+#include <QJsonDocument>
+#include <QJsonObject>
+
+#include <unistd.h>
+
+#define STREAM_FILE "-"
+// "\xdd" "dis"
+#define STREAM_MAGIC 0xdd646973
+#define STREAM_VERSION 1
+#define RECORD_MAGIC 0xdd
+#define DRAIN_BUFFER_SIZE 1048576
+
+// The stream starts with the magic number and the version, followed by one record per scope:
+//   quint8 magic, quint8 scope, qint32 index, a sequential DZlibIODevice stream
+// The json info is always the first record, it describes the disk before any data arrives.
+class DStreamDiskInfoPrivate : public DDiskInfoPrivate
+{
+public:
+    DStreamDiskInfoPrivate(DStreamDiskInfo *qq, DDiskInfo::ScopeMode mode);
+
+    bool init();
+
+    QString filePath() const Q_DECL_OVERRIDE;
+    void refresh() Q_DECL_OVERRIDE;
+
+    bool hasScope(DDiskInfo::DataScope scope, DDiskInfo::ScopeMode mode, int index) const Q_DECL_OVERRIDE;
+    bool openDataStream(int index) Q_DECL_OVERRIDE;
+    void closeDataStream() Q_DECL_OVERRIDE;
+
+    qint64 readableDataSize(DDiskInfo::DataScope scope) const Q_DECL_OVERRIDE;
+
+    qint64 totalReadableDataSize() const Q_DECL_OVERRIDE;
+    qint64 maxReadableDataSize() const Q_DECL_OVERRIDE;
+    qint64 totalWritableDataSize() const Q_DECL_OVERRIDE;
+    bool setTotalWritableDataSize(qint64 size) Q_DECL_OVERRIDE;
+
+    qint64 read(char *data, qint64 maxSize) Q_DECL_OVERRIDE;
+    qint64 write(const char *data, qint64 maxSize) Q_DECL_OVERRIDE;
+
+    bool atEnd() const Q_DECL_OVERRIDE;
+
+    QString errorString() const Q_DECL_OVERRIDE;
+
+    bool readRecordHead();
+    bool skipRecord();
+
+    DDiskInfo::ScopeMode m_mode;
+    QFile m_stream;
+    DZlibIODevice m_record;
+    QBuffer m_jsonInfo;
+    QIODevice *m_device = nullptr;
+    bool m_headWritten = false;
+    // the head of the next record has been read, its data not yet
+    bool m_havePendingRecord = false;
+    DDiskInfo::DataScope m_recordScope = DDiskInfo::NullScope;
+    int m_recordIndex = 0;
+    qint64 m_totalReadableDataSize = 0;
+    qint64 m_maxReadableDataSize = 0;
+};
+
+DStreamDiskInfoPrivate::DStreamDiskInfoPrivate(DStreamDiskInfo *qq, DDiskInfo::ScopeMode mode)
+    : DDiskInfoPrivate(qq)
+    , m_mode(mode)
+{
+
+}
+
+// the records are written in the order of the clone job
+static qint64 recordOrder(DDiskInfo::DataScope scope, int index)
+{
+    return (qint64(scope) << 32) | quint32(index);
+}
+
+bool DStreamDiskInfoPrivate::init()
+{
+    name = STREAM_FILE;
+    kname = STREAM_FILE;
+    type = DDiskInfo::Disk;
+    ptType = DDiskInfo::Unknow;
+    havePartitionTable = false;
+
+    if (m_mode == DDiskInfo::Write) {
+        if (!m_stream.open(STDOUT_FILENO, QIODevice::WriteOnly | QIODevice::Unbuffered)) {
+            dCError("Failed to open the standard output, error: %s", qPrintable(m_stream.errorString()));
+
+            return false;
+        }
+
+        m_record.setDevice(&m_stream);
+        size = INT64_MAX;
+        typeName = "stream";
+
+        return true;
+    }
+
+    if (!m_stream.open(STDIN_FILENO, QIODevice::ReadOnly | QIODevice::Unbuffered)) {
+        dCError("Failed to open the standard input, error: %s", qPrintable(m_stream.errorString()));
+
+        return false;
+    }
+
+    QDataStream stream(&m_stream);
+
+    stream.setVersion(QDataStream::Qt_5_6);
+
+    quint32 magic = 0;
+    quint16 version = 0;
+
+    stream >> magic >> version;
+
+    if (stream.status() != QDataStream::Ok || magic != STREAM_MAGIC || version > STREAM_VERSION) {
+        dCError("The standard input is not a dim stream, magic: %x, version: %d", magic, version);
+
+        return false;
+    }
+
+    if (!readRecordHead() || m_recordScope != DDiskInfo::JsonInfo) {
+        dCError("The dim stream does not start with the disk info");
+
+        return false;
+    }
+
+    m_havePendingRecord = false;
+    m_record.setDevice(&m_stream);
+
+    if (!m_record.open(QIODevice::ReadOnly)) {
+        dCError("Failed to read the disk info, error: %s", qPrintable(m_record.errorString()));
+
+        return false;
+    }
+
+    const QByteArray &json = m_record.readAll();
+
+    m_record.close();
+
+    initFromJson(json);
+    m_jsonInfo.setData(json);
+
+    const QJsonObject &root = QJsonDocument::fromJson(json).object();
+
+    m_totalReadableDataSize = root.value("totalReadableDataSize").toString().toLongLong();
+    m_maxReadableDataSize = root.value("maxReadableDataSize").toString().toLongLong();
+    readonly = true;
+    typeName = "stream";
+
+    for (const DPartInfo &part : children) {
+        part.d->filePath = STREAM_FILE;
+        part.d->parentDiskFilePath = STREAM_FILE;
+        part.d->readonly = true;
+    }
+
+    return true;
+}
+
+QString DStreamDiskInfoPrivate::filePath() const
+{
+    return STREAM_FILE;
+}
+
+void DStreamDiskInfoPrivate::refresh()
+{
+    // a pipe can not be read again
+}
+
+bool DStreamDiskInfoPrivate::hasScope(DDiskInfo::DataScope scope, DDiskInfo::ScopeMode mode, int index) const
+{
+    if (mode != m_mode)
+        return false;
+
+    if (mode == DDiskInfo::Write)
+        return true;
+
+    // the scopes a disk device offers for reading, the stream has been written from them
+    switch (scope) {
+    case DDiskInfo::Headgear:
+        return havePartitionTable && (children.isEmpty() || children.first().sizeStart() >= 1048576);
+    case DDiskInfo::PartitionTable:
+        return havePartitionTable;
+    case DDiskInfo::Partition: {
+        const DPartInfo &info = q->getPartByNumber(index);
+
+        return info && !info.isExtended() && !(info.type() == DPartInfo::Unknow
+                                               && info.fileSystemType() == DPartInfo::Invalid
+                                               && info.guidType() == DPartInfo::InvalidGUID);
+    }
+    case DDiskInfo::JsonInfo:
+        return true;
+    default:
+        break;
+    }
+
+    return false;
+}
+
+bool DStreamDiskInfoPrivate::openDataStream(int index)
+{
+    if (currentMode == DDiskInfo::Write) {
+        QDataStream stream(&m_stream);
+
+        stream.setVersion(QDataStream::Qt_5_6);
+
+        if (!m_headWritten) {
+            stream << quint32(STREAM_MAGIC) << quint16(STREAM_VERSION);
+            m_headWritten = true;
+        }
+
+        stream << quint8(RECORD_MAGIC) << quint8(currentScope) << qint32(index);
+
+        if (stream.status() != QDataStream::Ok || !m_record.open(QIODevice::WriteOnly)) {
+            setErrorString(QObject::tr("Failed to write to the standard output, error: %1").arg(m_stream.errorString()));
+
+            return false;
+        }
+
+        m_device = &m_record;
+
+        return true;
+    }
+
+    // read at the beginning of the stream
+    if (currentScope == DDiskInfo::JsonInfo) {
+        m_jsonInfo.open(QIODevice::ReadOnly);
+        m_device = &m_jsonInfo;
+
+        return true;
+    }
+
+    forever {
+        if (!m_havePendingRecord && !readRecordHead()) {
+            setErrorString(QObject::tr("The %1 %2 is not in the stream").arg(scopeString(currentScope)).arg(index));
+
+            return false;
+        }
+
+        if (m_recordScope == currentScope && m_recordIndex == index)
+            break;
+
+        // the record was skipped by the writer, keep the later one for the next scope
+        if (recordOrder(m_recordScope, m_recordIndex) > recordOrder(currentScope, index)) {
+            setErrorString(QObject::tr("The %1 %2 is not in the stream").arg(scopeString(currentScope)).arg(index));
+
+            return false;
+        }
+
+        if (!skipRecord())
+            return false;
+    }
+
+    m_havePendingRecord = false;
+
+    if (!m_record.open(QIODevice::ReadOnly)) {
+        setErrorString(QObject::tr("Failed to read the standard input, error: %1").arg(m_record.errorString()));
+
+        return false;
+    }
+
+    m_device = &m_record;
+
+    return true;
+}
+
+void DStreamDiskInfoPrivate::closeDataStream()
+{
+    if (!m_device)
+        return;
+
+    // the next record starts after the end frame of this one
+    if (m_device == &m_record && currentMode == DDiskInfo::Read) {
+        QByteArray buffer(DRAIN_BUFFER_SIZE, Qt::Uninitialized);
+
+        while (!m_record.atEnd() && m_record.read(buffer.data(), buffer.size()) > 0);
+    }
+
+    m_device->close();
+    m_device = nullptr;
+
+    if (currentMode == DDiskInfo::Write && m_stream.error() != QFile::NoError)
+        setErrorString(QObject::tr("Failed to write to the standard output, error: %1").arg(m_stream.errorString()));
+}
+
+qint64 DStreamDiskInfoPrivate::readableDataSize(DDiskInfo::DataScope scope) const
+{
+    Q_UNUSED(scope)
+
+    return -1;
+}
+
+qint64 DStreamDiskInfoPrivate::totalReadableDataSize() const
+{
+    return m_totalReadableDataSize;
+}
+
+qint64 DStreamDiskInfoPrivate::maxReadableDataSize() const
+{
+    return m_maxReadableDataSize;
+}
+
+qint64 DStreamDiskInfoPrivate::totalWritableDataSize() const
+{
+    return m_mode == DDiskInfo::Write ? INT64_MAX : 0;
+}
+
+bool DStreamDiskInfoPrivate::setTotalWritableDataSize(qint64 size)
+{
+    Q_UNUSED(size)
+
+    // nothing to reserve on a pipe
+    return m_mode == DDiskInfo::Write;
+}
+
+qint64 DStreamDiskInfoPrivate::read(char *data, qint64 maxSize)
+{
+    if (!m_device)
+        return -1;
+
+    return m_device->read(data, maxSize);
+}
+
+qint64 DStreamDiskInfoPrivate::write(const char *data, qint64 maxSize)
+{
+    if (!m_device)
+        return -1;
+
+    return m_device->write(data, maxSize);
+}
+
+bool DStreamDiskInfoPrivate::atEnd() const
+{
+    return !m_device || m_device->atEnd();
+}
+
+QString DStreamDiskInfoPrivate::errorString() const
+{
+    if (!error.isEmpty())
+        return error;
+
+    return m_record.errorString();
+}
+
+bool DStreamDiskInfoPrivate::readRecordHead()
+{
+    QDataStream stream(&m_stream);
+
+    stream.setVersion(QDataStream::Qt_5_6);
+
+    quint8 magic = 0;
+    quint8 scope = DDiskInfo::NullScope;
+    qint32 index = 0;
+
+    stream >> magic >> scope >> index;
+
+    if (stream.status() != QDataStream::Ok)
+        return false;
+
+    if (magic != RECORD_MAGIC) {
+        dCError("Invalid record in the dim stream, magic: %x", magic);
+
+        return false;
+    }
+
+    m_recordScope = DDiskInfo::DataScope(scope);
+    m_recordIndex = index;
+    m_havePendingRecord = true;
+
+    return true;
+}
+
+bool DStreamDiskInfoPrivate::skipRecord()
+{
+    dCDebug("Skip the record of the stream, scope: %s, index: %d", qPrintable(scopeString(m_recordScope)), m_recordIndex);
+
+    m_havePendingRecord = false;
+
+    if (!m_record.open(QIODevice::ReadOnly)) {
+        setErrorString(QObject::tr("Failed to read the standard input, error: %1").arg(m_record.errorString()));
+
+        return false;
+    }
+
+    QByteArray buffer(DRAIN_BUFFER_SIZE, Qt::Uninitialized);
+
+    while (!m_record.atEnd() && m_record.read(buffer.data(), buffer.size()) > 0);
+
+    m_record.close();
+
+    return true;
+}
+
+DStreamDiskInfo::DStreamDiskInfo(DDiskInfo::ScopeMode mode)
+{
+    DStreamDiskInfoPrivate *dd = new DStreamDiskInfoPrivate(this, mode);
+
+    if (dd->init())
+        d = dd;
+    else
+        delete dd;
+}
+
+bool DStreamDiskInfo::isStreamFile(const QString &file)
+{
+    return file == STREAM_FILE;
+}
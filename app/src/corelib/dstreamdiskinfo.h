@@ -0,0 +1,25 @@
+// SPDX-FileCopyrightText: 2022 UnionTech Software Technology Co., Ltd.
+//
+// SPDX-License-Identifier: GPL-3.0-only
+
+#ifndef DSTREAMDISKINFO_H
+#define DSTREAMDISKINFO_H
+
+#include "../dglobal.h"
+#include "ddiskinfo.h"
+
+// A dim image on the standard input or output. The scopes are written one after another
+// to a pipe, so they can only be read back in the same order.
+class DStreamDiskInfoPrivate;
+class DStreamDiskInfo : public DDiskInfo
+{
+public:
+    explicit DStreamDiskInfo(DDiskInfo::ScopeMode mode);
+
+    static bool isStreamFile(const QString &file);
+
+private:
+    DG_DFUNC(DStreamDiskInfo)
+};
+
+#endif // DSTREAMDISKINFO_H
@@ -11,25 +11,79 @@
 #include <QCryptographicHash>
 #include <QFileInfo>
 #include <QDateTime>
+#include <QMutex>
+
+#include <functional>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <string.h>
+#include <sys/stat.h>
 
 #define FILE_NAME_LENGTH 63
+// Version 1: a 24 KiB head holding 80 bytes entries, the file count is a quint8
+#define V1_META_DATA_SIZE 24 * 1024
+#define V1_MAX_FILE_COUNT UINT8_MAX
+// Version 2: a small head, the file data, then the entry table and a fixed size trailer at the end
+// of the file, updating the entries never touches the head.
+#define V2_HEAD_SIZE 4096
+#define V2_TRAILER_SIZE 64
+#define V2_TRAILER_MAGIC Q_UINT64_C(0xdd44494d5441494c)
+#define V2_MAX_FILE_COUNT 65535
+#define DIM_VERSION 2
+// the digest of an entry samples the same amount of data for any entry size
+#define ENTRY_SAMPLE_COUNT 64
+#define ENTRY_SAMPLE_SIZE 1024
+#define ENTRY_TAIL_SAMPLE_SIZE 10 * 1024
+// the space allocated at once for an entry written next to others
+#define EXTENT_SIZE Q_INT64_C(64 * 1024 * 1024)
+// the offsets, sizes and buffers of O_DIRECT are aligned to the largest logical block size
+#define DIRECT_IO_ALIGNMENT 4096
+#define DIRECT_IO_BUFFER_SIZE (4 * 1024 * 1024)
+
+enum TailFlag {
+    // every entry stores the digest of its data samples, the checksum covers the entry table only
+    EntryDigestFlag = 0x01,
+    // the entries written in parallel store the extents following their first data range
+    EntryExtentFlag = 0x02
+};
 
+// Every instance has its own descriptor and entry cursor, the entry data is accessed with pread() and
+// pwrite(), so any number of instances may stream the entries of one image from different threads.
 class DVirtualImageFileIOPrivate : public QSharedData
 {
 public:
     ~DVirtualImageFileIOPrivate() {
-        for (const QString &file : dMap.keys()) {
-            if (dMap.value(file) == this) {
-                dMap.remove(file);
-            }
-        }
+        if (directFd >= 0)
+            ::close(directFd);
+
+        qFreeAligned(stage);
     }
 
     bool isValid = false;
 
     QFile file;
-
-    quint8 version;
+    // the position in the opened entry, the position of the descriptor is not used
+    qint64 cursor = 0;
+    // the entry data goes through this descriptor in the direct I/O mode, -1 otherwise
+    int directFd = -1;
+    // an aligned copy of the file data from stageOffset, the unaligned head and tail of the
+    // direct writes are merged with the data on the disk here
+    char *stage = nullptr;
+    qint64 stageOffset = -1;
+    qint64 stageSize = 0;
+    // the stage holds data not written yet
+    bool stageDirty = false;
+
+    quint8 version = DIM_VERSION;
+
+    struct Extent {
+        qint64 offset;
+        qint64 size;
+        // the space allocated for the extent, only kept in memory while the entry is written
+        qint64 capacity;
+    };
 
     struct FileInfo {
         FileInfo &operator=(const FileInfo &other) {
@@ -37,41 +91,133 @@ public:
             name = other.name;
             start = other.start;
             end = other.end;
+            attributes = other.attributes;
+            digest = other.digest;
+            capacity = other.capacity;
+            extents = other.extents;
 
             return *this;
         }
 
-        quint8 index;
+        int index;
         QString name;
+        // the first data range of the entry
         qint64 start;
         qint64 end;
+        // only stored in the version 2 files
+        QVariantMap attributes;
+        QByteArray digest;
+        // the space allocated after start, 0 if only the data range
+        qint64 capacity = 0;
+        // the data continues in these extents when the space after the first range was taken by another entry
+        QVector<Extent> extents;
     };
 
     QHash<QString, FileInfo> fileMap;
     QString openedFile;
+    quint32 flags = EntryDigestFlag;
 
     QStringList fileNameList() const;
     QVarLengthArray<FileInfo> fileList() const;
+    static QVarLengthArray<FileInfo> fileList(const QHash<QString, FileInfo> &map);
+    // the serialized entry table of the version 2 files, with the digests sampled from the file again if resample
+    QByteArray entryTable(bool resample = false);
+    static QByteArray entryTable(const QHash<QString, FileInfo> &map, quint32 flags);
+    QByteArray entryDigest(const FileInfo &info);
+    // samples the entries without a digest and sets the flags the table of map needs
+    void prepareTable(QHash<QString, FileInfo> &map, quint32 &flags);
+    // writes the table of map and a trailer pointing at it from offset, the file is neither synced nor truncated
+    bool writeTable(const QHash<QString, FileInfo> &map, quint32 flags, qint64 offset);
+    qint64 readAt(char *data, qint64 maxlen, qint64 offset);
+    qint64 writeAt(const char *data, qint64 len, qint64 offset);
+    // allocates the blocks up to size without changing the file size, the file is resized
+    // instead on the file systems without fallocate()
+    bool preallocate(qint64 size);
+    // frees the blocks allocated beyond the end of the file
+    void releaseSpace();
+    bool openDirect(bool write);
+    bool closeDirect();
+    bool flushStage();
+    qint64 readDirect(char *data, qint64 maxlen, qint64 offset);
+    qint64 writeDirect(const char *data, qint64 len, qint64 offset);
+
+    // the first range and the extents of an entry, in the order of the entry data
+    static int extentCount(const FileInfo &info);
+    static Extent extent(const FileInfo &info, int index);
+    static qint64 entrySize(const FileInfo &info);
+    static void resizeEntry(FileInfo &info, qint64 size);
+    // drops the space allocated beyond the data
+    static void trimEntry(FileInfo &info);
+    // the end of the data and the allocated space of all the entries
+    static qint64 allocationEnd(const QHash<QString, FileInfo> &map);
+    // where the next entry or extent starts, no block is shared by two entries in the direct I/O mode
+    static qint64 allocationStart(const QHash<QString, FileInfo> &map);
+    qint64 readEntry(const FileInfo &info, char *data, qint64 maxlen, qint64 pos);
+    // writes within the allocated space of the entry only
+    qint64 writeEntry(FileInfo &info, const char *data, qint64 len, qint64 pos);
+    // allocates space for at least size bytes of the entry, next to its data if nothing follows it
+    bool growEntry(const QString &fileName, qint64 size);
+
+    QString sessionKey() const;
+    bool inSession() const;
+    void saveSession();
+    // moves the table of the last commit past the space allocated in map, false if it failed
+    bool keepSessionTail(const QHash<QString, FileInfo> &map);
+    // copies the given entry and the opened entry of this instance to the session, applies the change
+    // to the table of the session and takes the table back, false if the file is not in a session
+    bool syncSession(const QString &fileName, const std::function<void(QHash<QString, FileInfo> &)> &change = nullptr);
+
+    // the parsed head or tail of an image, valid while the inode, the mtime and the size are unchanged
+    struct MetaData {
+        dev_t device;
+        ino_t inode;
+        qint64 mtime;
+        qint64 size;
+        quint8 version;
+        quint32 flags;
+        QHash<QString, FileInfo> fileMap;
+    };
+
+    bool loadMetaData();
+    void cacheMetaData();
+    void dropMetaData();
 
-    static thread_local QMap<QString, DVirtualImageFileIOPrivate*> dMap;
-    static QReadWriteLock dMapLock;
     static QMap<QByteArray, QByteArray> md5Cache;
+    static QMutex md5CacheLock;
+    // the entry tables of the images in a write session, shared by all the instances of a file
+    static QHash<QString, QHash<QString, FileInfo>> sessions;
+    // the writers of every session, the table is written when the last one commits
+    static QHash<QString, int> sessionRefs;
+
+    // the state of an image when its session began, its table stays at the end of the
+    // file after the space allocated in the session, so the image is readable until the commit
+    struct SessionTail {
+        QHash<QString, FileInfo> fileMap;
+        quint32 flags;
+        qint64 offset;
+    };
+
+    static QHash<QString, SessionTail> sessionTails;
+    static QMutex sessionLock;
+    // shared by all the instances and threads of the process, the GUI and the file manager plugin
+    // query the same image many times
+    static QHash<QString, MetaData> metaDataCache;
+    static QMutex metaDataLock;
 };
 
-thread_local QMap<QString, DVirtualImageFileIOPrivate*> DVirtualImageFileIOPrivate::dMap;
 QMap<QByteArray, QByteArray> DVirtualImageFileIOPrivate::md5Cache;
+QMutex DVirtualImageFileIOPrivate::md5CacheLock;
+QHash<QString, QHash<QString, DVirtualImageFileIOPrivate::FileInfo>> DVirtualImageFileIOPrivate::sessions;
+QHash<QString, int> DVirtualImageFileIOPrivate::sessionRefs;
+QHash<QString, DVirtualImageFileIOPrivate::SessionTail> DVirtualImageFileIOPrivate::sessionTails;
+QMutex DVirtualImageFileIOPrivate::sessionLock;
+QHash<QString, DVirtualImageFileIOPrivate::MetaData> DVirtualImageFileIOPrivate::metaDataCache;
+QMutex DVirtualImageFileIOPrivate::metaDataLock;
 
 DVirtualImageFileIO::DVirtualImageFileIO(const QString &fileName)
+    : d(new DVirtualImageFileIOPrivate())
 {
-    DVirtualImageFileIOPrivate *dd = DVirtualImageFileIOPrivate::dMap.value(fileName);
-
-    if (!dd || dd->file.isOpen()) {
-        d = new DVirtualImageFileIOPrivate();
-        DVirtualImageFileIOPrivate::dMap[fileName] = d.data();
-    } else {
-        d = dd;
-    }
-
+    // the parsed metadata is shared by the cache, the descriptor and the cursor are not
     setFile(fileName);
 }
 
@@ -119,8 +265,14 @@ bool DVirtualImageFileIO::setFile(const QString &fileName)
         return false;
     }
 
+    if (d->loadMetaData()) {
+        d->isValid = true;
+
+        return true;
+    }
+
     if (d->file.size() > 0) {
-        if (d->file.size() < metaDataSize()) {
+        if (d->file.size() < V2_HEAD_SIZE + V2_TRAILER_SIZE) {
             dCError("Not a valid dim file: %s", qPrintable(fileName));
 
             return false;
@@ -146,62 +298,53 @@ bool DVirtualImageFileIO::setFile(const QString &fileName)
 
         stream >> d->version;
 
-        if (d->version != 1) {
-            dCError("Unsupported version: %d", (int)d->version);
-
-            d->file.close();
+        bool ok = false;
 
-            return false;
-        }
+        if (d->version == 1) {
+            ok = readHead();
 
-        quint8 file_count;
+            if (ok && !Global::disableMD5CheckForDimFile)
+                d->cacheMetaData();
+        } else if (d->version == 2) {
+            QMutexLocker locker(&DVirtualImageFileIOPrivate::sessionLock);
 
-        stream >> file_count;
+            // the tail on the disk is out of date until the session is committed
+            if (DVirtualImageFileIOPrivate::sessions.contains(d->sessionKey())) {
+                d->fileMap = DVirtualImageFileIOPrivate::sessions.value(d->sessionKey());
+                d->flags = EntryDigestFlag;
+                ok = true;
+            } else {
+                locker.unlock();
+                ok = readTail();
 
-        if (d->file.size() < 3 + file_count * 80) {
-            dCError("Not a valid dim file");
+                // a head parsed without the checksum is not trusted by the next instances
+                if (ok && !Global::disableMD5CheckForDimFile)
+                    d->cacheMetaData();
+            }
+        } else {
+            dCError("Unsupported version: %d", (int)d->version);
+        }
 
+        if (!ok) {
             d->file.close();
 
             return false;
         }
+    } else if (d->file.open(QIODevice::ReadWrite)) {
+        d->version = DIM_VERSION;
+        d->flags = EntryDigestFlag;
+        d->fileMap.clear();
+        d->file.resize(V2_HEAD_SIZE);
+        d->file.putChar(0xdd);
+        d->file.putChar(DIM_VERSION);
 
-        for (quint8 i = 0; i < file_count; ++i) {
-            if (getData<quint8>(stream) != 0xdd) {
-                dCError("The %lldth character should be 0xdd", d->file.pos());
-
-                d->file.close();
-
-                return false;
-            }
-
-            DVirtualImageFileIOPrivate::FileInfo info;
-
-            info.name = QString::fromUtf8(d->file.read(FILE_NAME_LENGTH));
-            info.index = i;
-
-            stream >> info.start;
-            stream >> info.end;
-
-            d->fileMap[info.name] = info;
-        }
-
-        const QByteArray &md5 = d->file.read(16);
+        if (!writeTail()) {
+            dCError("Failed to write \"%s\", error: \"%s\"", qPrintable(fileName), qPrintable(d->file.errorString()));
 
-        if (!Global::disableMD5CheckForDimFile && md5 != md5sum()) {
-            dCError("MD5 check failed, file: %s, Is the file open in other application?", qPrintable(fileName));
+            d->file.close();
 
             return false;
         }
-    } else if (d->file.open(QIODevice::WriteOnly)) {
-        d->file.resize(metaDataSize());
-        d->file.putChar(0xdd);
-        d->file.putChar(0x01);
-        d->file.putChar(0x00);
-        // init md5 sum
-        uchar md5[16] = {0x21, 0x21, 0x5b, 0x9a, 0xf6, 0xd0, 0x5c, 0x31,
-                        0xd8, 0xcd, 0x42, 0xbb, 0xca, 0x12, 0x97, 0x7f};
-        d->file.write((char*)md5, 16);
     } else {
         dCError("Failed to open \"%s\", error: \"%s\"", qPrintable(fileName), qPrintable(d->file.errorString()));
 
@@ -216,7 +359,30 @@ bool DVirtualImageFileIO::setFile(const QString &fileName)
 
 bool DVirtualImageFileIO::setSize(qint64 size)
 {
-    return d->file.resize(size);
+    d->dropMetaData();
+
+    if (d->version == 1)
+        return d->file.resize(size);
+
+    // keep the entry table and the trailer at the end of the file
+    if (!d->file.open(QIODevice::ReadWrite))
+        return false;
+
+    const qint64 new_size = qMax(size, metaDataSize() + fileDataSize());
+    bool ok = true;
+
+    if (new_size < d->file.size()) {
+        ok = d->file.resize(new_size);
+        d->releaseSpace();
+    } else {
+        ok = d->preallocate(new_size);
+    }
+
+    ok = ok && saveTail();
+
+    d->file.close();
+
+    return ok;
 }
 
 bool DVirtualImageFileIO::isValid() const
@@ -246,6 +412,9 @@ bool DVirtualImageFileIO::open(const QString &fileName, QIODevice::OpenMode open
         if (!isWritable(fileName)) {
             return false;
         }
+
+        // the entry grows without a new tail until close()
+        d->dropMetaData();
     } else if (!existes(fileName)) {
         return false;
     }
@@ -254,12 +423,14 @@ bool DVirtualImageFileIO::open(const QString &fileName, QIODevice::OpenMode open
         addFile(fileName);
     }
 
-    if (!d->file.open(openMode | QIODevice::ReadOnly))
+    // the entry data bypasses the buffer of QFile, see read() and write()
+    if (!d->file.open(openMode | QIODevice::ReadOnly | QIODevice::Unbuffered))
         return false;
 
-    const DVirtualImageFileIOPrivate::FileInfo &info = d->fileMap.value(fileName);
+    if (Global::directIO)
+        d->openDirect(openMode & (QIODevice::WriteOnly | QIODevice::Append));
 
-    d->file.seek(info.start);
+    d->cursor = 0;
     d->openedFile = fileName;
 
     return true;
@@ -271,23 +442,25 @@ bool DVirtualImageFileIO::close()
         return false;
 
     const QFile::OpenMode open_mode = d->file.openMode();
+    // the staged data is written before the entry is updated
+    const bool direct_ok = d->closeDirect();
 
     if (open_mode.testFlag(QFile::WriteOnly)) {
         if (!d->openedFile.isEmpty()) {
             const DVirtualImageFileIOPrivate::FileInfo &info = d->fileMap.value(d->openedFile);
 
             d->file.close();
-            setSize(d->openedFile, info.end - info.start);
+            // updates the entry and its checksum, the space allocated beyond the data is released
+            setSize(d->openedFile, DVirtualImageFileIOPrivate::entrySize(info));
         } else {
-            d->openedFile.clear();
+            updateMD5sum();
         }
-
-        updateMD5sum();
     }
 
     d->file.close();
+    d->openedFile.clear();
 
-    return d->file.error() == QFile::NoError;
+    return direct_ok && d->file.error() == QFile::NoError;
 }
 
 qint64 DVirtualImageFileIO::pos() const
@@ -295,14 +468,10 @@ qint64 DVirtualImageFileIO::pos() const
     if (d->openedFile.isEmpty())
         return -1;
 
-    const DVirtualImageFileIOPrivate::FileInfo &info = d->fileMap.value(d->openedFile);
-
-    qint64 pos = d->file.pos();
-
-    if (pos < info.start || pos > info.end)
+    if (d->cursor > DVirtualImageFileIOPrivate::entrySize(d->fileMap.value(d->openedFile)))
         return -1;
 
-    return d->file.pos() - info.start;
+    return d->cursor;
 }
 
 bool DVirtualImageFileIO::seek(qint64 pos)
@@ -311,16 +480,16 @@ bool DVirtualImageFileIO::seek(qint64 pos)
         return false;
 
     if (d->openedFile.isEmpty())
-        return -1;
+        return false;
 
-    const DVirtualImageFileIOPrivate::FileInfo &info = d->fileMap.value(d->openedFile);
+    d->cursor = pos;
 
-    return d->file.seek(info.start + pos);
+    return true;
 }
 
 bool DVirtualImageFileIO::flush()
 {
-    return d->file.flush();
+    return d->flushStage() && d->file.flush();
 }
 
 bool DVirtualImageFileIO::isSequential() const
@@ -335,19 +504,52 @@ QFile::Permissions DVirtualImageFileIO::permissions() const
 
 qint64 DVirtualImageFileIO::read(char *data, qint64 maxlen)
 {
-    maxlen = qMin(maxlen, d->fileMap.value(d->openedFile).end - d->file.pos());
+    if (d->openedFile.isEmpty())
+        return -1;
 
-    return d->file.read(data, maxlen);
+    const DVirtualImageFileIOPrivate::FileInfo &info = d->fileMap.value(d->openedFile);
+
+    maxlen = qMin(maxlen, DVirtualImageFileIOPrivate::entrySize(info) - d->cursor);
+
+    if (maxlen <= 0)
+        return 0;
+
+    const qint64 size = d->readEntry(info, data, maxlen, d->cursor);
+
+    if (size > 0)
+        d->cursor += size;
+
+    return size;
 }
 
 qint64 DVirtualImageFileIO::write(const char *data, qint64 len)
 {
-    len = d->file.write(data, len);
+    if (d->openedFile.isEmpty())
+        return -1;
 
-    DVirtualImageFileIOPrivate::FileInfo &info = d->fileMap[d->openedFile];
-    info.end = qMax(info.end, d->file.pos());
+    qint64 written = 0;
+    bool grown = false;
 
-    return len;
+    while (written < len) {
+        // the reference is taken again, the table may be replaced by growEntry()
+        const qint64 size = d->writeEntry(d->fileMap[d->openedFile], data + written, len - written, d->cursor + written);
+
+        if (size < 0 || (size == 0 && grown))
+            break;
+
+        written += size;
+
+        if (written < len) {
+            grown = d->growEntry(d->openedFile, d->cursor + len);
+
+            if (!grown)
+                break;
+        }
+    }
+
+    d->cursor += written;
+
+    return written > 0 || len == 0 ? written : -1;
 }
 
 qint64 DVirtualImageFileIO::size(const QString &fileName) const
@@ -355,9 +557,7 @@ qint64 DVirtualImageFileIO::size(const QString &fileName) const
     if (!d->fileMap.contains(fileName))
         return -1;
 
-    const DVirtualImageFileIOPrivate::FileInfo &info = d->fileMap.value(fileName);
-
-    return info.end - info.start;
+    return DVirtualImageFileIOPrivate::entrySize(d->fileMap.value(fileName));
 }
 
 qint64 DVirtualImageFileIO::start(const QString &fileName) const
@@ -391,15 +591,34 @@ bool DVirtualImageFileIO::setSize(const QString &fileName, qint64 size)
     if (!d->file.open(QIODevice::ReadWrite))
         return false;
 
-    d->fileMap[fileName].end = d->fileMap.value(fileName).start + size;
-    d->file.seek(3 + d->fileMap.count() * 80 - 8);
+    if (d->version != 1 && size > DVirtualImageFileIOPrivate::entrySize(d->fileMap.value(fileName))
+            && !d->growEntry(fileName, size)) {
+        d->file.close();
 
-    QDataStream stream(&d->file);
+        return false;
+    }
 
-    stream.setVersion(QDataStream::Qt_5_6);
-    stream << d->fileMap.value(fileName).end;
+    DVirtualImageFileIOPrivate::FileInfo &info = d->fileMap[fileName];
+
+    if (d->version == 1) {
+        info.end = info.start + size;
+        d->dropMetaData();
+        d->file.seek(3 + d->fileMap.count() * 80 - 8);
+
+        QDataStream stream(&d->file);
+
+        stream.setVersion(QDataStream::Qt_5_6);
+        stream << info.end;
 
-    updateMD5sum();
+        updateMD5sum();
+    } else {
+        DVirtualImageFileIOPrivate::resizeEntry(info, size);
+        // the space allocated beyond the size is given back to the other entries
+        DVirtualImageFileIOPrivate::trimEntry(info);
+        // only this entry is sampled, the other digests are kept
+        info.digest = d->entryDigest(info);
+        saveTail(fileName);
+    }
 
     d->file.close();
 
@@ -411,14 +630,45 @@ bool DVirtualImageFileIO::rename(const QString &from, const QString &to)
     if (!existes(from))
         return false;
 
-    DVirtualImageFileIOPrivate::FileInfo info = d->fileMap.take(from);
+    if (existes(to))
+        return false;
 
-    info.name = to;
+    if (d->version != 1) {
+        bool open_in = false;
 
-    qint64 pos = d->file.pos();
+        if (!d->file.isOpen()) {
+            if (!d->file.open(QIODevice::ReadWrite))
+                return false;
 
-    if (!d->file.seek(3 + info.index * 80 + 1))
-        return false;
+            open_in = true;
+        }
+
+        auto rename_entry = [&] (QHash<QString, DVirtualImageFileIOPrivate::FileInfo> &map) {
+            DVirtualImageFileIOPrivate::FileInfo info = map.take(from);
+
+            info.name = to;
+            map[to] = info;
+        };
+
+        const qint64 pos = d->file.pos();
+        bool ok = true;
+
+        // the table of a session is written by commit()
+        if (!d->syncSession(QString(), rename_entry)) {
+            rename_entry(d->fileMap);
+            ok = writeTail();
+        }
+
+        if (d->openedFile == from)
+            d->openedFile = to;
+
+        if (open_in)
+            d->file.close();
+        else
+            d->file.seek(pos);
+
+        return ok;
+    }
 
     const QByteArray &file_name = to.toUtf8();
 
@@ -428,6 +678,18 @@ bool DVirtualImageFileIO::rename(const QString &from, const QString &to)
         return false;
     }
 
+    d->dropMetaData();
+
+    DVirtualImageFileIOPrivate::FileInfo info = d->fileMap.take(from);
+
+    info.name = to;
+    d->fileMap[to] = info;
+
+    qint64 pos = d->file.pos();
+
+    if (!d->file.seek(3 + info.index * 80 + 1))
+        return false;
+
     d->file.write(file_name);
 
     if (file_name.size() < FILE_NAME_LENGTH) {
@@ -446,24 +708,39 @@ bool DVirtualImageFileIO::isWritable(const QString &fileName)
     if (!existes(fileName))
         return true;
 
+    // the entries of the version 2 files grow by extents
+    if (d->version != 1)
+        return true;
+
     const DVirtualImageFileIOPrivate::FileInfo &info = d->fileMap.value(fileName);
 
     return info.index == d->fileMap.count() - 1;
 }
 
-int DVirtualImageFileIO::maxFileCount()
+int DVirtualImageFileIO::maxFileCount() const
 {
-    return UINT8_MAX;
+    return d->version == 1 ? V1_MAX_FILE_COUNT : V2_MAX_FILE_COUNT;
 }
 
-qint64 DVirtualImageFileIO::metaDataSize()
+qint64 DVirtualImageFileIO::metaDataSize() const
 {
-    return 24 * 1024;
+    if (d->version == 1)
+        return V1_META_DATA_SIZE;
+
+    return V2_HEAD_SIZE + d->entryTable().size() + V2_TRAILER_SIZE;
 }
 
 qint64 DVirtualImageFileIO::validMetaDataSize() const
 {
-    return 3 + d->fileMap.count() * 80;
+    if (d->version == 1)
+        return 3 + d->fileMap.count() * 80;
+
+    return V2_HEAD_SIZE + d->entryTable().size() + V2_TRAILER_SIZE;
+}
+
+qint64 DVirtualImageFileIO::dataOffset() const
+{
+    return d->version == 1 ? V1_META_DATA_SIZE : V2_HEAD_SIZE;
 }
 
 qint64 DVirtualImageFileIO::fileDataSize() const
@@ -471,18 +748,65 @@ qint64 DVirtualImageFileIO::fileDataSize() const
     if (d->fileMap.isEmpty())
         return 0;
 
+    if (d->version != 1)
+        return DVirtualImageFileIOPrivate::allocationEnd(d->fileMap) - dataOffset();
+
     qint64 max_end = 0;
 
     for (const DVirtualImageFileIOPrivate::FileInfo &info : d->fileMap) {
         max_end = qMax(max_end, info.end);
     }
 
-    return max_end - metaDataSize();
+    return max_end - dataOffset();
 }
 
 qint64 DVirtualImageFileIO::writableDataSize() const
 {
-    return d->file.size() - fileDataSize() - metaDataSize();
+    qint64 size = d->file.size();
+    struct stat st;
+
+    // the space allocated by setSize() is beyond the end of the file
+    if (d->version != 1 && ::stat(QFile::encodeName(d->file.fileName()).constData(), &st) == 0)
+        size = qMax(size, qint64(st.st_blocks) * 512);
+
+    return size - fileDataSize() - metaDataSize();
+}
+
+int DVirtualImageFileIO::version() const
+{
+    return d->version;
+}
+
+QVariantMap DVirtualImageFileIO::attributes(const QString &fileName) const
+{
+    return d->fileMap.value(fileName).attributes;
+}
+
+bool DVirtualImageFileIO::setAttributes(const QString &fileName, const QVariantMap &attributes)
+{
+    if (d->version == 1 || !existes(fileName))
+        return false;
+
+    bool open_in = false;
+
+    if (!d->file.isOpen()) {
+        if (!d->file.open(QIODevice::ReadWrite))
+            return false;
+
+        open_in = true;
+    }
+
+    d->fileMap[fileName].attributes = attributes;
+
+    const qint64 pos = d->file.pos();
+    bool ok = saveTail(fileName);
+
+    if (open_in)
+        d->file.close();
+    else
+        d->file.seek(pos);
+
+    return ok;
 }
 
 QStringList DVirtualImageFileIO::fileList() const
@@ -490,6 +814,91 @@ QStringList DVirtualImageFileIO::fileList() const
     return d->fileNameList();
 }
 
+bool DVirtualImageFileIO::beginSession()
+{
+    if (!isValid() || d->version == 1)
+        return false;
+
+    d->saveSession();
+
+    return true;
+}
+
+bool DVirtualImageFileIO::commit()
+{
+    {
+        QMutexLocker locker(&DVirtualImageFileIOPrivate::sessionLock);
+        const QString &key = d->sessionKey();
+
+        if (!DVirtualImageFileIOPrivate::sessions.contains(key))
+            return false;
+
+        // the other writers are still adding entries
+        if (--DVirtualImageFileIOPrivate::sessionRefs[key] > 0) {
+            locker.unlock();
+            d->syncSession(QString());
+
+            return true;
+        }
+
+        DVirtualImageFileIOPrivate::sessionRefs.remove(key);
+        DVirtualImageFileIOPrivate::sessionTails.remove(key);
+        d->fileMap = DVirtualImageFileIOPrivate::sessions.take(key);
+    }
+
+    // the space of an unfinished writer is released too
+    for (DVirtualImageFileIOPrivate::FileInfo &info : d->fileMap)
+        DVirtualImageFileIOPrivate::trimEntry(info);
+
+    bool open_in = false;
+
+    if (!d->file.isOpen()) {
+        if (!d->file.open(QIODevice::ReadWrite)) {
+            dCError("Failed to open \"%s\", error: \"%s\"", qPrintable(d->file.fileName()), qPrintable(d->file.errorString()));
+
+            return false;
+        }
+
+        open_in = true;
+    }
+
+    d->prepareTable(d->fileMap, d->flags);
+
+    const int fd = d->file.handle();
+    const qint64 data_end = dataOffset() + fileDataSize();
+    const qint64 tail_size = d->entryTable().size() + V2_TRAILER_SIZE;
+    // past the previous table, which stays valid until the new one is on the disk
+    const qint64 spare_offset = qMax(d->file.size(), data_end + tail_size);
+
+    // no table points at data that may not have reached the disk, a crash at any step
+    // leaves the previous or the new table at the end of the file
+    bool ok = d->file.flush() && ::fdatasync(fd) == 0
+            && d->writeTable(d->fileMap, d->flags, spare_offset) && ::fdatasync(fd) == 0
+            // then the final copy right after the data, the spare one is cut off once it is on the disk
+            && d->writeTable(d->fileMap, d->flags, data_end) && ::fdatasync(fd) == 0
+            && d->file.resize(data_end + tail_size) && ::fdatasync(fd) == 0;
+
+    if (ok) {
+        d->releaseSpace();
+        d->cacheMetaData();
+    } else {
+        dCError("Failed to write the entry table of \"%s\", error: %s", qPrintable(d->file.fileName()), strerror(errno));
+        d->dropMetaData();
+    }
+
+    if (open_in)
+        d->file.close();
+
+    dCDebug("Commit the dim file \"%s\", entries: %d, ok: %d", qPrintable(d->file.fileName()), d->fileMap.count(), ok);
+
+    return ok;
+}
+
+bool DVirtualImageFileIO::inSession() const
+{
+    return d->inSession();
+}
+
 bool DVirtualImageFileIO::updateMD5sum(const QString &fileName)
 {
     bool bak = Global::disableMD5CheckForDimFile;
@@ -502,10 +911,46 @@ bool DVirtualImageFileIO::updateMD5sum(const QString &fileName)
 
 bool DVirtualImageFileIO::addFile(const QString &name)
 {
+    if (d->fileMap.count() >= maxFileCount()) {
+        dCError("The number of files exceeds the limit: %d", maxFileCount());
+
+        return false;
+    }
+
+    if (d->version != 1) {
+        DVirtualImageFileIOPrivate::FileInfo info;
+
+        info.name = name;
+
+        auto add_entry = [&] (QHash<QString, DVirtualImageFileIOPrivate::FileInfo> &map) {
+            info.start = DVirtualImageFileIOPrivate::allocationStart(map);
+            info.end = info.start;
+            info.index = map.count();
+            map[name] = info;
+        };
+
+        // the entry starts after the space allocated by the other writers of the session
+        if (d->syncSession(QString(), add_entry))
+            return true;
+
+        if (!d->file.open(QIODevice::ReadWrite))
+            return false;
+
+        add_entry(d->fileMap);
+
+        bool ok = writeTail();
+
+        d->file.close();
+
+        return ok;
+    }
+
     if (!d->file.open(QIODevice::ReadWrite)) {
         return false;
     }
 
+    d->dropMetaData();
+
     qint64 start = validMetaDataSize();
 
     d->file.seek(start);
@@ -537,7 +982,7 @@ bool DVirtualImageFileIO::addFile(const QString &name)
     DVirtualImageFileIOPrivate::FileInfo info;
 
     info.name = name;
-    info.start = metaDataSize() + fileDataSize();
+    info.start = dataOffset() + fileDataSize();
     info.end = info.start;
     info.index = d->fileMap.count();
 
@@ -564,17 +1009,34 @@ QByteArray DVirtualImageFileIO::md5sum(bool readCache)
 
     key = QCryptographicHash::hash(key, QCryptographicHash::Md5);
 
-    if (readCache && d->md5Cache.contains(key))
-        return d->md5Cache.value(key);
+    if (readCache) {
+        QMutexLocker locker(&DVirtualImageFileIOPrivate::md5CacheLock);
+
+        if (d->md5Cache.contains(key))
+            return d->md5Cache.value(key);
+    }
 
     if (!d->file.isOpen())
         return QByteArray();
 
-    d->file.seek(0);
+    // the digests are sampled from the file again, the cost does not depend on the image size
+    if (d->version != 1 && (d->flags & EntryDigestFlag)) {
+        const QByteArray &data = QCryptographicHash::hash(d->entryTable(true), QCryptographicHash::Md5);
+        QMutexLocker locker(&DVirtualImageFileIOPrivate::md5CacheLock);
+
+        d->md5Cache[key] = data;
+
+        return data;
+    }
 
     QCryptographicHash md5(QCryptographicHash::Md5);
 
-    md5.addData(d->file.read(validMetaDataSize()));
+    if (d->version == 1) {
+        d->file.seek(0);
+        md5.addData(d->file.read(validMetaDataSize()));
+    } else {
+        md5.addData(d->entryTable());
+    }
 
     const int block_size = qMax(1024 * 1024, int(d->file.size() / 1000));
 
@@ -603,6 +1065,7 @@ QByteArray DVirtualImageFileIO::md5sum(bool readCache)
     }
 
     const QByteArray &data = md5.result();
+    QMutexLocker locker(&DVirtualImageFileIOPrivate::md5CacheLock);
 
     d->md5Cache[key] = data;
 
@@ -629,6 +1092,17 @@ bool DVirtualImageFileIO::updateMD5sum()
     bool ok = true;
 
     do {
+        // the checksum is a part of the trailer, all the entries are sampled again
+        if (d->version != 1) {
+            for (DVirtualImageFileIOPrivate::FileInfo &info : d->fileMap)
+                info.digest.clear();
+
+            ok = saveTail();
+            break;
+        }
+
+        d->dropMetaData();
+
         const QByteArray &md5 = md5sum(false);
 
         if (md5.isEmpty()) {
@@ -670,14 +1144,954 @@ QStringList DVirtualImageFileIOPrivate::fileNameList() const
 }
 
 QVarLengthArray<DVirtualImageFileIOPrivate::FileInfo> DVirtualImageFileIOPrivate::fileList() const
+{
+    return fileList(fileMap);
+}
+
+QVarLengthArray<DVirtualImageFileIOPrivate::FileInfo> DVirtualImageFileIOPrivate::fileList(const QHash<QString, FileInfo> &map)
 {
     QVarLengthArray<FileInfo> list;
 
-    list.resize(fileMap.size());
+    list.resize(map.size());
 
-    for (const FileInfo &info : fileMap) {
+    for (const FileInfo &info : map) {
         list[info.index] = info;
     }
 
     return list;
 }
+
+QByteArray DVirtualImageFileIOPrivate::entryTable(bool resample)
+{
+    if (!resample || !(flags & EntryDigestFlag))
+        return entryTable(fileMap, flags);
+
+    QHash<QString, FileInfo> map = fileMap;
+
+    for (FileInfo &info : map)
+        info.digest = entryDigest(info);
+
+    return entryTable(map, flags);
+}
+
+QByteArray DVirtualImageFileIOPrivate::entryTable(const QHash<QString, FileInfo> &map, quint32 flags)
+{
+    QByteArray table;
+    QDataStream stream(&table, QIODevice::WriteOnly);
+
+    stream.setVersion(QDataStream::Qt_5_6);
+
+    for (const FileInfo &info : fileList(map)) {
+        stream << info.name << info.start << info.end << info.attributes;
+
+        if (flags & EntryDigestFlag)
+            stream << info.digest;
+
+        if (flags & EntryExtentFlag) {
+            stream << quint32(info.extents.count());
+
+            for (const Extent &extent : info.extents)
+                stream << extent.offset << extent.size;
+        }
+    }
+
+    return table;
+}
+
+QByteArray DVirtualImageFileIOPrivate::entryDigest(const FileInfo &info)
+{
+    QCryptographicHash md5(QCryptographicHash::Md5);
+    const qint64 size = entrySize(info);
+    const qint64 tail_size = qMin(size, qint64(ENTRY_TAIL_SAMPLE_SIZE));
+    const qint64 stride = qMax(qint64(ENTRY_SAMPLE_SIZE), size / ENTRY_SAMPLE_COUNT);
+
+    QByteArray sample(qMax(qint64(ENTRY_SAMPLE_SIZE), tail_size), Qt::Uninitialized);
+
+    md5.addData(QByteArray::number(size));
+
+    for (qint64 offset = 0; offset + ENTRY_SAMPLE_SIZE <= size - tail_size; offset += stride) {
+        const qint64 read_size = readEntry(info, sample.data(), ENTRY_SAMPLE_SIZE, offset);
+
+        if (read_size < 0)
+            return QByteArray();
+
+        md5.addData(sample.constData(), read_size);
+    }
+
+    const qint64 read_size = readEntry(info, sample.data(), tail_size, size - tail_size);
+
+    if (read_size < 0)
+        return QByteArray();
+
+    md5.addData(sample.constData(), read_size);
+
+    return md5.result();
+}
+
+static ssize_t preadRetry(int fd, char *data, qint64 size, qint64 offset)
+{
+    ssize_t ret;
+
+    do {
+        ret = ::pread(fd, data, size, offset);
+    } while (ret < 0 && errno == EINTR);
+
+    return ret;
+}
+
+static qint64 pwriteFully(int fd, const char *data, qint64 size, qint64 offset)
+{
+    qint64 written = 0;
+
+    while (written < size) {
+        const ssize_t ret = ::pwrite(fd, data + written, size - written, offset + written);
+
+        if (ret < 0 && errno == EINTR)
+            continue;
+
+        if (ret <= 0)
+            return -1;
+
+        written += ret;
+    }
+
+    return written;
+}
+
+qint64 DVirtualImageFileIOPrivate::readAt(char *data, qint64 maxlen, qint64 offset)
+{
+    if (directFd >= 0)
+        return readDirect(data, maxlen, offset);
+
+    qint64 size = 0;
+
+    // QFile may hold buffered writes of the entry table
+    if (file.openMode().testFlag(QIODevice::WriteOnly) && !file.flush())
+        return -1;
+
+    while (size < maxlen) {
+        const ssize_t ret = preadRetry(file.handle(), data + size, maxlen - size, offset + size);
+
+        if (ret < 0) {
+            dCError("Failed to read \"%s\" at %lld, error: %s", qPrintable(file.fileName()), offset + size, strerror(errno));
+
+            return size > 0 ? size : -1;
+        }
+
+        if (ret == 0)
+            break;
+
+        size += ret;
+    }
+
+    return size;
+}
+
+bool DVirtualImageFileIOPrivate::preallocate(qint64 size)
+{
+    const qint64 file_size = file.size();
+
+    if (size <= file_size)
+        return true;
+
+    // unwritten extents, the data is laid out in order as the entries fill them
+    if (::fallocate(file.handle(), FALLOC_FL_KEEP_SIZE, file_size, size - file_size) == 0) {
+        dCDebug("Allocated %lld bytes for \"%s\"", size - file_size, qPrintable(file.fileName()));
+
+        return true;
+    }
+
+    if (errno != EOPNOTSUPP && errno != ENOSYS) {
+        dCError("Failed to allocate %lld bytes for \"%s\", error: %s", size - file_size, qPrintable(file.fileName()), strerror(errno));
+
+        return false;
+    }
+
+    dCDebug("fallocate is not supported for \"%s\", resize it", qPrintable(file.fileName()));
+
+    return file.resize(size);
+}
+
+void DVirtualImageFileIOPrivate::releaseSpace()
+{
+    struct stat st;
+
+    if (::fstat(file.handle(), &st) != 0)
+        return;
+
+    const qint64 allocated = qint64(st.st_blocks) * 512;
+
+    // not every file system frees the blocks kept by FALLOC_FL_KEEP_SIZE on truncate
+    if (allocated > st.st_size
+            && ::fallocate(file.handle(), FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, st.st_size, allocated) != 0
+            && errno != EOPNOTSUPP && errno != ENOSYS) {
+        dCWarning("Failed to free the space after the end of \"%s\", error: %s", qPrintable(file.fileName()), strerror(errno));
+    }
+}
+
+qint64 DVirtualImageFileIOPrivate::writeAt(const char *data, qint64 len, qint64 offset)
+{
+    if (directFd >= 0)
+        return writeDirect(data, len, offset);
+
+    if (pwriteFully(file.handle(), data, len, offset) < 0) {
+        dCError("Failed to write \"%s\" at %lld, error: %s", qPrintable(file.fileName()), offset, strerror(errno));
+
+        return -1;
+    }
+
+    return len;
+}
+
+bool DVirtualImageFileIOPrivate::openDirect(bool write)
+{
+    directFd = ::open(QFile::encodeName(file.fileName()).constData(), (write ? O_RDWR : O_RDONLY) | O_DIRECT | O_CLOEXEC);
+
+    if (directFd < 0) {
+        dCWarning("Failed to open \"%s\" for direct I/O, error: %s", qPrintable(file.fileName()), strerror(errno));
+
+        return false;
+    }
+
+    // one more block behind the data for merging the tail
+    if (!stage)
+        stage = static_cast<char*>(qMallocAligned(DIRECT_IO_BUFFER_SIZE + DIRECT_IO_ALIGNMENT, DIRECT_IO_ALIGNMENT));
+
+    stageOffset = -1;
+    stageSize = 0;
+    stageDirty = false;
+
+    return stage;
+}
+
+bool DVirtualImageFileIOPrivate::closeDirect()
+{
+    if (directFd < 0)
+        return true;
+
+    const bool ok = flushStage();
+
+    ::close(directFd);
+    directFd = -1;
+    stageOffset = -1;
+    stageSize = 0;
+
+    return ok;
+}
+
+bool DVirtualImageFileIOPrivate::flushStage()
+{
+    if (!stageDirty)
+        return true;
+
+    stageDirty = false;
+
+    const qint64 write_size = (stageSize + DIRECT_IO_ALIGNMENT - 1) / DIRECT_IO_ALIGNMENT * DIRECT_IO_ALIGNMENT;
+
+    // the rest of the last block is read back, it may hold data written before
+    if (write_size > stageSize) {
+        const qint64 block = write_size - DIRECT_IO_ALIGNMENT;
+        const ssize_t ret = preadRetry(directFd, stage + write_size, DIRECT_IO_ALIGNMENT, stageOffset + block);
+
+        if (ret < 0) {
+            dCError("Failed to read \"%s\" at %lld, error: %s", qPrintable(file.fileName()), stageOffset + block, strerror(errno));
+            stageOffset = -1;
+
+            return false;
+        }
+
+        for (qint64 i = stageSize; i < write_size; ++i)
+            stage[i] = i - block < ret ? stage[write_size + i - block] : 0;
+    }
+
+    if (pwriteFully(directFd, stage, write_size, stageOffset) < 0) {
+        dCError("Failed to write \"%s\" at %lld, error: %s", qPrintable(file.fileName()), stageOffset, strerror(errno));
+        stageOffset = -1;
+
+        return false;
+    }
+
+    // the data is on the disk, the stage is kept for reading
+    stageSize = write_size;
+
+    return true;
+}
+
+qint64 DVirtualImageFileIOPrivate::readDirect(char *data, qint64 maxlen, qint64 offset)
+{
+    if (!flushStage())
+        return -1;
+
+    qint64 size = 0;
+
+    while (size < maxlen) {
+        const qint64 pos = offset + size;
+
+        if (stageOffset < 0 || pos < stageOffset || pos >= stageOffset + stageSize) {
+            stageOffset = pos / DIRECT_IO_ALIGNMENT * DIRECT_IO_ALIGNMENT;
+            stageSize = preadRetry(directFd, stage, DIRECT_IO_BUFFER_SIZE, stageOffset);
+
+            if (stageSize < 0) {
+                dCError("Failed to read \"%s\" at %lld, error: %s", qPrintable(file.fileName()), stageOffset, strerror(errno));
+                stageOffset = -1;
+                stageSize = 0;
+
+                return size > 0 ? size : -1;
+            }
+
+            // the end of the file
+            if (pos >= stageOffset + stageSize)
+                break;
+        }
+
+        const qint64 copy_size = qMin(maxlen - size, stageOffset + stageSize - pos);
+
+        memcpy(data + size, stage + (pos - stageOffset), copy_size);
+        size += copy_size;
+    }
+
+    return size;
+}
+
+qint64 DVirtualImageFileIOPrivate::writeDirect(const char *data, qint64 len, qint64 offset)
+{
+    qint64 size = 0;
+
+    while (size < len) {
+        const qint64 pos = offset + size;
+
+        // a new stage starts where the data does not follow the staged data
+        if (!stageDirty || pos != stageOffset + stageSize || stageSize == DIRECT_IO_BUFFER_SIZE) {
+            if (!flushStage())
+                return -1;
+
+            stageOffset = pos / DIRECT_IO_ALIGNMENT * DIRECT_IO_ALIGNMENT;
+            stageSize = pos - stageOffset;
+
+            // the data before the position in the first block is kept
+            if (stageSize > 0) {
+                const ssize_t ret = preadRetry(directFd, stage, DIRECT_IO_ALIGNMENT, stageOffset);
+
+                if (ret < 0) {
+                    dCError("Failed to read \"%s\" at %lld, error: %s", qPrintable(file.fileName()), stageOffset, strerror(errno));
+                    stageOffset = -1;
+                    stageSize = 0;
+
+                    return -1;
+                }
+
+                if (ret < DIRECT_IO_ALIGNMENT)
+                    memset(stage + ret, 0, DIRECT_IO_ALIGNMENT - ret);
+            }
+
+            stageDirty = true;
+        }
+
+        const qint64 copy_size = qMin(len - size, DIRECT_IO_BUFFER_SIZE - stageSize);
+
+        memcpy(stage + stageSize, data + size, copy_size);
+        stageSize += copy_size;
+        size += copy_size;
+    }
+
+    return size;
+}
+
+QString DVirtualImageFileIOPrivate::sessionKey() const
+{
+    return QFileInfo(file).absoluteFilePath();
+}
+
+bool DVirtualImageFileIOPrivate::inSession() const
+{
+    QMutexLocker locker(&sessionLock);
+
+    return sessions.contains(sessionKey());
+}
+
+void DVirtualImageFileIOPrivate::saveSession()
+{
+    QMutexLocker locker(&sessionLock);
+    const QString &key = sessionKey();
+
+    // a writer joining the session takes the entries of the others
+    if (sessions.contains(key)) {
+        fileMap = sessions.value(key);
+    } else {
+        SessionTail tail {fileMap, flags, 0};
+
+        for (FileInfo &info : tail.fileMap)
+            trimEntry(info);
+
+        // the table read by readTail() ends the file
+        tail.offset = qMax(allocationEnd(tail.fileMap), file.size() - entryTable(tail.fileMap, flags).size() - V2_TRAILER_SIZE);
+
+        sessions[key] = fileMap;
+        sessionTails[key] = tail;
+    }
+
+    ++sessionRefs[key];
+}
+
+bool DVirtualImageFileIOPrivate::keepSessionTail(const QHash<QString, FileInfo> &map)
+{
+    auto it = sessionTails.find(sessionKey());
+
+    if (it == sessionTails.end())
+        return true;
+
+    const qint64 offset = allocationEnd(map);
+
+    if (offset <= it->offset)
+        return true;
+
+    // the new extent would overwrite the table, a copy goes after it first, the files written
+    // before the digests were added get them, the checksum of the trailer covers them
+    prepareTable(it->fileMap, it->flags);
+
+    if (!writeTable(it->fileMap, it->flags, offset) || ::fdatasync(file.handle()) != 0) {
+        dCError("Failed to move the entry table of \"%s\" to %lld", qPrintable(file.fileName()), offset);
+
+        return false;
+    }
+
+    dCDebug("Move the entry table of \"%s\" from %lld to %lld", qPrintable(file.fileName()), it->offset, offset);
+
+    it->offset = offset;
+
+    return true;
+}
+
+bool DVirtualImageFileIOPrivate::syncSession(const QString &fileName, const std::function<void(QHash<QString, FileInfo> &)> &change)
+{
+    QMutexLocker locker(&sessionLock);
+
+    auto it = sessions.find(sessionKey());
+
+    if (it == sessions.end())
+        return false;
+
+    // every entry has one writer, its own copy is the newest
+    if (!fileName.isEmpty() && fileMap.contains(fileName))
+        (*it)[fileName] = fileMap.value(fileName);
+
+    if (!openedFile.isEmpty() && fileMap.contains(openedFile))
+        (*it)[openedFile] = fileMap.value(openedFile);
+
+    if (change)
+        change(*it);
+
+    fileMap = *it;
+
+    return true;
+}
+
+int DVirtualImageFileIOPrivate::extentCount(const FileInfo &info)
+{
+    return info.extents.count() + 1;
+}
+
+DVirtualImageFileIOPrivate::Extent DVirtualImageFileIOPrivate::extent(const FileInfo &info, int index)
+{
+    if (index > 0)
+        return info.extents.at(index - 1);
+
+    const qint64 size = info.end - info.start;
+
+    return {info.start, size, qMax(size, info.capacity)};
+}
+
+qint64 DVirtualImageFileIOPrivate::entrySize(const FileInfo &info)
+{
+    qint64 size = info.end - info.start;
+
+    for (const Extent &extent : info.extents)
+        size += extent.size;
+
+    return size;
+}
+
+void DVirtualImageFileIOPrivate::resizeEntry(FileInfo &info, qint64 size)
+{
+    if (info.extents.isEmpty()) {
+        info.end = info.start + size;
+
+        return;
+    }
+
+    // the last extent takes the rest, the others keep their data
+    qint64 left = size;
+
+    info.end = info.start + qMin(left, info.end - info.start);
+    left -= info.end - info.start;
+
+    for (int i = 0; i < info.extents.count(); ++i) {
+        Extent &extent = info.extents[i];
+
+        extent.size = i == info.extents.count() - 1 ? left : qMin(left, extent.size);
+        extent.capacity = qMax(extent.capacity, extent.size);
+        left -= extent.size;
+    }
+
+    while (!info.extents.isEmpty() && info.extents.last().size == 0)
+        info.extents.removeLast();
+}
+
+void DVirtualImageFileIOPrivate::trimEntry(FileInfo &info)
+{
+    info.capacity = 0;
+
+    for (Extent &extent : info.extents)
+        extent.capacity = extent.size;
+}
+
+qint64 DVirtualImageFileIOPrivate::allocationEnd(const QHash<QString, FileInfo> &map)
+{
+    qint64 end = V2_HEAD_SIZE;
+
+    for (const FileInfo &info : map) {
+        for (int i = 0; i < extentCount(info); ++i) {
+            const Extent &e = extent(info, i);
+
+            end = qMax(end, e.offset + qMax(e.size, e.capacity));
+        }
+    }
+
+    return end;
+}
+
+qint64 DVirtualImageFileIOPrivate::allocationStart(const QHash<QString, FileInfo> &map)
+{
+    const qint64 end = allocationEnd(map);
+
+    if (!Global::directIO)
+        return end;
+
+    return (end + DIRECT_IO_ALIGNMENT - 1) / DIRECT_IO_ALIGNMENT * DIRECT_IO_ALIGNMENT;
+}
+
+qint64 DVirtualImageFileIOPrivate::readEntry(const FileInfo &info, char *data, qint64 maxlen, qint64 pos)
+{
+    qint64 size = 0;
+    qint64 extent_pos = 0;
+
+    for (int i = 0; i < extentCount(info) && size < maxlen; ++i) {
+        const Extent &e = extent(info, i);
+
+        if (pos + size < extent_pos + e.size) {
+            const qint64 offset = pos + size - extent_pos;
+            const qint64 read_size = qMin(maxlen - size, e.size - offset);
+            const qint64 ret = readAt(data + size, read_size, e.offset + offset);
+
+            if (ret < 0)
+                return size > 0 ? size : -1;
+
+            size += ret;
+
+            if (ret < read_size)
+                break;
+        }
+
+        extent_pos += e.size;
+    }
+
+    return size;
+}
+
+qint64 DVirtualImageFileIOPrivate::writeEntry(FileInfo &info, const char *data, qint64 len, qint64 pos)
+{
+    qint64 size = 0;
+    qint64 extent_pos = 0;
+    const int count = extentCount(info);
+
+    for (int i = 0; i < count && size < len; ++i) {
+        const Extent &e = extent(info, i);
+        // only the last extent has space left, the others are full
+        const qint64 limit = i == count - 1 ? e.capacity : e.size;
+
+        if (pos + size < extent_pos + limit) {
+            const qint64 offset = pos + size - extent_pos;
+            const qint64 write_size = qMin(len - size, limit - offset);
+
+            if (writeAt(data + size, write_size, e.offset + offset) != write_size)
+                return -1;
+
+            size += write_size;
+
+            if (offset + write_size > e.size) {
+                if (i == 0)
+                    info.end = info.start + offset + write_size;
+                else
+                    info.extents[i - 1].size = offset + write_size;
+            }
+        }
+
+        extent_pos += e.size;
+    }
+
+    return size;
+}
+
+bool DVirtualImageFileIOPrivate::growEntry(const QString &fileName, qint64 size)
+{
+    auto grow = [&] (QHash<QString, FileInfo> &map) {
+        FileInfo &info = map[fileName];
+        const int last = extentCount(info) - 1;
+        const Extent &e = extent(info, last);
+        qint64 capacity = 0;
+
+        for (int i = 0; i < last; ++i)
+            capacity += extent(info, i).size;
+
+        if (capacity + e.capacity >= size)
+            return;
+
+        const qint64 grow_size = qMax(EXTENT_SIZE, size - capacity - e.capacity);
+
+        // an empty entry moves to the end instead
+        if (last == 0 && e.size == 0 && e.offset != allocationEnd(map)) {
+            info.start = allocationStart(map);
+            info.end = info.start;
+            info.capacity = grow_size;
+
+            return;
+        }
+
+        // nothing follows the entry, its data stays contiguous
+        if (e.offset + e.capacity == allocationEnd(map)) {
+            if (last == 0)
+                info.capacity = e.capacity + grow_size;
+            else
+                info.extents[last - 1].capacity += grow_size;
+
+            return;
+        }
+
+        // the unused space of the last extent becomes a part of the entry
+        if (last == 0)
+            info.end = info.start + e.capacity;
+        else
+            info.extents[last - 1].size = e.capacity;
+
+        info.extents.append({allocationStart(map), 0, grow_size});
+
+        dCDebug("Add an extent to \"%s\", offset: %lld, size: %lld", qPrintable(fileName), info.extents.last().offset, grow_size);
+    };
+
+    if (!fileMap.contains(fileName))
+        return false;
+
+    bool ok = true;
+
+    // under the session lock, no other writer allocates before the table has moved
+    auto grow_in_session = [&] (QHash<QString, FileInfo> &map) {
+        grow(map);
+        ok = keepSessionTail(map);
+    };
+
+    if (!syncSession(fileName, grow_in_session))
+        grow(fileMap);
+
+    return ok;
+}
+
+static bool statFile(const QString &fileName, struct stat *st)
+{
+    return ::stat(QFile::encodeName(fileName).constData(), st) == 0;
+}
+
+static qint64 mtimeOf(const struct stat &st)
+{
+    return qint64(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec;
+}
+
+bool DVirtualImageFileIOPrivate::loadMetaData()
+{
+    struct stat st;
+
+    if (!statFile(file.fileName(), &st) || st.st_size <= 0)
+        return false;
+
+    // the entries of a session are newer than the cached tail
+    if (inSession())
+        return false;
+
+    const QString &key = sessionKey();
+    QMutexLocker locker(&metaDataLock);
+
+    auto it = metaDataCache.constFind(key);
+
+    if (it == metaDataCache.constEnd())
+        return false;
+
+    if (it->device != st.st_dev || it->inode != st.st_ino || it->mtime != mtimeOf(st) || it->size != st.st_size) {
+        dCDebug("The dim file \"%s\" has been changed, read it again", qPrintable(key));
+        metaDataCache.erase(metaDataCache.find(key));
+
+        return false;
+    }
+
+    version = it->version;
+    flags = it->flags;
+    fileMap = it->fileMap;
+
+    return true;
+}
+
+void DVirtualImageFileIOPrivate::cacheMetaData()
+{
+    struct stat st;
+
+    if (!statFile(file.fileName(), &st)) {
+        dropMetaData();
+
+        return;
+    }
+
+    MetaData data;
+
+    data.device = st.st_dev;
+    data.inode = st.st_ino;
+    data.mtime = mtimeOf(st);
+    data.size = st.st_size;
+    data.version = version;
+    data.flags = flags;
+    data.fileMap = fileMap;
+
+    // the allocated space only belongs to the writer of this instance
+    for (FileInfo &info : data.fileMap)
+        trimEntry(info);
+
+    QMutexLocker locker(&metaDataLock);
+
+    metaDataCache[sessionKey()] = data;
+}
+
+void DVirtualImageFileIOPrivate::dropMetaData()
+{
+    QMutexLocker locker(&metaDataLock);
+
+    metaDataCache.remove(sessionKey());
+}
+
+bool DVirtualImageFileIO::readHead()
+{
+    if (d->file.size() < V1_META_DATA_SIZE) {
+        dCError("Not a valid dim file: %s", qPrintable(d->file.fileName()));
+
+        return false;
+    }
+
+    QDataStream stream(&d->file);
+
+    stream.setVersion(QDataStream::Qt_5_6);
+
+    quint8 file_count;
+
+    stream >> file_count;
+
+    if (d->file.size() < 3 + file_count * 80) {
+        dCError("Not a valid dim file");
+
+        return false;
+    }
+
+    d->fileMap.clear();
+
+    for (quint8 i = 0; i < file_count; ++i) {
+        if (getData<quint8>(stream) != 0xdd) {
+            dCError("The %lldth character should be 0xdd", d->file.pos());
+
+            return false;
+        }
+
+        DVirtualImageFileIOPrivate::FileInfo info;
+
+        info.name = QString::fromUtf8(d->file.read(FILE_NAME_LENGTH));
+        info.index = i;
+
+        stream >> info.start;
+        stream >> info.end;
+
+        d->fileMap[info.name] = info;
+    }
+
+    const QByteArray &md5 = d->file.read(16);
+
+    if (!Global::disableMD5CheckForDimFile && md5 != md5sum()) {
+        dCError("MD5 check failed, file: %s, Is the file open in other application?", qPrintable(d->file.fileName()));
+
+        return false;
+    }
+
+    return true;
+}
+
+bool DVirtualImageFileIO::readTail()
+{
+    const qint64 file_size = d->file.size();
+
+    if (!d->file.seek(file_size - V2_TRAILER_SIZE)) {
+        dCError("Failed to seek to the trailer, error: %s", qPrintable(d->file.errorString()));
+
+        return false;
+    }
+
+    QDataStream stream(&d->file);
+
+    stream.setVersion(QDataStream::Qt_5_6);
+
+    quint64 magic = 0;
+    quint32 file_count = 0;
+    quint32 flags = 0;
+    qint64 table_offset = 0;
+    qint64 table_size = 0;
+
+    stream >> magic >> file_count >> flags >> table_offset >> table_size;
+
+    const QByteArray &md5 = d->file.read(16);
+
+    if (magic != V2_TRAILER_MAGIC || table_offset < V2_HEAD_SIZE || table_size < 0
+            || table_offset + table_size > file_size - V2_TRAILER_SIZE) {
+        dCError("Not a valid dim file, the trailer is broken: %s", qPrintable(d->file.fileName()));
+
+        return false;
+    }
+
+    if (!d->file.seek(table_offset))
+        return false;
+
+    const QByteArray &table = d->file.read(table_size);
+    QDataStream table_stream(table);
+
+    table_stream.setVersion(QDataStream::Qt_5_6);
+    d->fileMap.clear();
+    d->flags = flags;
+
+    for (quint32 i = 0; i < file_count; ++i) {
+        DVirtualImageFileIOPrivate::FileInfo info;
+
+        info.index = i;
+        table_stream >> info.name >> info.start >> info.end >> info.attributes;
+
+        if (flags & EntryDigestFlag)
+            table_stream >> info.digest;
+
+        bool extents_ok = true;
+
+        if (flags & EntryExtentFlag) {
+            quint32 extent_count = 0;
+
+            table_stream >> extent_count;
+
+            for (quint32 j = 0; j < extent_count && table_stream.status() == QDataStream::Ok; ++j) {
+                DVirtualImageFileIOPrivate::Extent extent;
+
+                table_stream >> extent.offset >> extent.size;
+                extent.capacity = extent.size;
+                extents_ok = extents_ok && extent.offset >= V2_HEAD_SIZE && extent.size >= 0
+                        && extent.offset + extent.size <= table_offset;
+                info.extents.append(extent);
+            }
+        }
+
+        if (table_stream.status() != QDataStream::Ok || !extents_ok || info.start < V2_HEAD_SIZE
+                || info.end < info.start || info.end > table_offset) {
+            dCError("Not a valid dim file, the entry %u is broken", i);
+
+            d->fileMap.clear();
+
+            return false;
+        }
+
+        d->fileMap[info.name] = info;
+    }
+
+    if (!Global::disableMD5CheckForDimFile && md5 != md5sum()) {
+        dCError("MD5 check failed, file: %s, Is the file open in other application?", qPrintable(d->file.fileName()));
+
+        return false;
+    }
+
+    return true;
+}
+
+bool DVirtualImageFileIO::saveTail(const QString &fileName)
+{
+    // the table of a session is written by commit()
+    if (d->syncSession(fileName))
+        return true;
+
+    return writeTail();
+}
+
+bool DVirtualImageFileIO::writeTail()
+{
+    d->prepareTable(d->fileMap, d->flags);
+
+    const qint64 tail_size = d->entryTable().size() + V2_TRAILER_SIZE;
+    // after the file data, at the end of the file if it was resized for the data
+    const qint64 table_offset = qMax(dataOffset() + fileDataSize(), d->file.size() - tail_size);
+
+    if (!d->writeTable(d->fileMap, d->flags, table_offset)) {
+        d->dropMetaData();
+
+        return false;
+    }
+
+    if (d->file.size() > table_offset + tail_size && !d->file.resize(table_offset + tail_size)) {
+        d->dropMetaData();
+
+        return false;
+    }
+
+    // the next instances take the new table without reading it back
+    if (d->file.flush())
+        d->cacheMetaData();
+    else
+        d->dropMetaData();
+
+    return true;
+}
+
+void DVirtualImageFileIOPrivate::prepareTable(QHash<QString, FileInfo> &map, quint32 &flags)
+{
+    // the files written before the digests were added are upgraded, every entry is sampled once
+    for (FileInfo &info : map) {
+        if (info.digest.isEmpty())
+            info.digest = entryDigest(info);
+    }
+
+    flags |= EntryDigestFlag;
+    flags &= ~EntryExtentFlag;
+
+    for (const FileInfo &info : map) {
+        if (!info.extents.isEmpty())
+            flags |= EntryExtentFlag;
+    }
+}
+
+bool DVirtualImageFileIOPrivate::writeTable(const QHash<QString, FileInfo> &map, quint32 flags, qint64 offset)
+{
+    const QByteArray &table = entryTable(map, flags);
+    const QByteArray &md5 = QCryptographicHash::hash(table, QCryptographicHash::Md5);
+
+    QByteArray trailer;
+    QDataStream stream(&trailer, QIODevice::WriteOnly);
+
+    stream.setVersion(QDataStream::Qt_5_6);
+    stream << V2_TRAILER_MAGIC << quint32(map.count()) << flags << offset << qint64(table.size());
+    trailer.append(md5);
+    trailer.append(V2_TRAILER_SIZE - trailer.size(), 0);
+
+    const QByteArray &tail = table + trailer;
+
+    // the table and the trailer in one write, the trailer is only valid with its table
+    if (pwriteFully(file.handle(), tail.constData(), tail.size(), offset) != tail.size()) {
+        dCError("Failed to write the entry table of \"%s\" at %lld, error: %s", qPrintable(file.fileName()), offset, strerror(errno));
+
+        return false;
+    }
+
+    return true;
+}
@@ -7,6 +7,7 @@
 #define DVIRTUALIMAGEFILEIO_H
 
 #include <QHash>
+#include <QVariantMap>
 #include <QExplicitlySharedDataPointer>
 #include <QFile>
 
@@ -44,17 +45,37 @@ public:
     bool rename(const QString &from, const QString &to);
     bool isWritable(const QString &fileName);
 
-    static int maxFileCount();
-    static qint64 metaDataSize();
+    int maxFileCount() const;
+    // the size of the head, plus the entry table and the trailer for the version 2 files
+    qint64 metaDataSize() const;
     qint64 validMetaDataSize() const;
+    // the offset of the first file data
+    qint64 dataOffset() const;
     qint64 fileDataSize() const;
     qint64 writableDataSize() const;
     QStringList fileList() const;
 
+    int version() const;
+    // codec, block size, hash and uncompressed size of the files, only the version 2 files have attributes
+    QVariantMap attributes(const QString &fileName) const;
+    bool setAttributes(const QString &fileName, const QVariantMap &attributes);
+
+    // A write session keeps the entry table in memory for all the instances of the file, the
+    // table and the checksum are written once by commit(). Only the version 2 files have sessions.
+    // Several writers may join a session and fill their entries at once, the table is written
+    // when the last of them commits.
+    bool beginSession();
+    bool commit();
+    bool inSession() const;
+
     static bool updateMD5sum(const QString &fileName);
 
 private:
     bool addFile(const QString &name);
+    bool readHead();
+    bool readTail();
+    bool writeTail();
+    bool saveTail(const QString &fileName = QString());
     QByteArray md5sum(bool readCache = true);
     bool updateMD5sum();
 
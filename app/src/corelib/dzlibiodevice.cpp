@@ -8,13 +8,146 @@
 #undef private
 
 #include "dzlibiodevice.h"
+#include "dblockcodec.h"
 #include "../dglobal.h"
+#include "helper.h"
 
 #include <QDataStream>
 #include <QFile>
 #include <QDebug>
+#include <QThreadPool>
+#include <QtConcurrent/QtConcurrent>
 
+#include <cmath>
+
+// header only, the hash functions are inlined
+#define XXH_INLINE_ALL
+#include <xxhash.h>
+
+// the block size of the version 1 streams
 #define BLOCK_SIZE 1024 * 1024
+#define MIN_BLOCK_SIZE 256 * 1024
+#define MAX_BLOCK_SIZE 16 * 1024 * 1024
+// upper bound of the block data held by the compression queue, raw and compressed
+#define MAX_QUEUED_DATA_SIZE 256 * 1024 * 1024
+
+// Version 1 streams: a 20 bytes header(size, block count, last block size), then the blocks,
+// each one prefixed by its qCompress size, or by 0 for a raw block.
+#define V1_HEADER_SIZE 20
+// Version 2 streams: a 64 bytes header starting with the magic number, followed by the codec
+// and the block size, then the blocks, each one prefixed by a frame header(stored size, type, size).
+// The first byte of the magic number has the high bit set, a version 1 stream never starts with it.
+#define STREAM_MAGIC 0xdd7a6962
+#define STREAM_VERSION 2
+#define V2_HEADER_SIZE 64
+
+enum StreamFlag {
+    // the device offsets of the blocks are stored after the last block
+    BlockIndexFlag = 0x01,
+    // written to a pipe, the size and the block count are unknown, the data ends with an EndFrame
+    SequentialFlag = 0x02,
+    // the hashes of the blocks are stored after the block index
+    HashTreeFlag = 0x04,
+    // every frame header ends with the CRC32C of the stored data
+    BlockChecksumFlag = 0x08
+};
+
+// XXH3 128 bits, several times faster than the copy of the block
+#define BLOCK_HASH_SIZE 16
+
+// the probe reads PROBE_SAMPLE_COUNT samples of PROBE_SAMPLE_SIZE bytes spread over the block
+#define PROBE_SAMPLE_COUNT 16
+#define PROBE_SAMPLE_SIZE 4096
+// bits per byte, random or already compressed data is close to 8
+#define PROBE_MAX_ENTROPY 7.5
+
+// estimate the byte entropy of the block from a few samples, a block with a high entropy
+// is not worth the compression time, e.g. media files, encrypted partitions or squashfs
+static bool isCompressible(const QByteArray &data)
+{
+    if (data.size() < PROBE_SAMPLE_COUNT * PROBE_SAMPLE_SIZE * 2)
+        return true;
+
+    quint32 counts[256] = {0};
+    const uchar *bytes = reinterpret_cast<const uchar*>(data.constData());
+    const int step = data.size() / PROBE_SAMPLE_COUNT;
+
+    for (int i = 0; i < PROBE_SAMPLE_COUNT; ++i) {
+        const uchar *sample = bytes + i * step;
+
+        for (int j = 0; j < PROBE_SAMPLE_SIZE; ++j)
+            ++counts[sample[j]];
+    }
+
+    const double total = PROBE_SAMPLE_COUNT * PROBE_SAMPLE_SIZE;
+    double entropy = 0;
+
+    for (quint32 count : counts) {
+        if (count == 0)
+            continue;
+
+        const double p = count / total;
+
+        entropy -= p * std::log2(p);
+    }
+
+    return entropy < PROBE_MAX_ENTROPY;
+}
+
+// a leaf of the hash tree, the root is the hash of all the leaves
+static QByteArray blockHash(const QByteArray &data)
+{
+    XXH128_canonical_t hash;
+
+    XXH128_canonicalFromHash(&hash, XXH3_128bits(data.constData(), data.size()));
+
+    return QByteArray(reinterpret_cast<const char*>(hash.digest), sizeof(hash.digest));
+}
+
+// shared by all devices, so several streams compressed at the same time do not oversubscribe the cores
+static QThreadPool *blockThreadPool()
+{
+    static QThreadPool *pool = [] {
+        QThreadPool *pool = new QThreadPool();
+
+        if (Global::compressionThreads > 0)
+            pool->setMaxThreadCount(Global::compressionThreads);
+
+        return pool;
+    }();
+
+    return pool;
+}
+
+// block size of the new streams, Global::compressionBlockSize or a size tuned for the codec
+static qint32 compressionBlockSize(DBlockCodec::Type codec, bool longMode, int threads)
+{
+    if (Global::compressionBlockSize > 0)
+        return qBound(MIN_BLOCK_SIZE, Global::compressionBlockSize, MAX_BLOCK_SIZE);
+
+    qint32 size = BLOCK_SIZE;
+
+    switch (codec) {
+    case DBlockCodec::None:
+    case DBlockCodec::Lz4:
+        // cheap per byte, larger blocks save the syscalls and frame headers
+        size = 4 * 1024 * 1024;
+        break;
+    case DBlockCodec::Zstd:
+        // better ratio with larger windows, the long mode searches far back
+        size = longMode ? MAX_BLOCK_SIZE : 4 * 1024 * 1024;
+        break;
+    default:
+        // zlib has a 32 KiB window, larger blocks do not improve the ratio
+        break;
+    }
+
+    // every thread holds up to two blocks in the queue, keep the memory bounded on many cores
+    while (size > MIN_BLOCK_SIZE && qint64(size) * threads * 4 > MAX_QUEUED_DATA_SIZE)
+        size /= 2;
+
+    return size;
+}
 
 DZlibIODevice::DZlibIODevice(QObject *parent)
     : QIODevice(parent)
@@ -40,24 +173,23 @@ void DZlibIODevice::setDevice(QIODevice *device)
     close();
 
     m_device = device;
-    m_lastBlockSize = BLOCK_SIZE;
 
-    if (device->size() > metaDataSize() && device->open(QIODevice::ReadOnly)) {
-        QDataStream stream(device);
-
-        stream.setVersion(QDataStream::Qt_5_6);
+    m_closeDevice = true;
 
-        stream >> m_size;
-        stream >> m_blockCount;
-        stream >> m_lastBlockSize;
+    // a device opened by the caller may be a pipe, its metadata can only be read once on open
+    if (!device->isOpen() && device->open(QIODevice::ReadOnly)) {
+        readMetaData();
 
         device->close();
+    } else {
+        resetMetaData();
     }
 }
 
 bool DZlibIODevice::isSequential() const
 {
-    return true;
+    // the block index makes random access possible when reading from a seekable device
+    return !isReadMode() || m_sequential;
 }
 
 bool DZlibIODevice::open(QIODevice::OpenMode mode)
@@ -71,21 +203,72 @@ bool DZlibIODevice::open(QIODevice::OpenMode mode)
     if (mode != QIODevice::WriteOnly && mode != QIODevice::ReadOnly)
         return false;
 
-    if (!m_device->open(mode))
+    // a device opened by the caller, e.g. a pipe shared by several streams, is left open on close
+    m_closeDevice = !m_device->isOpen();
+
+    if (m_closeDevice && !m_device->open(mode))
         return false;
 
-    if (!QIODevice::open(mode))
+    // the frames of a foreign stream or an unknown codec must not be taken as data
+    if (mode == QIODevice::ReadOnly && !readMetaData()) {
+        if (m_closeDevice)
+            m_device->close();
+
         return false;
+    }
 
-    if (isReadMode()) {
-        m_device->seek(metaDataSize());
-    } else if (isWriteMode() && m_device->size() < metaDataSize()) {
-        char data[metaDataSize() - m_device->size()];
+    // the data is already buffered by blocks
+    if (!QIODevice::open(mode | QIODevice::Unbuffered))
+        return false;
 
-        m_device->write(data, metaDataSize() - m_device->size());
+    m_blockHashes.clear();
+    m_rootHash.clear();
+
+    if (isReadMode()) {
+        if (!m_sequential) {
+            if ((m_flags & HashTreeFlag) && !loadBlockHashes())
+                dCWarning("Failed to load the hash tree, the blocks are not verified");
+
+            m_device->seek(m_headerSize);
+        }
+    } else if (isWriteMode()) {
+        // other data may precede the stream on a shared device, it can not go back to the header
+        m_sequential = m_device->isSequential() || !m_closeDevice;
+
+        // new data always written in the version 2 format, the header is filled in on close
+        if (!m_sequential) {
+            const QByteArray header(V2_HEADER_SIZE, 0);
+
+            m_device->write(header);
+        }
+
+        m_version = STREAM_VERSION;
+        m_headerSize = V2_HEADER_SIZE;
+        m_flags = Global::blockChecksum ? BlockChecksumFlag : 0;
         m_size = 0;
         m_blockCount = 0;
-        m_lastBlockSize = BLOCK_SIZE;
+        m_indexOffset = 0;
+        m_blockOffsets.clear();
+
+        if (Global::compressionLevel > 0) {
+            m_codec.reset(DBlockCodec::create(DBlockCodec::Type(Global::compressionCodec),
+                                              Global::compressionLevel, Global::compressionLongMode));
+        } else {
+            m_codec.reset(DBlockCodec::create(DBlockCodec::None));
+        }
+
+        m_blockSize = compressionBlockSize(m_codec->type(), Global::compressionLongMode,
+                                           blockThreadPool()->maxThreadCount());
+        m_lastBlockSize = m_blockSize;
+
+        dCDebug("Block size: %d, codec: %s", m_blockSize,
+                qPrintable(DBlockCodec::typeName(m_codec->type(), Global::compressionLongMode)));
+
+        // a pipe can not be rewound, the header goes first and the end of the data is marked by a frame
+        if (m_sequential) {
+            m_flags |= SequentialFlag;
+            writeMetaData();
+        }
     }
 
     return true;
@@ -96,29 +279,62 @@ void DZlibIODevice::close()
     if (!isOpen())
         return;
 
-    if (m_writeBuffer.isEmpty()) {
-        if (m_blockCount > 0)
-            m_lastBlockSize = BLOCK_SIZE;
-    } else {
-        m_lastBlockSize = m_writeBuffer.size();
+    if (isWriteMode()) {
+        if (!m_writeBuffer.isEmpty())
+            writeToBlock();
 
-        if (!writeToBlock())
-            m_lastBlockSize = BLOCK_SIZE;
-    }
+        if (!flushCompressedBlocks())
+            dCError("Failed to write the compressed blocks, error: %s", qPrintable(m_device->errorString()));
 
-    if (isWriteMode()) {
-        m_device->seek(0);
-        QDataStream stream(m_device);
-        stream.setVersion(QDataStream::Qt_5_6);
-        stream << m_size << m_blockCount << m_lastBlockSize;
+        // m_lastBlockSize is updated for every block written
+        if (m_blockCount == 0)
+            m_lastBlockSize = m_blockSize;
+
+        if (!m_sequential && m_blockHashes.size() == m_blockCount * BLOCK_HASH_SIZE)
+            m_rootHash = blockHash(m_blockHashes);
+
+        if (m_sequential) {
+            QDataStream stream(m_device);
+
+            stream.setVersion(QDataStream::Qt_5_6);
+            stream << qint32(0) << quint8(EndFrame) << qint32(0);
+
+            if (m_flags & BlockChecksumFlag)
+                stream << quint32(0);
+        } else {
+            writeBlockIndex();
+            writeBlockHashes();
+            writeMetaData();
+        }
     }
 
+    waitForReadAheadBlocks();
+
+    dCDebug("Copied %lld bytes through the buffers of %lld bytes data, zero blocks: %lld, uncompressed blocks: %lld",
+            m_copiedBytes, m_size, m_zeroBlocks, m_rawBlocks);
+
     m_readBuffer.clear();
+    m_readOffset = 0;
+    m_copiedBytes = 0;
+    m_zeroBlocks = 0;
+    m_rawBlocks = 0;
+    m_writeBuffer.clear();
+    m_compressedBlocks.clear();
+    m_readAheadBlocks.clear();
+    m_blockOffsets.clear();
+    m_blockHashes.clear();
     m_currentBlock = -1;
+    m_fetchedBlock = -1;
     m_size = 0;
     m_blockCount = 0;
     m_lastBlockSize = 0;
-    m_device->close();
+    m_sequential = false;
+    m_sequentialEnd = false;
+    m_readFailed = false;
+
+    if (m_closeDevice)
+        m_device->close();
+
     QIODevice::close();
 }
 
@@ -130,6 +346,52 @@ qint64 DZlibIODevice::pos() const
     return m_size - bytesAvailable();
 }
 
+bool DZlibIODevice::seek(qint64 pos)
+{
+    if (!isReadMode() || m_sequential)
+        return QIODevice::seek(pos);
+
+    if (pos > m_size || m_readFailed || !QIODevice::seek(pos))
+        return false;
+
+    if (!loadBlockIndex()) {
+        setErrorString(QObject::tr("Failed to load the block index"));
+
+        return false;
+    }
+
+    const qint64 block = m_blockSize > 0 ? pos / m_blockSize : 0;
+
+    // the current block already holds the position
+    if (block == m_currentBlock && !m_readBuffer.isEmpty()) {
+        m_readOffset = pos - block * m_blockSize;
+
+        return true;
+    }
+
+    waitForReadAheadBlocks();
+    m_readAheadBlocks.clear();
+    m_readBuffer.clear();
+    m_readOffset = 0;
+    m_currentBlock = block - 1;
+    m_fetchedBlock = block - 1;
+
+    if (block >= m_blockCount)
+        return true;
+
+    if (!m_device->seek(m_blockOffsets.at(block)))
+        return false;
+
+    readNextBlock();
+
+    if (m_readFailed)
+        return false;
+
+    m_readOffset = qMin(pos - block * m_blockSize, qint64(m_readBuffer.size()));
+
+    return true;
+}
+
 qint64 DZlibIODevice::size() const
 {
     return m_size;
@@ -137,7 +399,10 @@ qint64 DZlibIODevice::size() const
 
 bool DZlibIODevice::atEnd() const
 {
-    return (m_currentBlock >= m_blockCount - 1 || m_device->atEnd()) && m_readBuffer.isEmpty();
+    if (m_sequential)
+        return m_sequentialEnd && readBufferSize() == 0 && m_readAheadBlocks.isEmpty();
+
+    return (m_fetchedBlock >= m_blockCount - 1 || m_device->atEnd()) && readBufferSize() == 0 && m_readAheadBlocks.isEmpty();
 }
 
 qint64 DZlibIODevice::bytesAvailable() const
@@ -145,15 +410,30 @@ qint64 DZlibIODevice::bytesAvailable() const
     if (!isReadMode())
         return QIODevice::bytesAvailable();
 
+    // the block count of a pipe is unknown, only the blocks already fetched are counted
+    if (m_sequential) {
+        qint64 size = readBufferSize();
+
+        for (const ReadAheadBlock &block : m_readAheadBlocks)
+            size += block.size;
+
+        return size;
+    }
+
     if (m_currentBlock >= m_blockCount - 1)
-        return m_readBuffer.size();
+        return readBufferSize();
 
-    return m_readBuffer.size() + (m_blockCount - m_currentBlock - 2) * BLOCK_SIZE + m_lastBlockSize;
+    return readBufferSize() + (m_blockCount - m_currentBlock - 2) * m_blockSize + m_lastBlockSize;
 }
 
 qint64 DZlibIODevice::bytesToWrite() const
 {
-    return m_writeBuffer.size();
+    qint64 size = m_writeBuffer.size();
+
+    for (const CompressedBlock &block : m_compressedBlocks)
+        size += block.data.size();
+
+    return size;
 }
 
 bool DZlibIODevice::canReadLine() const
@@ -183,23 +463,55 @@ QString DZlibIODevice::errorString() const
     return QIODevice::errorString();
 }
 
-constexpr int DZlibIODevice::metaDataSize()
+int DZlibIODevice::metaDataSize() const
+{
+    return m_headerSize;
+}
+
+DBlockCodec::Type DZlibIODevice::codec() const
+{
+    return m_codec->type();
+}
+
+qint32 DZlibIODevice::blockSize() const
+{
+    return m_blockSize;
+}
+
+QByteArray DZlibIODevice::rootHash() const
+{
+    return m_rootHash;
+}
+
+qint64 DZlibIODevice::copiedBytes() const
 {
-    return 20;
+    return m_copiedBytes;
 }
 
 qint64 DZlibIODevice::readData(char *data, qint64 maxlen)
 {
     qint64 size = 0;
 
+    // the bytes before a damaged block are dropped too, the caller must not take the data as complete
+    if (m_readFailed)
+        return -1;
+
     while (size < maxlen && !atEnd()) {
-        if (m_readBuffer.isEmpty())
+        if (readBufferSize() == 0) {
             readNextBlock();
 
-        qint64 len = qMin(maxlen - size, (qint64)m_readBuffer.size());
-        memcpy(data, m_readBuffer.constData(), len);
+            if (m_readFailed)
+                return -1;
+
+            if (readBufferSize() == 0)
+                break;
+        }
+
+        qint64 len = qMin(maxlen - size, readBufferSize());
+        memcpy(data + size, m_readBuffer.constData() + m_readOffset, len);
         size += len;
-        m_readBuffer = m_readBuffer.mid(len);
+        m_readOffset += len;
+        m_copiedBytes += len;
     }
 
     return size;
@@ -207,11 +519,28 @@ qint64 DZlibIODevice::readData(char *data, qint64 maxlen)
 
 qint64 DZlibIODevice::writeData(const char *data, qint64 len)
 {
-    m_writeBuffer.append(data, len);
+    qint64 size = 0;
+
+    // the write buffer never grows beyond one block, a full block is handed over to writeToBlock()
+    while (size < len) {
+        if (m_writeBuffer.capacity() < m_blockSize)
+            m_writeBuffer.reserve(m_blockSize);
+
+        int copy_size = qMin(len - size, qint64(m_blockSize - m_writeBuffer.size()));
+
+        m_writeBuffer.append(data + size, copy_size);
+        size += copy_size;
+        m_copiedBytes += copy_size;
+
+        if (m_writeBuffer.size() < m_blockSize)
+            break;
+
+        if (!writeToBlock()) {
+            // the tasks still running reference this device
+            flushCompressedBlocks();
 
-    while (m_writeBuffer.size() >= BLOCK_SIZE) {
-        if (!writeToBlock())
             return -1;
+        }
     }
 
     return len;
@@ -219,12 +548,24 @@ qint64 DZlibIODevice::writeData(const char *data, qint64 len)
 
 QByteArray DZlibIODevice::compress(const QByteArray &data) const
 {
-    return qCompress(data, Global::compressionLevel);
+    return m_codec->compress(data);
 }
 
-QByteArray DZlibIODevice::uncompress(const QByteArray &data) const
+QByteArray DZlibIODevice::uncompress(const QByteArray &data, int size) const
 {
-    return qUncompress(data);
+    return m_codec->uncompress(data, size);
+}
+
+qint64 DZlibIODevice::readBufferSize() const
+{
+    return m_readBuffer.size() - m_readOffset;
+}
+
+void DZlibIODevice::waitForReadAheadBlocks()
+{
+    // the tasks still running reference this device
+    for (const ReadAheadBlock &block : m_readAheadBlocks)
+        block.future.waitForFinished();
 }
 
 bool DZlibIODevice::isReadMode() const
@@ -241,48 +582,495 @@ bool DZlibIODevice::isWriteMode() const
     return mode & (WriteOnly | Append);
 }
 
-void DZlibIODevice::readNextBlock()
+void DZlibIODevice::resetMetaData()
 {
-    if (m_currentBlock >= m_blockCount - 1)
+    m_version = 1;
+    m_flags = 0;
+    m_headerSize = V1_HEADER_SIZE;
+    m_blockSize = BLOCK_SIZE;
+    m_size = 0;
+    m_blockCount = 0;
+    m_lastBlockSize = BLOCK_SIZE;
+    m_indexOffset = 0;
+    m_blockOffsets.clear();
+    m_sequential = false;
+    m_sequentialEnd = false;
+    m_codec.reset(DBlockCodec::create(DBlockCodec::Zlib));
+}
+
+bool DZlibIODevice::readMetaData()
+{
+    resetMetaData();
+
+    if (!m_device->isOpen())
+        return true;
+
+    // a pipe or a shared device is read from the current position, the header of its stream is always complete
+    const bool sequential = m_device->isSequential() || !m_closeDevice;
+
+    if (!sequential) {
+        if (m_device->size() <= V1_HEADER_SIZE)
+            return true;
+
+        m_device->seek(0);
+    }
+
+    const QByteArray &header = m_device->read(sequential ? V2_HEADER_SIZE : qMin(m_device->size(), qint64(V2_HEADER_SIZE)));
+    QDataStream stream(header);
+
+    stream.setVersion(QDataStream::Qt_5_6);
+
+    quint32 magic = 0;
+
+    stream >> magic;
+
+    if (magic != STREAM_MAGIC) {
+        if (sequential) {
+            dCError("Not a valid stream, the magic number is: %x", magic);
+            setErrorString(QObject::tr("Not a valid stream"));
+
+            return false;
+        }
+
+        stream.device()->seek(0);
+        stream >> m_size;
+        stream >> m_blockCount;
+        stream >> m_lastBlockSize;
+
+        return true;
+    }
+
+    quint16 version = 0;
+    quint8 codec = 0;
+    quint8 flags = 0;
+
+    stream >> version >> codec >> flags;
+
+    if (version != STREAM_VERSION) {
+        dCError("Unsupported stream version: %d", (int)version);
+        setErrorString(QObject::tr("Unsupported stream version: %1").arg(version));
+
+        return false;
+    }
+
+    DBlockCodec *block_codec = DBlockCodec::create(DBlockCodec::Type(codec));
+
+    if (!block_codec) {
+        dCError("Unsupported codec: %d", (int)codec);
+        setErrorString(QObject::tr("Unsupported codec: %1").arg(codec));
+
+        return false;
+    }
+
+    m_version = version;
+    m_flags = flags;
+    m_headerSize = V2_HEADER_SIZE;
+    m_codec.reset(block_codec);
+
+    stream >> m_blockSize;
+    stream >> m_size;
+    stream >> m_blockCount;
+    stream >> m_lastBlockSize;
+
+    if (m_flags & BlockIndexFlag)
+        stream >> m_indexOffset;
+
+    m_sequential = sequential || (m_flags & SequentialFlag);
+
+    return true;
+}
+
+void DZlibIODevice::writeMetaData()
+{
+    QByteArray header;
+    QDataStream stream(&header, QIODevice::WriteOnly);
+
+    stream.setVersion(QDataStream::Qt_5_6);
+    stream << quint32(STREAM_MAGIC) << quint16(m_version) << quint8(m_codec->type()) << quint8(m_flags);
+    stream << m_blockSize << m_size << m_blockCount << m_lastBlockSize << m_indexOffset;
+    header.append(V2_HEADER_SIZE - header.size(), 0);
+
+    if (!m_sequential)
+        m_device->seek(0);
+
+    m_device->write(header);
+}
+
+void DZlibIODevice::writeBlockIndex()
+{
+    if (m_blockOffsets.count() != m_blockCount)
         return;
 
-    ++m_currentBlock;
+    m_indexOffset = m_device->pos();
+
+    QDataStream stream(m_device);
+
+    stream.setVersion(QDataStream::Qt_5_6);
+
+    for (qint64 offset : m_blockOffsets)
+        stream << offset;
+
+    if (stream.status() != QDataStream::Ok) {
+        dCWarning("Failed to write the block index, error: %s", qPrintable(m_device->errorString()));
+
+        m_indexOffset = 0;
+
+        return;
+    }
+
+    m_flags |= BlockIndexFlag;
+}
+
+void DZlibIODevice::writeBlockHashes()
+{
+    // right after the block index, its offset is known from the index
+    if (!(m_flags & BlockIndexFlag) || m_blockHashes.size() != m_blockCount * BLOCK_HASH_SIZE)
+        return;
+
+    if (m_device->write(m_blockHashes) != m_blockHashes.size()) {
+        dCWarning("Failed to write the hash tree, error: %s", qPrintable(m_device->errorString()));
 
-    int expectedSize = 0;
+        return;
+    }
 
+    m_flags |= HashTreeFlag;
+}
+
+bool DZlibIODevice::loadBlockHashes()
+{
+    if (!m_device->seek(m_indexOffset + m_blockCount * sizeof(qint64)))
+        return false;
+
+    m_blockHashes = m_device->read(m_blockCount * BLOCK_HASH_SIZE);
+
+    if (m_blockHashes.size() != m_blockCount * BLOCK_HASH_SIZE) {
+        m_blockHashes.clear();
+
+        return false;
+    }
+
+    m_rootHash = blockHash(m_blockHashes);
+
+    return true;
+}
+
+QByteArray DZlibIODevice::zeroBlockHash(int size)
+{
+    // almost every zero block has the block size, the hash is computed once
+    if (size != m_zeroBlockHashSize) {
+        m_zeroBlockHash = blockHash(QByteArray(size, 0));
+        m_zeroBlockHashSize = size;
+    }
+
+    return m_zeroBlockHash;
+}
+
+bool DZlibIODevice::loadBlockIndex()
+{
+    if (m_blockOffsets.count() == m_blockCount)
+        return true;
+
+    const qint64 pos = m_device->pos();
     QDataStream stream(m_device);
+
     stream.setVersion(QDataStream::Qt_5_6);
-    stream >> expectedSize;
+    m_blockOffsets.clear();
+    m_blockOffsets.reserve(m_blockCount);
+
+    if (m_indexOffset > 0) {
+        m_device->seek(m_indexOffset);
+
+        for (qint64 i = 0; i < m_blockCount; ++i) {
+            qint64 offset = 0;
+
+            stream >> offset;
+            m_blockOffsets << offset;
+        }
+    } else {
+        // no index stored, walk the frame headers once and keep the result
+        qint64 offset = m_headerSize;
+
+        for (qint64 i = 0; i < m_blockCount && m_device->seek(offset); ++i) {
+            qint32 stored_size = 0;
+
+            stream >> stored_size;
+            m_blockOffsets << offset;
+
+            if (m_version == 1) {
+                offset += sizeof(qint32) + (stored_size > 0 ? stored_size : m_blockSize);
+            } else {
+                offset += sizeof(qint32) + sizeof(quint8) + sizeof(qint32) + stored_size;
+
+                if (m_flags & BlockChecksumFlag)
+                    offset += sizeof(quint32);
+            }
+        }
+    }
+
+    m_device->seek(pos);
+
+    if (stream.status() != QDataStream::Ok || m_blockOffsets.count() != m_blockCount) {
+        dCError("Failed to load the block index, blocks: %lld, found: %d", m_blockCount, m_blockOffsets.count());
+
+        m_blockOffsets.clear();
+
+        return false;
+    }
+
+    return true;
+}
+
+void DZlibIODevice::readNextBlock()
+{
+    if (m_readFailed)
+        return;
+
+    fillReadAheadBlocks();
+
+    if (m_readAheadBlocks.isEmpty())
+        return;
+
+    const ReadAheadBlock &block = m_readAheadBlocks.dequeue();
+
+    // the block data is shared with the read buffer, it is consumed by moving m_readOffset
+    if (!block.compressed) {
+        m_readBuffer = block.data;
+    } else {
+        m_readBuffer = block.future.result();
+    }
+
+    m_readOffset = 0;
 
-    if (expectedSize <= 0) {
-        m_readBuffer.append(m_device->read(BLOCK_SIZE));
+    // the reason has been logged by the task, the current block stays before the damaged one
+    if (m_readBuffer.isEmpty() && block.size > 0) {
+        m_readFailed = true;
+        setErrorString(QObject::tr("Failed to read the block %1 at the offset %2, the data is corrupted").arg(m_currentBlock + 1).arg(block.offset));
 
         return;
     }
 
-    const QByteArray &array = m_device->read(expectedSize);
+    ++m_currentBlock;
 
-    m_readBuffer.append(uncompress(array));
+    // keep the threads busy while the caller consumes this block
+    fillReadAheadBlocks();
+}
+
+void DZlibIODevice::fillReadAheadBlocks()
+{
+    QThreadPool *pool = blockThreadPool();
+
+    while (m_readAheadBlocks.count() < pool->maxThreadCount() * 2
+           && (m_sequential ? !m_sequentialEnd : m_fetchedBlock < m_blockCount - 1 && !m_device->atEnd())) {
+        ++m_fetchedBlock;
+
+        // the device offset of the frame, named in the errors
+        const qint64 offset = m_device->pos();
+        QDataStream stream(m_device);
+        stream.setVersion(QDataStream::Qt_5_6);
+
+        qint32 stored_size = 0;
+        quint8 type = CompressedFrame;
+        qint32 size = m_blockSize;
+        quint32 crc = 0;
+
+        stream >> stored_size;
+
+        if (m_version == 1) {
+            // a raw block is only shorter than the block size at the end of the data
+            if (stored_size <= 0) {
+                type = RawFrame;
+                stored_size = m_blockSize;
+            }
+        } else {
+            stream >> type >> size;
+
+            if (m_flags & BlockChecksumFlag)
+                stream >> crc;
+        }
+
+        if (m_sequential) {
+            if (stream.status() != QDataStream::Ok) {
+                dCError("The stream ends unexpectedly");
+                setErrorString(QObject::tr("The stream ends unexpectedly"));
+            }
+
+            if (stream.status() != QDataStream::Ok || type == EndFrame) {
+                m_sequentialEnd = true;
+
+                break;
+            }
+
+            // the size of the data is only known once it has been fetched
+            m_size += size;
+            ++m_blockCount;
+        }
+
+        // empty without a hash tree
+        const QByteArray &leaf = m_blockHashes.mid(m_fetchedBlock * BLOCK_HASH_SIZE, BLOCK_HASH_SIZE);
+        const qint64 block = m_fetchedBlock;
+
+        if (type == ZeroFrame) {
+            if (!leaf.isEmpty() && leaf != zeroBlockHash(size)) {
+                dCError("The hash of the block %lld does not match, the data is corrupted", block);
+
+                m_readAheadBlocks.enqueue({QFuture<QByteArray>(), QByteArray(), false, size, offset});
+            } else {
+                m_readAheadBlocks.enqueue({QFuture<QByteArray>(), QByteArray(size, 0), false, size, offset});
+            }
+
+            continue;
+        }
+
+        const QByteArray &array = m_device->read(stored_size);
+
+        // checked before the block is uncompressed, nothing of a damaged block reaches the caller
+        if ((m_flags & BlockChecksumFlag) && Helper::crc32c(array.constData(), array.size()) != crc) {
+            dCError("The CRC32C of the block %lld at the offset %lld does not match, the data is corrupted", block, offset);
+
+            m_readAheadBlocks.enqueue({QFuture<QByteArray>(), QByteArray(), false, size, offset});
+
+            continue;
+        }
+
+        if (type == RawFrame && leaf.isEmpty()) {
+            m_readAheadBlocks.enqueue({QFuture<QByteArray>(), array, false, array.size(), offset});
+
+            continue;
+        }
+
+        // the leaves are checked on the thread pool too, verifying costs no more time than uncompressing
+        m_readAheadBlocks.enqueue({QtConcurrent::run(pool, [this, array, size, type, leaf, block] {
+            const QByteArray &data = type == RawFrame ? array : uncompress(array, size);
+
+            if (data.isEmpty()) {
+                dCError("Failed to uncompress the block %lld, codec: %s", block, qPrintable(DBlockCodec::typeName(m_codec->type())));
+
+                return QByteArray();
+            }
+
+            if (!leaf.isEmpty() && blockHash(data) != leaf) {
+                dCError("The hash of the block %lld does not match, the data is corrupted", block);
+
+                return QByteArray();
+            }
+
+            return data;
+        }), QByteArray(), true, type == RawFrame ? array.size() : size, offset});
+    }
 }
 
 bool DZlibIODevice::writeToBlock()
 {
-    const QByteArray &data = m_writeBuffer.left(BLOCK_SIZE);
-    const QByteArray &compress_data = Global::compressionLevel > 0 ? compress(data) : data;
+    QByteArray data;
+
+    // the block is handed over as is, writeData() reserves a new buffer for the next one
+    data.swap(m_writeBuffer);
+
+    // only the size of a zero filled block is stored
+    bool zero = Helper::isZeroData(data.constData(), data.size());
+
+    if (zero)
+        ++m_zeroBlocks;
+
+    if (zero && m_compressedBlocks.isEmpty())
+        return writeBlockData(QByteArray(), data.size(), ZeroFrame, m_sequential ? QByteArray() : zeroBlockHash(data.size()));
+
+    // compressed and hashed out of order on the thread pool, written back in order by flushCompressedBlock()
+    QThreadPool *pool = blockThreadPool();
+    CompressedBlock block {QFuture<QByteArray>(), QFuture<QByteArray>(), data, zero};
+
+    if (!zero) {
+        // a pipe has no room for the leaves after its blocks, nothing would verify them
+        if (!m_sequential)
+            block.hash = QtConcurrent::run(pool, blockHash, data);
+
+        if (m_codec->type() != DBlockCodec::None) {
+            block.future = QtConcurrent::run(pool, [this, data] {
+                // an empty result makes flushCompressedBlock() store the block raw
+                if (!isCompressible(data))
+                    return QByteArray();
+
+                return compress(data);
+            });
+        }
+    }
+
+    m_compressedBlocks.enqueue(block);
+
+    while (m_compressedBlocks.count() > pool->maxThreadCount() * 2) {
+        if (!flushCompressedBlock())
+            return false;
+    }
+
+    return true;
+}
+
+bool DZlibIODevice::writeBlockData(const QByteArray &data, int size, FrameType type, const QByteArray &hash)
+{
+    m_blockOffsets << m_device->pos();
+    m_blockHashes.append(hash);
+
     QDataStream stream(m_device);
     stream.setVersion(QDataStream::Qt_5_6);
-    stream << (Global::compressionLevel > 0 ? compress_data.size() : int(0));
-    qint64 write_size = m_device->write(compress_data);
+    stream << qint32(data.size()) << quint8(type) << qint32(size);
+
+    if (m_flags & BlockChecksumFlag)
+        stream << Helper::crc32c(data.constData(), data.size());
+
+    qint64 write_size = m_device->write(data);
 
-    if (write_size != compress_data.size()) {
+    if (write_size != data.size()) {
         return false;
     }
 
     ++m_currentBlock;
     ++m_blockCount;
-    m_size += data.size();
-    emit bytesWritten(data.size());
-    m_writeBuffer = m_writeBuffer.mid(data.size());
+    m_size += size;
+    m_lastBlockSize = size;
+    emit bytesWritten(size);
 
     return true;
 }
+
+bool DZlibIODevice::flushCompressedBlock()
+{
+    CompressedBlock block = m_compressedBlocks.dequeue();
+
+    if (block.zero)
+        return writeBlockData(QByteArray(), block.data.size(), ZeroFrame, m_sequential ? QByteArray() : zeroBlockHash(block.data.size()));
+
+    const QByteArray &hash = m_sequential ? QByteArray() : block.hash.result();
+
+    if (m_codec->type() == DBlockCodec::None)
+        return writeBlockData(block.data, block.data.size(), RawFrame, hash);
+
+    const QByteArray &compressed_data = block.future.result();
+
+    // store the block as is if it was skipped by the probe, the codec failed or did not gain anything
+    if (compressed_data.isEmpty() || compressed_data.size() >= block.data.size()) {
+        ++m_rawBlocks;
+
+        return writeBlockData(block.data, block.data.size(), RawFrame, hash);
+    }
+
+    return writeBlockData(compressed_data, block.data.size(), CompressedFrame, hash);
+}
+
+bool DZlibIODevice::flushCompressedBlocks()
+{
+    bool ok = true;
+
+    // always wait for every task, they reference this device
+    while (!m_compressedBlocks.isEmpty()) {
+        if (ok) {
+            ok = flushCompressedBlock();
+        } else {
+            CompressedBlock block = m_compressedBlocks.dequeue();
+
+            block.future.waitForFinished();
+            block.hash.waitForFinished();
+        }
+    }
+
+    return ok;
+}
@@ -6,7 +6,13 @@
 #ifndef DZLIBIODEVICE_H
 #define DZLIBIODEVICE_H
 
+#include "dblockcodec.h"
+
 #include <QIODevice>
+#include <QFuture>
+#include <QQueue>
+#include <QVector>
+#include <QScopedPointer>
 
 class DZlibIODevice : public QIODevice
 {
@@ -25,6 +31,7 @@ public:
     void close() Q_DECL_OVERRIDE;
 
     qint64 pos() const Q_DECL_OVERRIDE;
+    bool seek(qint64 pos) Q_DECL_OVERRIDE;
     qint64 size() const Q_DECL_OVERRIDE;
     bool atEnd() const Q_DECL_OVERRIDE;
 
@@ -38,29 +45,108 @@ public:
 
     QString errorString() const;
 
-    static constexpr int metaDataSize();
+    int metaDataSize() const;
+    DBlockCodec::Type codec() const;
+    qint32 blockSize() const;
+    // the root of the hash tree of the stream read, or of the last stream written, empty without a tree
+    QByteArray rootHash() const;
+    // bytes copied between the caller and the block buffers since the device was opened
+    qint64 copiedBytes() const;
 
 protected:
     qint64 readData(char *data, qint64 maxlen)  Q_DECL_OVERRIDE;
     qint64 writeData(const char *data, qint64 len)  Q_DECL_OVERRIDE;
 
     QByteArray compress(const QByteArray &data) const;
-    QByteArray uncompress(const QByteArray &data) const;
+    QByteArray uncompress(const QByteArray &data, int size) const;
 
 private:
+    enum FrameType {
+        RawFrame = 0,
+        CompressedFrame = 1,
+        // a block filled with zero, no data stored
+        ZeroFrame = 2,
+        // the end of a sequential stream
+        EndFrame = 3
+    };
+
+    qint64 readBufferSize() const;
     bool isReadMode() const;
     bool isWriteMode() const;
+    void resetMetaData();
+    // false if the stream can not be read, e.g. a pipe without a stream header, or a version or codec this version does not know
+    bool readMetaData();
+    void writeMetaData();
+    void writeBlockIndex();
+    bool loadBlockIndex();
+    void writeBlockHashes();
+    bool loadBlockHashes();
+    QByteArray zeroBlockHash(int size);
+    void waitForReadAheadBlocks();
     void readNextBlock();
+    void fillReadAheadBlocks();
     bool writeToBlock();
+    bool writeBlockData(const QByteArray &data, int size, FrameType type, const QByteArray &hash);
+    bool flushCompressedBlock();
+    bool flushCompressedBlocks();
+
+    struct CompressedBlock {
+        QFuture<QByteArray> future;
+        // the leaf of the hash tree, computed next to the compression
+        QFuture<QByteArray> hash;
+        QByteArray data;
+        bool zero;
+    };
+
+    struct ReadAheadBlock {
+        QFuture<QByteArray> future;
+        QByteArray data;
+        bool compressed;
+        int size;
+        // of the frame in the device
+        qint64 offset;
+    };
 
     QIODevice *m_device;
+    QScopedPointer<DBlockCodec> m_codec;
+    // the current uncompressed block, the bytes before m_readOffset are already read
     QByteArray m_readBuffer;
+    qint64 m_readOffset = 0;
+    // at most one block, filled in place
     QByteArray m_writeBuffer;
+    // bytes copied between the caller and the block buffers, logged on close
+    qint64 m_copiedBytes = 0;
+    qint64 m_zeroBlocks = 0;
+    // blocks stored raw with compression enabled
+    qint64 m_rawBlocks = 0;
+    // blocks handed to the compression threads, written back in order
+    QQueue<CompressedBlock> m_compressedBlocks;
+    // blocks already read from the device, uncompressed on the thread pool ahead of the reader
+    QQueue<ReadAheadBlock> m_readAheadBlocks;
     qint64 m_currentBlock = -1;
-
+    qint64 m_fetchedBlock = -1;
+    // device offsets of the frame headers, written on close or rebuilt on the first seek
+    QVector<qint64> m_blockOffsets;
+    // the leaves of the hash tree, one hash of the uncompressed data per block, stored after the block index
+    QByteArray m_blockHashes;
+    QByteArray m_rootHash;
+    QByteArray m_zeroBlockHash;
+    int m_zeroBlockHashSize = -1;
+
+    quint16 m_version = 1;
+    quint8 m_flags = 0;
+    int m_headerSize = 0;
+    qint32 m_blockSize = 0;
     qint64 m_size = 0;
     qint64 m_blockCount = 0;
     qint32 m_lastBlockSize = 0;
+    qint64 m_indexOffset = 0;
+    // reading from or writing to a pipe
+    bool m_sequential = false;
+    bool m_sequentialEnd = false;
+    // a block failed its checks, nothing past it is read until the device is closed
+    bool m_readFailed = false;
+    bool m_closeDevice = true;
 };
 
 #endif // DZLIBIODEVICE_H
@@ -9,6 +9,11 @@
 #include "ddevicepartinfo.h"
 #include "ddiskinfo.h"
 #include "dzlibfile.h"
+#include "dstreamdiskinfo.h"
+#include "dvirtualimagefileio.h"
+#include "dpipeprocess.h"
+#include "dpartitiontable.h"
+#include "ddevicetopology.h"
 
 #include <QProcess>
 #include <QEventLoop>
@@ -21,11 +26,23 @@
 #include <QRegularExpression>
 #include <QUuid>
 
-#define COMMAND_LSBLK QStringLiteral("/bin/lsblk")
-#define COMMAND_LSBLK_ARGS {"-J", "-b", "-p", "-o", "NAME,KNAME,PKNAME,FSTYPE,MOUNTPOINT,LABEL,UUID,SIZE,TYPE,PARTTYPE,PARTLABEL,PARTUUID,MODEL,PHY-SEC,RO,RM,TRAN,SERIAL"}
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
-QByteArray Helper::m_processStandardError;
-QByteArray Helper::m_processStandardOutput;
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#elif defined(__aarch64__)
+#include <arm_acle.h>
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#endif
+
+// the time a timed out process has to exit after SIGTERM
+#define PROCESS_TERMINATE_TIMEOUT 3000
+
+thread_local QByteArray Helper::m_processStandardError;
+thread_local QByteArray Helper::m_processStandardOutput;
 
 Q_LOGGING_CATEGORY(lcDeepinGhost, "deepin.ghost")
 Q_LOGGING_CATEGORY(lcFormat, "deepin.clone.format")
@@ -97,13 +114,22 @@ int Helper::processExec(QProcess *process, const QString &program, QStringList a
         dCDebug("The \"%s\" timeout, timeout: %d", qPrintable(command), timeout);
 
         // QT Bug，某种情况下(未知) QProcess::state 返回的状态有误，导致进程已退出却未能正确获取到其当前状态
-        // 因此,额外通过系统文件判断进程是否还存在
-        if (QFile::exists(QString("/proc/%1").arg(process->pid()))) {
+        // 因此通过 pidfd 等待进程退出，进程退出后立即返回
+        const pid_t pid = process->pid();
+
+        if (!DPipeProcess::waitForExit(pid, 0)) {
             process->terminate();
-            process->waitForFinished();
+
+            if (!DPipeProcess::waitForExit(pid, PROCESS_TERMINATE_TIMEOUT)) {
+                process->kill();
+                DPipeProcess::waitForExit(pid, -1);
+            }
         } else {
-            dCDebug("The \"%s\" is quit, but the QProcess object state is not NotRunning");
+            dCDebug("The \"%s\" is quit, but the QProcess object state is not NotRunning", qPrintable(command));
         }
+
+        // the exit is already known, this only collects the exit status
+        process->waitForFinished(PROCESS_TERMINATE_TIMEOUT);
     }
 
     m_processStandardOutput.append(process->readAllStandardOutput());
@@ -254,6 +280,8 @@ bool Helper::refreshSystemPartList(const QString &device)
 {
     int code = device.isEmpty() ? processExec("partprobe", {}) : processExec("partprobe", {device});
 
+    DDeviceTopology::instance()->invalidate(device);
+
     if (code != 0)
         return false;
 
@@ -444,46 +472,14 @@ bool Helper::getPartitionSizeInfo(const QString &partDevice, qint64 *used, qint6
     return false;
 }
 
-QByteArray Helper::callLsblk(const QStringList &extraArg)
-{
-    QStringList args(COMMAND_LSBLK_ARGS);
-
-    if (!extraArg.isEmpty())
-        args.append(extraArg);
-
-    processExec(COMMAND_LSBLK, args);
-
-    return lastProcessStandardOutput();
-}
-
-QJsonArray Helper::getBlockDevices(const QStringList &commandExtraArg)
-{
-    const QByteArray &array = Helper::callLsblk(commandExtraArg);
-
-    QJsonParseError error;
-
-    const QJsonDocument &jd = QJsonDocument::fromJson(QString::fromUtf8(array).toUtf8(), &error);
-
-    if (error.error != QJsonParseError::NoError) {
-        dCError(error.errorString());
-    }
-
-    return jd.object().value("blockdevices").toArray();
-}
-
 QString Helper::mountPoint(const QString &device)
 {
-    const QJsonArray &array = getBlockDevices({device});
-
-    if (array.isEmpty())
-        return QString();
-
-    return array.first().toObject().value("mountpoint").toString();
+    return DDeviceTopology::instance()->device(device).value("mountpoint").toString();
 }
 
 bool Helper::isMounted(const QString &device)
 {
-    const QJsonArray &array = getBlockDevices({"-l", device});
+    const QJsonArray &array = DDeviceTopology::instance()->devices({device}, true);
 
     for (const QJsonValue &part : array) {
         const QJsonObject &obj = part.toObject();
@@ -497,7 +493,7 @@ bool Helper::isMounted(const QString &device)
 
 bool Helper::umountDevice(const QString &device)
 {
-    const QJsonArray &array = getBlockDevices({"-l", device});
+    const QJsonArray &array = DDeviceTopology::instance()->devices({device}, true);
 
     for (const QJsonValue &device : array) {
         const QJsonObject &obj = device.toObject();
@@ -513,7 +509,7 @@ bool Helper::umountDevice(const QString &device)
 
 bool Helper::tryUmountDevice(const QString &device)
 {
-    const QJsonArray &array = getBlockDevices({"-l" + device});
+    const QJsonArray &array = DDeviceTopology::instance()->devices({device}, true);
 
     for (const QJsonValue &device : array) {
         const QJsonObject &obj = device.toObject();
@@ -564,15 +560,9 @@ QString Helper::temporaryMountDevice(const QString &device, const QString &name,
 
 QString Helper::findDiskBySerialIndexNumber(const QString &serialNumber, int partIndexNumber)
 {
-    const QJsonArray &array = getBlockDevices();
-
-    for (const QJsonValue &disk : array) {
-        const QJsonObject &obj = disk.toObject();
-
-        if (obj.value("serial").toString().compare(serialNumber, Qt::CaseInsensitive) != 0) {
-            continue;
-        }
+    const QJsonObject &obj = DDeviceTopology::instance()->device(serialNumber);
 
+    if (obj.value("serial").toString().compare(serialNumber, Qt::CaseInsensitive) == 0) {
         if (partIndexNumber <= 0)
             return obj.value("name").toString();
 
@@ -592,12 +582,12 @@ QString Helper::findDiskBySerialIndexNumber(const QString &serialNumber, int par
 
 int Helper::partitionIndexNumber(const QString &partDevice)
 {
-    const QJsonArray &array = getBlockDevices({partDevice});
+    const QJsonObject &part = DDeviceTopology::instance()->device(partDevice);
 
-    if (array.isEmpty())
+    if (part.isEmpty())
         return -1;
 
-    const QJsonArray &p_array = getBlockDevices({array.first().toObject().value("pkname").toString(), "-x", "NAME"});
+    const QJsonArray &p_array = DDeviceTopology::instance()->devices({part.value("pkname").toString()}, false, true);
 
     if (p_array.isEmpty())
         return -1;
@@ -616,24 +606,36 @@ int Helper::partitionIndexNumber(const QString &partDevice)
 
 QByteArray Helper::getPartitionTable(const QString &devicePath)
 {
-    processExec("/sbin/sfdisk", {"-d", devicePath});
+    DPartitionTable table;
+
+    if (!table.read(devicePath))
+        return QByteArray();
 
-    return lastProcessStandardOutput();
+    return table.toDump();
 }
 
 bool Helper::setPartitionTable(const QString &devicePath, const QString &ptFile)
 {
-    QProcess process;
+    QFile file(ptFile);
 
-    process.setStandardInputFile(ptFile);
+    if (!file.open(QIODevice::ReadOnly)) {
+        dCError("Failed to open %s: %s", qPrintable(ptFile), qPrintable(file.errorString()));
 
-    if (processExec(&process, "/sbin/sfdisk", {devicePath}) != 0)
         return false;
+    }
 
-    int code = processExec("/sbin/partprobe", {devicePath});
-    processExec("sleep", {"1"});
+    DPartitionTable table = DPartitionTable::fromDump(file.readAll(), devicePath);
 
-    return code == 0;
+    if (!table.write(devicePath)) {
+        dCError("%s", qPrintable(table.errorString()));
+
+        return false;
+    }
+
+    // the kernel does not announce a new table with the same partitions
+    DDeviceTopology::instance()->invalidate(devicePath);
+
+    return table.updateKernel(devicePath) || refreshSystemPartList(devicePath);
 }
 
 bool Helper::saveToFile(const QString &fileName, const QByteArray &data, bool override)
@@ -656,12 +658,137 @@ bool Helper::saveToFile(const QString &fileName, const QByteArray &data, bool ov
     return size == data.size();
 }
 
+bool Helper::isZeroData(const char *data, qint64 size)
+{
+    qint64 i = 0;
+
+#ifdef __SSE2__
+    // or 64 bytes together, compare once per chunk
+    for (; i + 64 <= size; i += 64) {
+        const __m128i *p = reinterpret_cast<const __m128i*>(data + i);
+        __m128i v = _mm_or_si128(_mm_or_si128(_mm_loadu_si128(p), _mm_loadu_si128(p + 1)),
+                                 _mm_or_si128(_mm_loadu_si128(p + 2), _mm_loadu_si128(p + 3)));
+
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_setzero_si128())) != 0xffff)
+            return false;
+    }
+#endif
+
+    for (; i + 8 <= size; i += 8) {
+        quint64 word;
+
+        memcpy(&word, data + i, sizeof(word));
+
+        if (word)
+            return false;
+    }
+
+    for (; i < size; ++i) {
+        if (data[i])
+            return false;
+    }
+
+    return true;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2")))
+static quint32 crc32cHardware(const char *data, qint64 size, quint32 crc)
+{
+    quint64 crc64 = crc;
+
+    for (; size >= 8; data += 8, size -= 8) {
+        quint64 word;
+
+        memcpy(&word, data, sizeof(word));
+        crc64 = _mm_crc32_u64(crc64, word);
+    }
+
+    crc = crc64;
+
+    for (; size > 0; ++data, --size)
+        crc = _mm_crc32_u8(crc, *data);
+
+    return crc;
+}
+
+static bool haveCrc32cHardware()
+{
+    return __builtin_cpu_supports("sse4.2");
+}
+#elif defined(__aarch64__)
+__attribute__((target("+crc")))
+static quint32 crc32cHardware(const char *data, qint64 size, quint32 crc)
+{
+    for (; size >= 8; data += 8, size -= 8) {
+        quint64 word;
+
+        memcpy(&word, data, sizeof(word));
+        crc = __crc32cd(crc, word);
+    }
+
+    for (; size > 0; ++data, --size)
+        crc = __crc32cb(crc, *data);
+
+    return crc;
+}
+
+static bool haveCrc32cHardware()
+{
+    return getauxval(AT_HWCAP) & HWCAP_CRC32;
+}
+#else
+static quint32 crc32cHardware(const char *data, qint64 size, quint32 crc)
+{
+    Q_UNUSED(data)
+    Q_UNUSED(size)
+
+    return crc;
+}
+
+static bool haveCrc32cHardware()
+{
+    return false;
+}
+#endif
+
+quint32 Helper::crc32c(const char *data, qint64 size, quint32 crc)
+{
+    static const bool hardware = haveCrc32cHardware();
+
+    crc = ~crc;
+
+    if (hardware)
+        return ~crc32cHardware(data, size, crc);
+
+    // the reflected polynomial 0x1edc6f41, one table lookup per byte
+    static const QVector<quint32> table = [] {
+        QVector<quint32> table(256);
+
+        for (quint32 i = 0; i < 256; ++i) {
+            quint32 value = i;
+
+            for (int j = 0; j < 8; ++j)
+                value = (value >> 1) ^ (value & 1 ? 0x82f63b78 : 0);
+
+            table[i] = value;
+        }
+
+        return table;
+    }();
+
+    for (qint64 i = 0; i < size; ++i)
+        crc = table[(crc ^ quint8(data[i])) & 0xff] ^ (crc >> 8);
+
+    return ~crc;
+}
+
 bool Helper::isBlockSpecialFile(const QString &fileName)
 {
     if (fileName.startsWith("/dev/"))
         return true;
 
-    if (fileName.isEmpty())
+    if (fileName.isEmpty() || DStreamDiskInfo::isStreamFile(fileName))
         return false;
 
     QProcess process;
@@ -682,28 +809,22 @@ bool Helper::isPartcloneFile(const QString &fileName)
 
 bool Helper::isDiskDevice(const QString &devicePath)
 {
-    const QJsonArray &blocks = getBlockDevices({devicePath});
+    const QJsonObject &obj = DDeviceTopology::instance()->device(devicePath);
 
-    if (blocks.isEmpty())
+    if (obj.isEmpty())
         return false;
 
-    if (!blocks.first().isObject())
-        return false;
-
-    return blocks.first().toObject().value("pkname").isNull();
+    return obj.value("pkname").isNull();
 }
 
 bool Helper::isPartitionDevice(const QString &devicePath)
 {
-    const QJsonArray &blocks = getBlockDevices({devicePath});
-
-    if (blocks.isEmpty())
-        return false;
+    const QJsonObject &obj = DDeviceTopology::instance()->device(devicePath);
 
-    if (!blocks.first().isObject())
+    if (obj.isEmpty())
         return false;
 
-    return !blocks.first().toObject().value("pkname").isString();
+    return !obj.value("pkname").isString();
 }
 
 QString Helper::parentDevice(const QString &device)
@@ -711,12 +832,12 @@ QString Helper::parentDevice(const QString &device)
     if (device.isEmpty())
         return QString();
 
-    const QJsonArray &blocks = getBlockDevices({device});
+    const QJsonObject &obj = DDeviceTopology::instance()->device(device);
 
-    if (blocks.isEmpty())
+    if (obj.isEmpty())
         return device;
 
-    const QString &parent = blocks.first().toObject().value("pkname").toString();
+    const QString &parent = obj.value("pkname").toString();
 
     if (parent.isEmpty())
         return device;
@@ -1121,6 +1242,7 @@ bool Helper::readCustomFile(const QString &source, const QString &customFileName
     //write custom file content
     char data[Global::bufferSize];
     bool isWriteOK = true;
+    qint64 total_size = 0;
     while (!sourceFile.atEnd())
     {
         qint64 read_size = sourceFile.read(data, Global::bufferSize);
@@ -1131,6 +1253,19 @@ bool Helper::readCustomFile(const QString &source, const QString &customFileName
             break;
         }
 
+        total_size += read_size;
+
+        // leave a hole for the zero data, the file size is set after the loop
+        if (isZeroData(data, read_size)) {
+            if (!customFile.seek(total_size)) {
+                printf("Seeking %s failed\n", qPrintable(customFileName));
+                isWriteOK = false;
+                break;
+            }
+
+            continue;
+        }
+
         qint64 write_size = customFile.write(data, read_size);
 
         if (write_size < read_size) {
@@ -1140,6 +1275,10 @@ bool Helper::readCustomFile(const QString &source, const QString &customFileName
             break;
         }
     }
+    if (isWriteOK && customFile.size() < total_size && !customFile.resize(total_size)) {
+        printf("Resizing %s failed\n", qPrintable(customFileName));
+        isWriteOK = false;
+    }
     customFile.close();
     sourceFile.close();
     if (isWriteOK)
@@ -1147,3 +1286,58 @@ bool Helper::readCustomFile(const QString &source, const QString &customFileName
 
     return isWriteOK;
 }
+
+bool Helper::verifyDimFile(const QString &fileName)
+{
+    DVirtualImageFileIO io(fileName);
+
+    if (!io.isValid()) {
+        printf("%s is invalid file\n", qPrintable(fileName));
+        return false;
+    }
+
+    QByteArray data(Global::bufferSize, Qt::Uninitialized);
+    const QStringList &files = io.fileList();
+    int failed_count = 0;
+    int unverified_count = 0;
+
+    for (const QString &file : files) {
+        const QString &hash = io.attributes(file).value("hash").toString();
+
+        // the version 1 streams have no hash tree, nothing can tell whether their data is intact
+        if (hash.isEmpty()) {
+            printf("%s: UNVERIFIED (no hash tree)\n", qPrintable(file));
+            ++unverified_count;
+            continue;
+        }
+
+        // the blocks are uncompressed and hashed on the block thread pool while reading ahead
+        DZlibFile sourceFile(QString("dim://%1/%2").arg(fileName).arg(file));
+
+        if (!sourceFile.open(QIODevice::ReadOnly)) {
+            printf("%s: cannot open\n", qPrintable(file));
+            ++failed_count;
+            continue;
+        }
+
+        bool ok = QString::fromLatin1(sourceFile.rootHash().toHex()) == hash;
+
+        while (ok && !sourceFile.atEnd()) {
+            if (sourceFile.read(data.data(), data.size()) <= 0)
+                ok = false;
+        }
+
+        sourceFile.close();
+
+        printf("%s: %s\n", qPrintable(file), ok ? "OK" : "FAILED");
+
+        if (!ok)
+            ++failed_count;
+    }
+
+    printf("%d of %d entries verified, %d failed, %d unverified\n",
+           files.count() - failed_count - unverified_count, files.count(), failed_count, unverified_count);
+
+    // an entry that could not be checked does not pass the verification
+    return failed_count == 0 && unverified_count == 0;
+}
@@ -50,9 +50,6 @@ public:
     static QString getPartcloneExecuter(const DPartInfo &info, QStringList &args);
     static bool getPartitionSizeInfo(const QString &partDevice, qint64 *used, qint64 *free, int *blockSize);
 
-    static QByteArray callLsblk(const QStringList &extraArg = QStringList());
-    static QJsonArray getBlockDevices(const QStringList &commandExtraArg = QStringList());
-
     static QString mountPoint(const QString &device);
     static bool isMounted(const QString &device);
     static bool umountDevice(const QString &device);
@@ -67,6 +64,9 @@ public:
     static bool setPartitionTable(const QString &devicePath, const QString &ptFile);
     static bool saveToFile(const QString &fileName, const QByteArray &data, bool override = true);
     static bool isBlockSpecialFile(const QString &fileName);
+    static bool isZeroData(const char *data, qint64 size);
+    // the Castagnoli CRC, with the SSE 4.2 or the ARMv8 CRC instructions when the processor has them
+    static quint32 crc32c(const char *data, qint64 size, quint32 crc = 0);
     static bool isPartcloneFile(const QString &fileName);
     static bool isDiskDevice(const QString &devicePath);
     static bool isPartitionDevice(const QString &devicePath);
@@ -107,13 +107,21 @@ public:
      */
     static bool readCustomFile(const QString &source, const QString &customFileName);
 
+    /**
+     * @brief verifyDimFile read every file of the dim and check its blocks against the hash tree
+     * @param fileName dim file path
+     * @return successful return true, else return false
+     */
+    static bool verifyDimFile(const QString &fileName);
+
 signals:
     void newWarning(const QString &message);
     void newError(const QString &message);
 
 private:
-    static QByteArray m_processStandardOutput;
-    static QByteArray m_processStandardError;
+    // per thread, partitions may be cloned on several threads at the same time
+    static thread_local QByteArray m_processStandardOutput;
+    static thread_local QByteArray m_processStandardError;
 
     QString m_warningString;
     QString m_errorString;
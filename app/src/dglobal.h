@@ -17,7 +17,23 @@ public:
 
     static int bufferSize;
     static int compressionLevel;
+    // number of threads used to compress the dim file data, 0 means QThread::idealThreadCount()
+    static int compressionThreads;
+    // DBlockCodec::Type of the blocks written to the dim file
+    static int compressionCodec;
+    // enable the zstd long distance matching
+    static bool compressionLongMode;
+    // size of the dim file data blocks, 0 means tuned for the codec and the number of threads
+    static int compressionBlockSize;
+    // store the CRC32C of every block written to the dim file
+    static bool blockChecksum;
+    // read and write the dim file data with O_DIRECT, bypassing the page cache
+    static bool directIO;
     static int debugLevel;
+    // maximum number of partitions cloned at the same time
+    static int cloneJobs;
+    // maximum number of partition streams per device, 0 means no extra limit
+    static int deviceJobs;
 
     static bool disableMD5CheckForDimFile;
     static bool disableLoopDevice;
@@ -35,6 +35,9 @@ bool Global::isOverride = true;
 bool Global::disableMD5CheckForDimFile = false;
 bool Global::disableLoopDevice = true;
 bool Global::fixBoot = false;
+bool Global::compressionLongMode = false;
+bool Global::blockChecksum = false;
+bool Global::directIO = false;
 #ifdef ENABLE_GUI
 bool Global::isTUIMode = false;
 #else
@@ -43,7 +46,12 @@ bool Global::isTUIMode = true;
 
 int Global::bufferSize = 1024 * 1024;
 int Global::compressionLevel = 0;
+int Global::compressionThreads = 0;
+int Global::compressionCodec = 1;
+int Global::compressionBlockSize = 0;
 int Global::debugLevel = 1;
+int Global::cloneJobs = 1;
+int Global::deviceJobs = 0;
 
 #ifndef DISABLE_DTK
 DCORE_USE_NAMESPACE
@@ -15,6 +15,7 @@
 #include "../corelib/ddiskinfo.h"
 #include "../corelib/dpartinfo.h"
 #include "../corelib/ddevicepartinfo.h"
+#include "../corelib/dblockcodec.h"
 
 #include <DDesktopServices>
 #include <ddialog.h>
@@ -734,6 +735,8 @@ void MainWindow::onButtonClicked()
         arguments << source_url << target_url
                   << "-B" << QString::number(Global::bufferSize)
                   << "-C" << QString::number(Global::compressionLevel)
+                  << "--codec" << DBlockCodec::typeName(DBlockCodec::Type(Global::compressionCodec), Global::compressionLongMode)
+                  << "--block-size" << (Global::compressionBlockSize > 0 ? QString::number(Global::compressionBlockSize) : QString("auto"))
                   << "-d" << QString::number(Global::debugLevel)
                   << "--log-backup" << toSerialUrl("/var/log/deepin-clone-livesystem.log");
 
@@ -0,0 +1,149 @@
+// SPDX-FileCopyrightText: 2022 UnionTech Software Technology Co., Ltd.
+//
+// SPDX-License-Identifier: GPL-3.0-only
+
+#include <QBuffer>
+#include <QCoreApplication>
+#include <QElapsedTimer>
+#include <QTextStream>
+
+#include "../app/src/dglobal.h"
+#include "../app/src/corelib/dblockcodec.h"
+#include "../app/src/corelib/dzlibiodevice.h"
+
+bool Global::isOverride = true;
+bool Global::disableMD5CheckForDimFile = false;
+bool Global::disableLoopDevice = true;
+bool Global::fixBoot = false;
+bool Global::compressionLongMode = false;
+bool Global::blockChecksum = false;
+bool Global::directIO = false;
+bool Global::isTUIMode = true;
+
+int Global::bufferSize = 1024 * 1024;
+// the data is a short pattern, lz4 keeps the stream small enough for memory
+int Global::compressionLevel = 1;
+int Global::compressionThreads = 0;
+int Global::compressionCodec = DBlockCodec::Lz4;
+int Global::compressionBlockSize = 0;
+int Global::debugLevel = 0;
+int Global::cloneJobs = 1;
+int Global::deviceJobs = 0;
+
+static const qint64 dataSize = 1024 * 1024 * 1024;
+
+// pushes 1 GiB through DZlibIODevice by chunks of the given sizes, prints the bytes
+// the stream copied between the caller and its block buffers and the time it took
+int main(int argc, char *argv[])
+{
+    QCoreApplication a(argc, argv);
+    QTextStream out(stdout);
+    QList<int> chunk_sizes = {512, 4096, 65536, 100000, 1024 * 1024, 4 * 1024 * 1024};
+
+    if (argc > 1) {
+        chunk_sizes.clear();
+
+        for (int i = 1; i < argc; ++i) {
+            bool ok = false;
+            const int size = QByteArray(argv[i]).toInt(&ok);
+
+            if (!ok || size <= 0) {
+                QTextStream(stderr) << "Invalid chunk size: " << argv[i] << endl;
+
+                return 1;
+            }
+
+            chunk_sizes << size;
+        }
+    }
+
+    out << "mode\tchunk\tbytes\tcopied\tcopied/bytes\tms\tMiB/s" << endl;
+
+    auto print = [&out] (const char *mode, int chunk_size, qint64 bytes, qint64 copied, qint64 msecs) {
+        out << mode << '\t' << chunk_size << '\t' << bytes << '\t' << copied << '\t'
+            << QString::number(double(copied) / qMax(bytes, qint64(1)), 'f', 2) << '\t' << msecs << '\t'
+            << QString::number(bytes / 1048576.0 / qMax(msecs, qint64(1)) * 1000, 'f', 0) << endl;
+    };
+
+    for (int chunk_size : chunk_sizes) {
+        QByteArray chunk(chunk_size, Qt::Uninitialized);
+
+        // no zero byte, a zero block is not copied to the stream
+        for (int i = 0; i < chunk_size; ++i)
+            chunk[i] = char(i % 251 + 1);
+
+        QBuffer buffer;
+        QElapsedTimer timer;
+
+        {
+            DZlibIODevice device(&buffer);
+
+            if (!device.open(QIODevice::WriteOnly)) {
+                QTextStream(stderr) << "Failed to open the stream for writing: " << device.errorString() << endl;
+
+                return 1;
+            }
+
+            qint64 written = 0;
+
+            timer.start();
+
+            while (written < dataSize) {
+                const qint64 size = device.write(chunk.constData(), qMin(qint64(chunk_size), dataSize - written));
+
+                if (size <= 0) {
+                    QTextStream(stderr) << "Failed to write the stream: " << device.errorString() << endl;
+
+                    return 1;
+                }
+
+                written += size;
+            }
+
+            // the counter is cleared on close
+            const qint64 copied = device.copiedBytes();
+
+            device.close();
+            print("write", chunk_size, written, copied, timer.elapsed());
+        }
+
+        {
+            DZlibIODevice device(&buffer);
+
+            if (!device.open(QIODevice::ReadOnly)) {
+                QTextStream(stderr) << "Failed to open the stream for reading: " << device.errorString() << endl;
+
+                return 1;
+            }
+
+            qint64 read = 0;
+
+            timer.start();
+
+            while (!device.atEnd()) {
+                const qint64 size = device.read(chunk.data(), chunk_size);
+
+                if (size <= 0) {
+                    QTextStream(stderr) << "Failed to read the stream: " << device.errorString() << endl;
+
+                    return 1;
+                }
+
+                read += size;
+            }
+
+            const qint64 copied = device.copiedBytes();
+
+            device.close();
+            print("read", chunk_size, read, copied, timer.elapsed());
+
+            if (read != dataSize) {
+                QTextStream(stderr) << "Read " << read << " bytes, " << dataSize << " expected" << endl;
+
+                return 1;
+            }
+        }
+    }
+
+    return 0;
+}
@@ -17,11 +17,19 @@ bool Global::isOverride = true;
 bool Global::disableMD5CheckForDimFile = false;
 bool Global::disableLoopDevice = true;
 bool Global::fixBoot = false;
+bool Global::compressionLongMode = false;
+bool Global::blockChecksum = false;
+bool Global::directIO = false;
 bool Global::isTUIMode = false;
 
 int Global::bufferSize = 1024 * 1024;
 int Global::compressionLevel = 0;
+int Global::compressionThreads = 0;
+int Global::compressionCodec = 1;
+int Global::compressionBlockSize = 0;
 int Global::debugLevel = 1;
+int Global::cloneJobs = 1;
+int Global::deviceJobs = 0;
 
 DFM_USE_NAMESPACE
 